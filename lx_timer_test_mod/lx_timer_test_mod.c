@@ -8,11 +8,31 @@
  *
  * Rather quick-and-dirty. It is after all just a test.
  *
+ * To see whether long oversleeps go with deep CPU idle states, it
+ * watches the "cpu_idle" tracepoint and keeps its own per CPU count of
+ * entries into, and time spent in, each cpuidle state.  Those are
+ * sampled before and after each sleep, and each sleep's oversleep is
+ * attributed to the deepest idle state entered during it.  When the
+ * module is unloaded it logs a histogram of oversleep for each state.
+ *
+ * Sweep mode (sweep_mode=1 for linear, 2 for logarithmic) replaces the
+ * random durations with a fixed sequence, to map out where the timers'
+ * quantization shows: jiffy rounding in schedule_timeout_interruptible(),
+ * the timer wheel's coarser granularity at longer timeouts, and timer
+ * slack in schedule_hrtimeout().  It steps through sweep_points durations
+ * from min_wait_ns to max_wait_ns, sleeping with each primitive at each,
+ * sweep_reps times over (interleaved, so slow drift in the system affects
+ * them all alike).  Then it logs a table: for each duration & primitive,
+ * the distribution of oversleep.  It logs nothing per sleep in this mode.
+ *
  * To build and run (after installing kernel headers):
  *      make
  *      sudo insmod lx_timer_test_mod.ko
  *      # wait a while
  *      dmesg > File
+ * or for a sweep, e.g. logarithmic from 10us to 100ms:
+ *      sudo insmod lx_timer_test_mod.ko sweep_mode=2 min_wait_ns=10000 \
+ *          max_wait_ns=100000000 sweep_points=60 sweep_reps=50
  *
  * Licensed under BSD or GPL, see bottom of file.
  */
@@ -21,6 +41,20 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/kthread.h>
+#include <linux/math64.h>
+#include <linux/percpu.h>
+#include <linux/sched/clock.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+
+#if defined(CONFIG_CPU_IDLE) && defined(CONFIG_TRACEPOINTS)
+#define LX_IDLE 1
+#include <linux/cpuidle.h>
+#include <trace/events/power.h>
+#else
+#define CPUIDLE_STATE_MAX 1
+#define CPUIDLE_NAME_LEN 16
+#endif
 
 #define MY_NAME "lx_timer_test"
 
@@ -33,9 +67,22 @@ MODULE_VERSION("1");
 static u64 min_wait_ns = 0;
 static u64 max_wait_ns = 1000000000;
 static unsigned minstd_state = 1;
+static int sweep_mode = 0;
+static int sweep_points = 50;
+static int sweep_reps = 20;
+module_param(min_wait_ns, ullong, 0444);
+module_param(max_wait_ns, ullong, 0444);
+module_param(minstd_state, uint, 0444);
+module_param(sweep_mode, int, 0444);
+module_param(sweep_points, int, 0444);
+module_param(sweep_reps, int, 0444);
 MODULE_PARM_DESC(min_wait_ns, "Shortest wait time in nanoseconds");
 MODULE_PARM_DESC(max_wait_ns, "Longest wait time in nanoseconds");
 MODULE_PARM_DESC(minstd_state, "Seed for pseudorandom number generator");
+MODULE_PARM_DESC(sweep_mode,
+                 "0 random durations, 1 linear sweep, 2 logarithmic sweep");
+MODULE_PARM_DESC(sweep_points, "Number of durations in a sweep");
+MODULE_PARM_DESC(sweep_reps, "Sleeps with each primitive at each duration");
 
 /* other variables and prototypes */
 static struct task_struct *lx_timer_test_task;
@@ -44,10 +91,55 @@ static int lx_timer_test_main(void *);
 static unsigned minstd(unsigned *);
 static u64 minstd_long_range(u64, u64);
 
+/* Idle state accounting, per CPU, kept by idle_probe() */
+struct idle_track {
+    int cur;                            /* state it's in, or -1 */
+    int last;                           /* state it last left, or -1 */
+    u64 entered;                        /* local_clock() on entering it */
+    u64 usage[CPUIDLE_STATE_MAX];       /* times each state was entered */
+    u64 time_ns[CPUIDLE_STATE_MAX];     /* time spent in each state */
+};
+static DEFINE_PER_CPU(struct idle_track, idle_tracks);
+static int idle_probing;                /* is idle_probe() registered? */
+static int idle_nstates;                /* number of states known */
+static char idle_names[CPUIDLE_STATE_MAX][CPUIDLE_NAME_LEN];
+
+/* Oversleep histograms: [0] for sleeps with no idle state entered,
+ * [s + 1] for sleeps whose deepest idle state was s.  Bucket b counts
+ * oversleeps of [2^(b-1), 2^b) ns; bucket 0 is oversleep <= 0.
+ */
+#define HIST_BUCKETS 40
+static u64 idle_hist[CPUIDLE_STATE_MAX + 1][HIST_BUCKETS];
+static u64 idle_hist_residency[CPUIDLE_STATE_MAX + 1];
+static u64 idle_migrated;       /* samples that woke on another CPU */
+
+static void idle_start(void);
+static void idle_stop(void);
+static void idle_sample(int *cpu, struct idle_track *it);
+static int idle_deepest(int cpu0, struct idle_track *it0,
+                        int cpu1, struct idle_track *it1, u64 *residency);
+static void idle_report(void);
+
+/* Sweep mode: the durations, and every oversleep, [point][primitive][rep] */
+#define SWEEP_MAX_POINTS 200
+#define SWEEP_MAX_REPS 1000
+#define SWEEP_NPRIM 2                   /* values of 'whichsleep' */
+static u64 sweep_ns[SWEEP_MAX_POINTS];
+static s64 *sweep_extra;
+static int sweep_n[SWEEP_MAX_POINTS][SWEEP_NPRIM]; /* how many so far */
+static int sweep_pos;                   /* next sleep in the sequence */
+static int sweep_reported;
+
+static int sweep_start(void);
+static int sweep_next(u64 *sleepns, int *whichsleep);
+static void sweep_count(int whichsleep, s64 extra);
+static void sweep_report(void);
+
 /* is run after loading the module */
 static int __init lx_timer_test_mod_init(void)
 {
     struct task_struct *task;
+    int rv;
 
     if (max_wait_ns < min_wait_ns ||
         (max_wait_ns >> 42) > 0) {
@@ -65,10 +157,21 @@ static int __init lx_timer_test_mod_init(void)
         return(-EINVAL);
     }
 
+    /* set up the sweep, if any */
+    if (sweep_mode && (rv = sweep_start()) < 0) {
+        return(rv);
+    }
+
+    /* start watching the CPUs go idle */
+    idle_start();
+
     /* start the test thread, which does all the work */
     task = kthread_run(lx_timer_test_main, NULL, MY_NAME);
     if (IS_ERR(task)) {
         printk(KERN_ERR MY_NAME ": Failed to create lx_timer_test thread.\n");
+        idle_stop();
+        kvfree(sweep_extra);
+        sweep_extra = NULL;
         return(PTR_ERR(task));
     }
     lx_timer_test_task = task;
@@ -86,6 +189,13 @@ static void __exit lx_timer_test_mod_fini(void)
         lx_timer_test_task = NULL;
         printk(KERN_ERR "lx_timer_test_mod_fini() stopped task\n");
     }
+    idle_stop();
+    idle_report();
+    if (sweep_mode && !sweep_reported) {
+        sweep_report(); /* what there is of it */
+    }
+    kvfree(sweep_extra);
+    sweep_extra = NULL;
     printk(KERN_ERR "lx_timer_test_mod_fini() ends\n");
 }
 
@@ -97,29 +207,48 @@ static int lx_timer_test_main(void * unused)
     ktime_t sleepk, tbefore, tafter;
     int whichsleep;
     char *how;
+    int cpu0, cpu1, deepest, b;
+    u64 residency;
+    static struct idle_track it0, it1;
 
     if (kthread_should_stop()) {
         return(0);
     }
 
     for (;;) {
-        /* How long to sleep? The double random scaling is to favor low vals. */
-        sleepns = max_wait_ns;
-        sleepns = minstd_long_range(min_wait_ns, sleepns);
-        sleepns = minstd_long_range(min_wait_ns, sleepns);
+        if (sweep_mode) {
+            /* How long & which sleep: the next in the sweep */
+            if (!sweep_next(&sleepns, &whichsleep)) {
+                /* the sweep's done; report it & wait to be unloaded */
+                sweep_report();
+                while (!kthread_should_stop()) {
+                    schedule_timeout_interruptible(HZ);
+                }
+                break;
+            }
+        } else {
+            /* How long to sleep? The double random scaling is to favor
+             * low vals. */
+            sleepns = max_wait_ns;
+            sleepns = minstd_long_range(min_wait_ns, sleepns);
+            sleepns = minstd_long_range(min_wait_ns, sleepns);
 
-        /* Which sleep to use */
-        whichsleep = minstd(&minstd_state) % 2;
+            /* Which sleep to use */
+            whichsleep = minstd(&minstd_state) % 2;
+        }
 
         /* And sleep */
         switch (whichsleep) {
         case 0:
             sleepj = nsecs_to_jiffies(sleepns);
             how = "schedule_timeout_interruptible";
-            printk(KERN_INFO MY_NAME
-                   ": about to sleep %lld ns using"
-                   " schedule_timeout_interruptible(%ld)\n",
-                   (long long)sleepns, (long)sleepj);
+            if (!sweep_mode) {
+                printk(KERN_INFO MY_NAME
+                       ": about to sleep %lld ns using"
+                       " schedule_timeout_interruptible(%ld)\n",
+                       (long long)sleepns, (long)sleepj);
+            }
+            idle_sample(&cpu0, &it0);
             tbefore = ktime_get();
             schedule_timeout_interruptible(sleepj);
             break;
@@ -127,9 +256,12 @@ static int lx_timer_test_main(void * unused)
         default:
             sleepk = ns_to_ktime(sleepns);
             how = "schedule_hrtimeout";
-            printk(KERN_INFO MY_NAME
-                   ": about to sleep %lld ns using schedule_hrtimeout()\n",
-                   (long long)sleepns);
+            if (!sweep_mode) {
+                printk(KERN_INFO MY_NAME
+                       ": about to sleep %lld ns using schedule_hrtimeout()\n",
+                       (long long)sleepns);
+            }
+            idle_sample(&cpu0, &it0);
             tbefore = ktime_get();
             set_current_state(TASK_INTERRUPTIBLE);
             schedule_hrtimeout(&sleepk, HRTIMER_MODE_REL);
@@ -138,6 +270,7 @@ static int lx_timer_test_main(void * unused)
 
         /* When did that end? */
         tafter = ktime_get();
+        idle_sample(&cpu1, &it1);
 
         /* If we're supposed to exit, do so */
         if (kthread_should_stop()) {
@@ -145,19 +278,329 @@ static int lx_timer_test_main(void * unused)
             break;
         }
 
-        /* Log the time it took */
+        /* Log the time it took (or in a sweep, keep it for the table) */
         slept = ktime_to_ns(ktime_sub(tafter, tbefore));
+        deepest = idle_deepest(cpu0, &it0, cpu1, &it1, &residency);
+        if (sweep_mode) {
+            sweep_count(whichsleep, (s64)slept - (s64)sleepns);
+        } else {
+            printk(KERN_INFO MY_NAME
+                   ": slept %lld ns planned %lld ns extra %lld ns using %s"
+                   " cpu %d->%d idle %s residency %lld ns\n",
+                   (long long)slept,
+                   (long long)sleepns,
+                   (long long)(slept - sleepns),
+                   how, cpu0, cpu1,
+                   deepest < 0 ? "-" : idle_names[deepest],
+                   (long long)residency);
+        }
+
+        /* And count it in the histogram for that idle state */
+        b = (slept > sleepns) ? fls64(slept - sleepns) : 0;
+        if (b >= HIST_BUCKETS) {
+            b = HIST_BUCKETS - 1;
+        }
+        ++idle_hist[deepest + 1][b];
+        idle_hist_residency[deepest + 1] += residency;
+    }
+
+    return(0);
+}
+
+#ifdef LX_IDLE
+/* probe on the "cpu_idle" tracepoint: called on a CPU as it enters an
+ * idle state, and with PWR_EVENT_EXIT as it leaves */
+static void idle_probe(void *unused, unsigned int state, unsigned int cpu)
+{
+    struct idle_track *it = per_cpu_ptr(&idle_tracks, cpu);
+    u64 now = local_clock();
+
+    if (state == PWR_EVENT_EXIT) {
+        if (it->cur >= 0) {
+            it->time_ns[it->cur] += now - it->entered;
+            it->last = it->cur;
+            it->cur = -1;
+        }
+    } else if (state < CPUIDLE_STATE_MAX) {
+        ++it->usage[state];
+        it->cur = state;
+        it->entered = now;
+    }
+}
+#endif /* LX_IDLE */
+
+/* start idle state accounting, if the kernel can do it */
+static void idle_start(void)
+{
+    int cpu, i;
+
+    for_each_possible_cpu(cpu) {
+        per_cpu_ptr(&idle_tracks, cpu)->cur = -1;
+        per_cpu_ptr(&idle_tracks, cpu)->last = -1;
+    }
+    for (i = 0; i < CPUIDLE_STATE_MAX; ++i) {
+        snprintf(idle_names[i], CPUIDLE_NAME_LEN, "state%d", i);
+    }
+    idle_nstates = CPUIDLE_STATE_MAX;
+
+#ifdef LX_IDLE
+    {
+        struct cpuidle_driver *drv;
+
+        /* the state names, from the driver (taken to be the same on
+         * all CPUs, as is usual) */
+        get_cpu();
+        drv = cpuidle_get_driver();
+        if (drv) {
+            idle_nstates = drv->state_count;
+            for (i = 0; i < drv->state_count; ++i) {
+                strscpy(idle_names[i], drv->states[i].name,
+                        CPUIDLE_NAME_LEN);
+            }
+        }
+        put_cpu();
+    }
+    if (register_trace_cpu_idle(idle_probe, NULL) == 0) {
+        idle_probing = 1;
+    } else {
+        printk(KERN_ERR MY_NAME
+               ": Failed to watch cpu_idle, no idle state accounting\n");
+    }
+#endif /* LX_IDLE */
+}
+
+/* stop idle state accounting */
+static void idle_stop(void)
+{
+#ifdef LX_IDLE
+    if (idle_probing) {
+        unregister_trace_cpu_idle(idle_probe, NULL);
+        tracepoint_synchronize_unregister();
+        idle_probing = 0;
+    }
+#endif /* LX_IDLE */
+}
+
+/* idle_sample(): Take a copy of this CPU's idle state counters.  The
+ * probe only changes them while the CPU is idle, so with preemption
+ * disabled they hold still.
+ */
+static void idle_sample(int *cpu, struct idle_track *it)
+{
+    *cpu = get_cpu();
+    *it = *this_cpu_ptr(&idle_tracks);
+    put_cpu();
+}
+
+/* idle_deepest(): Find the deepest idle state entered during a sleep,
+ * from samples before (it0, on cpu0) and after (it1, on cpu1), and the
+ * time spent in idle states (*residency).  -1 if none.  If the thread
+ * woke up on a different CPU the samples can't be compared; use the
+ * state that CPU last left, since leaving it was part of waking us.
+ */
+static int idle_deepest(int cpu0, struct idle_track *it0,
+                        int cpu1, struct idle_track *it1, u64 *residency)
+{
+    int i, deepest = -1;
+
+    *residency = 0;
+    if (!idle_probing) {
+        return(-1);
+    }
+    if (cpu0 != cpu1) {
+        ++idle_migrated;
+        return(it1->last);
+    }
+    for (i = 0; i < idle_nstates; ++i) {
+        if (it1->usage[i] != it0->usage[i]) {
+            deepest = i;
+        }
+        *residency += it1->time_ns[i] - it0->time_ns[i];
+    }
+    return(deepest);
+}
+
+/* idle_report(): Log the oversleep histograms for each idle state */
+static void idle_report(void)
+{
+    int i, b;
+    u64 n;
+
+    printk(KERN_INFO MY_NAME ": oversleep by deepest idle state entered;"
+           " %lld samples woke on another CPU\n", (long long)idle_migrated);
+    for (i = 0; i <= idle_nstates; ++i) {
+        n = 0;
+        for (b = 0; b < HIST_BUCKETS; ++b) {
+            n += idle_hist[i][b];
+        }
+        if (n == 0) {
+            continue;
+        }
         printk(KERN_INFO MY_NAME
-               ": slept %lld ns planned %lld ns extra %lld ns using %s\n",
-               (long long)slept,
-               (long long)sleepns,
-               (long long)(slept - sleepns),
-               how);
+               ": idle %s: %lld samples, mean residency %lld ns\n",
+               i == 0 ? "-" : idle_names[i - 1], (long long)n,
+               (long long)div64_u64(idle_hist_residency[i], n));
+        for (b = 0; b < HIST_BUCKETS; ++b) {
+            if (idle_hist[i][b] == 0) {
+                continue;
+            }
+            printk(KERN_INFO MY_NAME
+                   ": idle %s: extra < %lld ns: %lld\n",
+                   i == 0 ? "-" : idle_names[i - 1],
+                   b == 0 ? 1ll : (long long)(1ull << b),
+                   (long long)idle_hist[i][b]);
+        }
+    }
+}
+
+/* sweep_log2(), sweep_exp2(): base 2 logarithm & exponential, in 16.16
+ * fixed point, taking 2^f as 1 + f between powers of 2.  So the sweep's
+ * logarithmic spacing is only approximately even, which doesn't matter:
+ * the durations reported are the ones actually requested.
+ */
+static u64 sweep_log2(u64 x)
+{
+    int e = fls64(x) - 1;
+
+    return(((u64)e << 16) + (((x - (1ull << e)) << 16) >> e));
+}
+
+static u64 sweep_exp2(u64 l)
+{
+    int e = l >> 16;
+
+    return((1ull << e) + (((1ull << e) * (l & 0xffff)) >> 16));
+}
+
+/* sweep_start(): check the sweep parameters, calculate the durations, and
+ * allocate space for the results.  Returns a negative error number on
+ * failure, logging why.
+ */
+static int sweep_start(void)
+{
+    int i;
+    u64 l0, l1;
+
+    if (sweep_mode < 0 || sweep_mode > 2 ||
+        sweep_points < 1 || sweep_points > SWEEP_MAX_POINTS ||
+        sweep_reps < 1 || sweep_reps > SWEEP_MAX_REPS) {
+        printk(KERN_ERR MY_NAME
+               ": Bad sweep_mode/sweep_points/sweep_reps parameter values\n");
+        return(-EINVAL);
+    }
+    if (sweep_mode == 2 && min_wait_ns == 0) {
+        printk(KERN_ERR MY_NAME
+               ": Logarithmic sweep needs min_wait_ns > 0\n");
+        return(-EINVAL);
     }
 
+    l0 = sweep_mode == 2 ? sweep_log2(min_wait_ns) : 0;
+    l1 = sweep_mode == 2 ? sweep_log2(max_wait_ns) : 0;
+    for (i = 0; i < sweep_points; ++i) {
+        if (i == 0 || sweep_points == 1) {
+            sweep_ns[i] = min_wait_ns;
+        } else if (i == sweep_points - 1) {
+            sweep_ns[i] = max_wait_ns;
+        } else if (sweep_mode == 1) {
+            sweep_ns[i] = min_wait_ns +
+                div64_u64((max_wait_ns - min_wait_ns) * i, sweep_points - 1);
+        } else {
+            sweep_ns[i] =
+                sweep_exp2(l0 + div64_u64((l1 - l0) * i, sweep_points - 1));
+        }
+    }
+
+    sweep_extra = kvmalloc_array((size_t)sweep_points * SWEEP_NPRIM *
+                                 sweep_reps, sizeof(sweep_extra[0]),
+                                 GFP_KERNEL);
+    if (!sweep_extra) {
+        printk(KERN_ERR MY_NAME ": Can't allocate space for the sweep\n");
+        return(-ENOMEM);
+    }
+    printk(KERN_INFO MY_NAME ": %s sweep, %lld to %lld ns, %d points,"
+           " %d reps\n", sweep_mode == 1 ? "linear" : "logarithmic",
+           (long long)min_wait_ns, (long long)max_wait_ns,
+           sweep_points, sweep_reps);
     return(0);
 }
 
+/* sweep_next(): the next duration & primitive in the sweep: all the
+ * points with each primitive, then all of them again, 'sweep_reps' times.
+ * Returns 0 when it's done.
+ */
+static int sweep_next(u64 *sleepns, int *whichsleep)
+{
+    int per_rep = sweep_points * SWEEP_NPRIM;
+
+    if (sweep_pos >= per_rep * sweep_reps) {
+        return(0);
+    }
+    *sleepns = sweep_ns[(sweep_pos % per_rep) / SWEEP_NPRIM];
+    *whichsleep = sweep_pos % SWEEP_NPRIM;
+    return(1);
+}
+
+/* sweep_count(): record the oversleep of the sleep sweep_next() gave */
+static void sweep_count(int whichsleep, s64 extra)
+{
+    int per_rep = sweep_points * SWEEP_NPRIM;
+    int point = (sweep_pos % per_rep) / SWEEP_NPRIM;
+    int *n = &(sweep_n[point][whichsleep]);
+
+    sweep_extra[(point * SWEEP_NPRIM + whichsleep) * sweep_reps + *n] = extra;
+    ++*n;
+    ++sweep_pos;
+}
+
+static int sweep_cmp(const void *a, const void *b)
+{
+    s64 x = *(const s64 *)a, y = *(const s64 *)b;
+
+    return(x < y ? -1 : x > y);
+}
+
+/* sweep_report(): Log the table of oversleep by duration & primitive:
+ * minimum, percentiles (nearest rank), maximum, and mean, in ns.  For
+ * schedule_timeout_interruptible() also the jiffies it was asked for.
+ */
+static void sweep_report(void)
+{
+    static const char *prims[SWEEP_NPRIM] = {
+        "schedule_timeout_interruptible", "schedule_hrtimeout"
+    };
+    int i, p, n, k;
+    s64 *x, sum;
+    long jifs;
+
+    sweep_reported = 1;
+    printk(KERN_INFO MY_NAME ": sweep: requested ns, primitive, jiffies,"
+           " samples; oversleep ns min p50 p90 p99 max mean\n");
+    for (i = 0; i < sweep_points; ++i) {
+        for (p = 0; p < SWEEP_NPRIM; ++p) {
+            n = sweep_n[i][p];
+            if (n == 0) {
+                continue;
+            }
+            x = &(sweep_extra[(i * SWEEP_NPRIM + p) * sweep_reps]);
+            sort(x, n, sizeof(x[0]), &sweep_cmp, NULL);
+            sum = 0;
+            for (k = 0; k < n; ++k) {
+                sum += x[k];
+            }
+            jifs = p == 0 ? (long)nsecs_to_jiffies(sweep_ns[i]) : -1;
+            printk(KERN_INFO MY_NAME ": sweep %lld %s %ld %d;"
+                   " %lld %lld %lld %lld %lld %lld\n",
+                   (long long)sweep_ns[i], prims[p], jifs, n,
+                   (long long)x[0],
+                   (long long)x[(n * 50 + 99) / 100 - 1],
+                   (long long)x[(n * 90 + 99) / 100 - 1],
+                   (long long)x[(n * 99 + 99) / 100 - 1],
+                   (long long)x[n - 1],
+                   (long long)div64_s64(sum, n));
+        }
+    }
+}
+
 /* pseudorandom number generator (MINSTD -- Park and Miller 1988 and 1993) */
 static unsigned minstd(unsigned *state)
 {
@@ -11,30 +11,82 @@ proc usage {} {
     puts stderr "Usage: tclsh srec2prg.tcl \[options\] < input > output"
     puts stderr "Options:"
     puts stderr "\tfi= uninitialized byte value, def 0"
+    puts stderr "\tgap= longest unfilled gap within one segment, def 65536"
+    puts stderr "\tseg= file name format for writing each segment separately,"
+    puts stderr "\t\tgiven its load address, e.g. seg=out-%04x.prg"
     exit 1
 }
 
 # read command line parameters into array $parm()
 set parm(fi) 0
+set parm(gap) 65536
+set parm(seg) ""
 
 foreach arg $argv {
     set ap [split $arg =]
     set ap0 [lindex $ap 0]
     set ap1 [lindex $ap 1]
     if {[llength $ap] != 2 ||
-        ![string is integer -strict $ap1] ||
-        ![info exists parm($ap0)]} {
+        ![info exists parm($ap0)] ||
+        ($ap0 ne "seg" && ![string is integer -strict $ap1])} {
         puts stderr "Invalid parameter $arg"
         usage
     }
     set parm($ap0) $ap1
 }
 
-# initialize a record of the whole memory address space, $rom()
-# initialize a record of how many times each address was written, $ovr()
-for {set i 0} {$i < 65536} {incr i} {
-    set rom($i) $parm(fi)
-    set ovr($i) 0
+# The memory image is kept sparse: $ext is a list of extents, each a pair
+# of start address & byte string, sorted by address.  No two extents
+# overlap or even touch; those that would are merged.  $ovl is a list of
+# address ranges (start, end+1) that were written more than once; they
+# may overlap each other.
+set ext [list]
+set ovl [list]
+
+# addext - record the byte string $data as written starting at address $a.
+proc addext {a data} {
+    global ext ovl
+
+    set e [expr {$a + [string length $data]}]
+
+    # The usual case: records come in order, each continuing the last.
+    if {[llength $ext]} {
+        lassign [lindex $ext end] xs xd
+        set xe [expr {$xs + [string length $xd]}]
+        if {$xe == $a} {
+            lset ext end [list $xs $xd$data]
+            return
+        }
+    }
+
+    # Otherwise merge it with whatever extents it overlaps or touches.
+    set ms $a
+    set md $data
+    set before [list]
+    set after [list]
+    foreach x $ext {
+        lassign $x xs xd
+        set xe [expr {$xs + [string length $xd]}]
+        if {$xe < $a} {
+            lappend before $x
+        } elseif {$xs > $e} {
+            lappend after $x
+        } else {
+            set os [expr {max($xs, $a)}]
+            set oe [expr {min($xe, $e)}]
+            if {$os < $oe} {
+                lappend ovl [list $os $oe]
+            }
+            if {$xs < $a} {
+                set md [string range $xd 0 [expr {$a - $xs - 1}]]$md
+                set ms $xs
+            }
+            if {$xe > $e} {
+                append md [string range $xd [expr {$e - $xs}] end]
+            }
+        }
+    }
+    set ext [concat $before [list [list $ms $md]] $after]
 }
 
 # parse1 - pass 1 of parsing an S-Record.  Breaks it into pieces, returned
@@ -44,7 +96,7 @@ for {set i 0} {$i < 65536} {incr i} {
 #       data
 # it validates the checksum & doesn't return it.  The address value it
 # returns is a single numeric value; the data value it returns is a
-# list of numeric byte values.
+# byte string.
 #
 # Returns empty list on recoverable parse error or a type of record that
 # is ignored.
@@ -91,10 +143,7 @@ proc parse1 {sr} {
         error "$type record bad checksum, got $cksum exp $cksum2"
     }
 
-    set data [list]
-    for {set i [expr {$alen + 4}]} {$i < ($l - 2)} {incr i 2} {
-        lappend data [scan [string range $sr $i $i+1] %x]
-    }
+    set data [binary format H* [string range $sr $alen+4 end-2]]
 
     return [list $type $addr $data]
 }
@@ -136,14 +185,12 @@ while {![eof stdin]} {
         S2 -
         S3 {
             # Data record
-            set l [llength $Data]
+            set l [string length $Data]
             if {$Addr + $l > 65536 || $Addr < 0} {
                 error "Address out of range: Record addr $Addr len $l"
             }
-            for {set i 0} {$i < $l} {incr i} {
-                set ma [expr {$Addr + $i}]
-                set rom($ma) [lindex $Data $i]
-                incr ovr($ma)
+            if {$l} {
+                addext $Addr $Data
             }
             incr lc_use
         }
@@ -155,29 +202,47 @@ while {![eof stdin]} {
     }
 }
 
+if {![llength $ext]} {
+    error "Input is empty!"
+}
+set minad [lindex $ext 0 0]
+lassign [lindex $ext end] xs xd
+set maxad [expr {$xs + [string length $xd] - 1}]
+
 # Our output must be a contiguous sequence of addresses; our input might not;
-# solve that.
-set minad ""
-set maxad ""
-for {set i 0} {$i < 65536} {incr i} {
-    if {$ovr($i)} {
-        if {$minad eq ""} { set minad $i }
-        set maxad $i
+# solve that by filling gaps up to $parm(gap) bytes long.  Anything further
+# apart goes into a separate segment, a list of extents in $segs.
+set segs [list]
+set seg [list]
+set pe ""
+foreach x $ext {
+    lassign $x xs xd
+    if {$pe ne "" && $xs - $pe > $parm(gap)} {
+        lappend segs $seg
+        set seg [list]
     }
+    lappend seg $x
+    set pe [expr {$xs + [string length $xd]}]
 }
-if {$minad eq ""} {
-    error "Input is empty!"
+lappend segs $seg
+if {[llength $segs] > 1 && $parm(seg) eq ""} {
+    error "Input has [llength $segs] segments; use seg= to write them"
 }
 
 # Print a report on what we did
 set bf 0
-set bu 0
+foreach x $ext {
+    incr bf [string length [lindex $x 1]]
+}
+set bu [expr {65536 - $bf}]
 set bo 0
-for {set i 0} {$i < 65536} {incr i} {
-    switch -- $ovr($i) {
-        0 { incr bu }
-        1 { incr bf }
-        default { incr bf ; incr bo }
+set pe 0
+foreach o [lsort -integer -index 0 $ovl] {
+    lassign $o os oe
+    if {$os < $pe} { set os $pe }
+    if {$oe > $os} {
+        incr bo [expr {$oe - $os}]
+        set pe $oe
     }
 }
 foreach {rl rv} [list \
@@ -190,15 +255,38 @@ foreach {rl rv} [list \
     "Bytes unfilled" $bu \
     "Bytes overwritten" $bo \
     "Minimum address" [format "%u ($%x)" $minad $minad] \
-    "Maximum address" [format "%u ($%x)" $maxad $maxad]
+    "Maximum address" [format "%u ($%x)" $maxad $maxad] \
+    "Segments" [llength $segs]
 ] {
     puts stderr [format {srec2prg:%27s %s} $rl $rv]
 }
 
-# Now write the output.
-fconfigure stdout -encoding binary -translation binary
-puts -nonewline [format %c%c [expr {$minad & 255}] [expr {($minad >> 8) & 255}]]
-for {set i $minad} {$i <= $maxad} {incr i} {
-    puts -nonewline [format %c $rom($i)]
+# Now write the output: each segment is its load address followed by its
+# data, with any gaps between its extents filled in.
+set fill [binary format c $parm(fi)]
+foreach seg $segs {
+    set sa [lindex $seg 0 0]
+    if {$parm(seg) eq ""} {
+        set fp stdout
+    } else {
+        set fn [format $parm(seg) $sa]
+        set fp [open $fn w]
+        lassign [lindex $seg end] xs xd
+        puts stderr [format {srec2prg:%27s %s} "Segment $fn" \
+            [format "%u-%u ($%x-$%x)" $sa [expr {$xs + [string length $xd] - 1}] \
+                $sa [expr {$xs + [string length $xd] - 1}]]]
+    }
+    fconfigure $fp -encoding binary -translation binary
+    puts -nonewline $fp [binary format s $sa]
+    set pe $sa
+    foreach x $seg {
+        lassign $x xs xd
+        puts -nonewline $fp [string repeat $fill [expr {$xs - $pe}]]
+        puts -nonewline $fp $xd
+        set pe [expr {$xs + [string length $xd]}]
+    }
+    if {$fp ne "stdout"} {
+        close $fp
+    }
 }
 exit 0
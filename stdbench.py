@@ -0,0 +1,312 @@
+#!/usr/bin/python3
+# stdbench.py - Jeremy Dilatush
+#
+# Copyright (C) 2026, Jeremy Dilatush.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY JEREMY DILATUSH AND CONTRIBUTORS
+# ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+# TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+# PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL JEREMY DILATUSH OR CONTRIBUTORS
+# BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+# CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+# SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+# INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+# CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+# ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+# POSSIBILITY OF SUCH DAMAGE.
+
+# stdbench - loopback benchmark of stdserve and tcphammer together.
+#
+# For each of a fixed set of scenarios, starts stdserve on a loopback port,
+# runs tcphammer against it for a fixed time, and summarizes tcphammer's
+# reports.  Writes a table to stdout, one line per scenario, with columns:
+#       scenario        name of the scenario
+#       ops             operations that succeeded
+#       errs            operations that failed
+#       ops_s           successful operations per second
+#       p50_us          median operation duration, microseconds
+#       p99_us          99th percentile operation duration, microseconds
+#       cpu_us_op       CPU time (stdserve + tcphammer, user + system)
+#                       per successful operation, microseconds
+# stdserve gets a listen backlog big enough for the scenarios; if its queue
+# overflows anyway, there's a warning on stderr.
+# Lines beginning with "#" are comments.  The format is meant to stay the
+# same from one version to the next, so tables can be compared.
+#
+# Usage:
+#       stdbench.py [options]
+# Options:
+#       -s path         stdserve program (default ./stdserve)
+#       -t path         tcphammer program (default ./tcphammer)
+#       -d sec          how long to run each scenario (default 5)
+#       -p port         first of the loopback ports to use (default 21000)
+#       -o file         also write the table to file
+#       -r file         don't run anything; take the table from file
+#       -b file         compare against the baseline table in file
+#       -T pct          tolerance in percent for the comparison (default 10)
+# With -b, exits with status 1 if any value is worse than the baseline by
+# more than the tolerance.
+
+import os
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+# The scenarios: name, stdserve protocol, port offset, tcphammer settings.
+# Only "echo" gets data exchanges, since only echo sends data back the
+# way tcphammer expects.
+scenarios = [
+    ("echo", "echo", 7,
+     ["kopendata", "c50/127.0.0.1/{port}/echo", "i0.01", "s5/0/4",
+      "pd15", "po5", "pc5", "pt1"]),
+    ("discard", "discard", 9,
+     ["c50/127.0.0.1/{port}/discard", "i0.01", "s5/0/4",
+      "pd0", "po5", "pc5", "pt1"]),
+    ("chargen", "chargen", 19,
+     ["c50/127.0.0.1/{port}/chargen", "i0.01", "s5/0/4",
+      "pd0", "po5", "pc5", "pt1"]),
+    ("daytime", "daytime", 13,
+     ["c50/127.0.0.1/{port}/daytime", "i0.01", "s5/0/4",
+      "pd0", "po5", "pc5", "pt1"]),
+]
+
+# stdserve's listen backlog (-B): enough that the scenarios' bursts of
+# opens don't overflow the accept queue, which would make the benchmark
+# measure SYN retransmissions instead of the server.
+listen_backlog = 1024
+
+# Columns of the table, and which direction is better for each.
+columns = ["ops", "errs", "ops_s", "p50_us", "p99_us", "cpu_us_op"]
+higher_better = {"ops": True, "errs": False, "ops_s": True,
+                 "p50_us": False, "p99_us": False, "cpu_us_op": False}
+
+def usage():
+    sys.stderr.write("Usage: stdbench.py [-s stdserve] [-t tcphammer]"
+                     " [-d sec] [-p port]\n"
+                     "\t[-o file] [-r file] [-b baseline] [-T pct]\n")
+    sys.exit(1)
+
+# Fixed point read of times: from fractional seconds to integer microseconds
+def usread(s):
+    parts = s.split(".")
+    t = int(parts[0]) * 1000000
+    if len(parts) > 1:
+        t += int((parts[1] + "00000")[:6], base=10)
+    return(t)
+
+# percentile of a sorted list, by the nearest rank method
+def percentile(vals, p):
+    if not vals:
+        return(0)
+    k = (len(vals) * p + 99) // 100
+    return(vals[max(k, 1) - 1])
+
+# CPU time, in microseconds, from the rusage returned by os.wait4()
+def cpu_us(ru):
+    return(int((ru.ru_utime + ru.ru_stime) * 1e+6))
+
+# wait for a file to exist
+def wait_for_file(path, limit):
+    t0 = time.time()
+    while time.time() - t0 < limit:
+        if os.path.exists(path):
+            return(True)
+        time.sleep(0.05)
+    return(False)
+
+# stdserve's & tcphammer's statistics files: "key value" lines
+def read_stats(path):
+    st = {}
+    try:
+        with open(path) as fp:
+            for line in fp:
+                f = line.split()
+                if len(f) == 2:
+                    st[f[0]] = f[1]
+    except OSError:
+        pass
+    return(st)
+
+# run one scenario, returning a dictionary of the table columns
+#       host -- address stdserve listens on and tcphammer connects to
+#       srv_wrap, cli_wrap -- command prefixes to run stdserve and tcphammer
+#           under (e.g. "ip netns exec ..."); they must exec() the program
+#           so its resource usage is what os.wait4() reports
+#       stats -- if not None, a file name prefix: stdserve and tcphammer
+#           write their statistics files to stats + ".stdserve" and
+#           stats + ".tcphammer".  This is also how stdserve is known to
+#           be ready, when it can't be reached from here to check.
+#           If None, they're written to a temporary directory anyway, to
+#           check stdserve's listen queue didn't overflow.
+def run_scenario(sc, stdserve, tcphammer, dur, baseport,
+                 host="127.0.0.1", srv_wrap=[], cli_wrap=[], stats=None):
+    if stats is None:
+        tmpdir = tempfile.mkdtemp(prefix="stdbench")
+        try:
+            return(run_scenario(sc, stdserve, tcphammer, dur, baseport,
+                                host, srv_wrap, cli_wrap,
+                                os.path.join(tmpdir, sc[0])))
+        finally:
+            shutil.rmtree(tmpdir, ignore_errors=True)
+    name, proto, poff, conf = sc
+    port = baseport + poff
+    sopts = ["-N", "0", "-B", str(listen_backlog)]
+    for sfx in (".stdserve", ".tcphammer"):
+        if os.path.exists(stats + sfx):
+            os.unlink(stats + sfx)
+    sopts += ["-S", stats + ".stdserve"]
+    srv = subprocess.Popen(srv_wrap + [stdserve] + sopts +
+                           [proto, host + "/" + str(port)],
+                           stdout=subprocess.DEVNULL)
+    try:
+        ready = wait_for_file(stats + ".stdserve", 5)
+        if not ready:
+            raise RuntimeError("stdserve " + proto + " didn't start on port "
+                               + str(port))
+        lines = ["kusec", "e" + str(dur), "m" + stats + ".tcphammer"]
+        lines += [l.replace("{port}", str(port)).replace("127.0.0.1", host)
+                  for l in conf]
+        cli = subprocess.Popen(cli_wrap + [tcphammer], stdin=subprocess.PIPE,
+                               stdout=subprocess.PIPE,
+                               universal_newlines=True)
+        cli.stdin.write("\n".join(lines) + "\n")
+        cli.stdin.close()
+        out = cli.stdout.read()
+        _, cli.returncode, cru = os.wait4(cli.pid, 0)
+        if cli.returncode:
+            raise RuntimeError("tcphammer failed, status "
+                               + str(cli.returncode))
+        # stdserve writes its statistics once a second; let it catch up
+        time.sleep(1.2)
+    finally:
+        srv.send_signal(signal.SIGTERM)
+        _, srv.returncode, sru = os.wait4(srv.pid, 0)
+    ovf = read_stats(stats + ".stdserve").get("listen_overflows", "0")
+    if ovf != "0":
+        sys.stderr.write("stdbench: WARNING: %s: stdserve's listen queue"
+                         " overflowed %s times; its times include SYN"
+                         " retransmissions\n" % (name, ovf))
+
+    # Parse tcphammer's CSV reports; see cslot_main() in tcphammer.c
+    durs = []
+    errs = 0
+    for line in out.splitlines():
+        cols = line.split(",")
+        if len(cols) < 10:
+            continue
+        if cols[8] == "ok":
+            durs.append(usread(cols[1]))
+        else:
+            errs += 1
+    durs.sort()
+    ops = len(durs)
+    cpu = cpu_us(sru) + cpu_us(cru)
+    return({"ops": ops, "errs": errs,
+            "ops_s": ops / dur,
+            "p50_us": percentile(durs, 50),
+            "p99_us": percentile(durs, 99),
+            "cpu_us_op": (cpu / ops) if ops else 0})
+
+def format_table(results):
+    out = ["# stdbench results"]
+    out.append("# %-10s %8s %8s %10s %10s %10s %10s" %
+               tuple(["scenario"] + columns))
+    for name, r in results:
+        out.append("%-12s %8d %8d %10.1f %10d %10d %10.1f" %
+                   (name, r["ops"], r["errs"], r["ops_s"],
+                    r["p50_us"], r["p99_us"], r["cpu_us_op"]))
+    return("\n".join(out) + "\n")
+
+def parse_table(text):
+    results = []
+    for line in text.splitlines():
+        if line.startswith("#") or not line.strip():
+            continue
+        f = line.split()
+        results.append((f[0], dict(zip(columns,
+                                       [float(x) for x in f[1:]]))))
+    return(results)
+
+# compare two tables, returning the number of regressions
+def compare(base, cur, tol):
+    bad = 0
+    bd = dict(base)
+    print("# comparison with baseline, tolerance %g%%" % tol)
+    for name, r in cur:
+        if name not in bd:
+            print("# %s: not in baseline" % name)
+            continue
+        for c in columns:
+            b, v = bd[name][c], r[c]
+            if b == 0:
+                pct = 0 if v == 0 else 100
+            else:
+                pct = (v - b) * 100.0 / b
+            worse = -pct if higher_better[c] else pct
+            flag = ""
+            if worse > tol and not (c == "errs" and v == 0):
+                flag = "  REGRESSION"
+                bad += 1
+            print("# %-10s %-10s %12.1f -> %12.1f %+8.1f%%%s" %
+                  (name, c, b, v, pct, flag))
+    return(bad)
+
+def main(argv):
+    stdserve, tcphammer = "./stdserve", "./tcphammer"
+    dur, baseport, tol = 5, 21000, 10.0
+    outfile = resfile = basefile = None
+    i = 1
+    while i < len(argv):
+        if argv[i] in ("-s", "-t", "-d", "-p", "-o", "-r", "-b", "-T") \
+                and i + 1 < len(argv):
+            o, a = argv[i], argv[i + 1]
+            i += 2
+            if o == "-s": stdserve = a
+            elif o == "-t": tcphammer = a
+            elif o == "-d": dur = float(a)
+            elif o == "-p": baseport = int(a)
+            elif o == "-o": outfile = a
+            elif o == "-r": resfile = a
+            elif o == "-b": basefile = a
+            elif o == "-T": tol = float(a)
+        else:
+            usage()
+
+    if resfile:
+        with open(resfile) as fp:
+            table = fp.read()
+    else:
+        results = []
+        for sc in scenarios:
+            sys.stderr.write("stdbench: running %s for %g sec\n" %
+                             (sc[0], dur))
+            results.append((sc[0], run_scenario(sc, stdserve, tcphammer,
+                                                dur, baseport)))
+        table = format_table(results)
+    sys.stdout.write(table)
+    if outfile:
+        with open(outfile, "w") as fp:
+            fp.write(table)
+
+    if basefile:
+        with open(basefile) as fp:
+            base = parse_table(fp.read())
+        if compare(base, parse_table(table), tol):
+            return(1)
+    return(0)
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,257 @@
+#!/usr/bin/python3
+# stdnetem.py - Jeremy Dilatush
+#
+# Copyright (C) 2026, Jeremy Dilatush.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY JEREMY DILATUSH AND CONTRIBUTORS
+# ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+# TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+# PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL JEREMY DILATUSH OR CONTRIBUTORS
+# BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+# CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+# SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+# INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+# CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+# ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+# POSSIBILITY OF SUCH DAMAGE.
+
+# stdnetem - stdbench's scenarios over an impaired network path, on one host.
+#
+# Creates two network namespaces, "<prefix>-srv" and "<prefix>-cli", joined
+# by a veth pair (addresses 10.213.7.1 and 10.213.7.2).  For each network
+# profile, puts a "tc netem" queueing discipline with that profile's
+# settings on both ends of the veth pair, so each direction gets the delay,
+# loss, etc.  Then runs each of stdbench's scenarios with stdserve in one
+# namespace and tcphammer in the other.
+#
+# Writes the same table stdbench does, with the scenario names prefixed by
+# the profile name (e.g. "wan/echo"), so it can be compared against a
+# baseline the same way.  After the table come comment lines with each
+# side's own view: from stdserve's and tcphammer's statistics files, and
+# TCP segment retransmissions counted in each namespace.
+#
+# Needs to run as root, and needs "ip" and "tc" (iproute2) and the kernel's
+# sch_netem module.  The namespaces are removed at the end unless -k is
+# given; they're also removed (if left over) at the start.
+#
+# Usage:
+#       stdnetem.py [options]
+# Options:
+#       -s path         stdserve program (default ./stdserve)
+#       -t path         tcphammer program (default ./tcphammer)
+#       -d sec          how long to run each scenario (default 5)
+#       -p port         first of the ports to use (default 21000)
+#       -P names        comma separated list of profiles to run (default
+#                       all of them; see "profiles" below)
+#       -n settings     run just one profile, named "custom", with these
+#                       netem settings (e.g. "delay 5ms loss 1%")
+#       -N prefix       prefix of the namespace names (default "stdnetem")
+#       -S dir          keep the statistics files in dir
+#       -k              keep the namespaces when done
+#       -o file         also write the table to file
+#       -b file         compare against the baseline table in file
+#       -T pct          tolerance in percent for the comparison (default 10)
+# With -b, exits with status 1 if any value is worse than the baseline by
+# more than the tolerance.
+
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+import stdbench
+
+# The network profiles: name, and netem settings applied to each direction.
+# So "delay" is one way; the round trip time is twice that.
+profiles = [
+    ("none", ""),
+    ("lan", "delay 250us 50us"),
+    ("wan", "delay 20ms 5ms loss 0.1%"),
+    ("lossy", "delay 10ms 2ms loss 2% 25%"),
+    ("reorder", "delay 10ms reorder 25% 50%"),
+    ("slow", "delay 30ms rate 2mbit"),
+]
+
+srv_addr = "10.213.7.1"
+cli_addr = "10.213.7.2"
+
+def usage():
+    sys.stderr.write("Usage: stdnetem.py [-s stdserve] [-t tcphammer]"
+                     " [-d sec] [-p port]\n"
+                     "\t[-P profiles] [-n settings] [-N prefix] [-S dir]"
+                     " [-k]\n"
+                     "\t[-o file] [-b baseline] [-T pct]\n")
+    sys.exit(1)
+
+# run a command, raising an exception if it fails unless "check" is false
+def run(args, check=True):
+    p = subprocess.run(args, stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                       universal_newlines=True)
+    if check and p.returncode:
+        raise RuntimeError(" ".join(args) + ": " + p.stderr.strip())
+    return(p.stdout)
+
+# command prefix to run something in a namespace
+def nsexec(ns):
+    return(["ip", "netns", "exec", ns])
+
+# names of the namespaces and their veth interfaces
+def names(prefix):
+    return({"srv": (prefix + "-srv", prefix[:12] + "-s", srv_addr),
+            "cli": (prefix + "-cli", prefix[:12] + "-c", cli_addr)})
+
+def teardown(prefix):
+    for ns, dev, addr in names(prefix).values():
+        run(["ip", "netns", "del", ns], check=False)
+
+def setup(prefix):
+    teardown(prefix)
+    n = names(prefix)
+    run(["ip", "link", "add", n["srv"][1], "type", "veth",
+         "peer", "name", n["cli"][1]])
+    for ns, dev, addr in n.values():
+        run(["ip", "netns", "add", ns])
+        run(["ip", "link", "set", dev, "netns", ns])
+        run(["ip", "-n", ns, "addr", "add", addr + "/24", "dev", dev])
+        run(["ip", "-n", ns, "link", "set", dev, "up"])
+        run(["ip", "-n", ns, "link", "set", "lo", "up"])
+
+# put netem settings on both ends; empty settings means no impairment
+def set_profile(prefix, settings):
+    for ns, dev, addr in names(prefix).values():
+        run(nsexec(ns) + ["tc", "qdisc", "del", "dev", dev, "root"],
+            check=False)
+        if settings:
+            run(nsexec(ns) + ["tc", "qdisc", "add", "dev", dev, "root",
+                              "netem"] + settings.split())
+
+# TCP counters from /proc/net/snmp, which is per namespace
+def tcp_counters(ns):
+    keys = vals = None
+    for line in run(nsexec(ns) + ["cat", "/proc/net/snmp"]).splitlines():
+        if line.startswith("Tcp:"):
+            if keys is None:
+                keys = line.split()[1:]
+            else:
+                vals = [int(x) for x in line.split()[1:]]
+    return(dict(zip(keys or [], vals or [])))
+
+# comment lines describing each side's view of one scenario run
+def side_lines(name, stats, retrans):
+    s = stdbench.read_stats(stats + ".stdserve")
+    t = stdbench.read_stats(stats + ".tcphammer")
+    out = []
+    out.append("# %-16s stdserve  accepts %s bytes_in %s bytes_out %s"
+               " errors %s retrans %d listen_qhigh %s listen_overflows %s" %
+               (name, s.get("accepts", "?"), s.get("bytes_in", "?"),
+                s.get("bytes_out", "?"), s.get("errors", "?"),
+                retrans["srv"], s.get("listen_qhigh", "?"),
+                s.get("listen_overflows", "?")))
+    out.append("# %-16s tcphammer opens %s closes %s datas %s"
+               " errors %s retrans %d sched_max %s saturated %s/%s" %
+               (name, t.get("opens", "?"), t.get("closes", "?"),
+                t.get("datas", "?"), t.get("errors", "?"), retrans["cli"],
+                t.get("sched_max", "?"), t.get("sat_intervals", "?"),
+                t.get("intervals", "?")))
+    return(out)
+
+def main(argv):
+    stdserve, tcphammer = "./stdserve", "./tcphammer"
+    dur, baseport, tol = 5, 21000, 10.0
+    outfile = basefile = statsdir = None
+    prefix, keep = "stdnetem", False
+    torun = profiles
+    i = 1
+    while i < len(argv):
+        if argv[i] == "-k":
+            keep = True
+            i += 1
+        elif argv[i] in ("-s", "-t", "-d", "-p", "-P", "-n", "-N", "-S",
+                         "-o", "-b", "-T") and i + 1 < len(argv):
+            o, a = argv[i], argv[i + 1]
+            i += 2
+            if o == "-s": stdserve = a
+            elif o == "-t": tcphammer = a
+            elif o == "-d": dur = float(a)
+            elif o == "-p": baseport = int(a)
+            elif o == "-P":
+                pd = dict(profiles)
+                for p in a.split(","):
+                    if p not in pd:
+                        sys.stderr.write("stdnetem: unknown profile %s\n" % p)
+                        return(1)
+                torun = [(p, pd[p]) for p in a.split(",")]
+            elif o == "-n": torun = [("custom", a)]
+            elif o == "-N": prefix = a
+            elif o == "-S": statsdir = a
+            elif o == "-o": outfile = a
+            elif o == "-b": basefile = a
+            elif o == "-T": tol = float(a)
+        else:
+            usage()
+    if os.geteuid() != 0:
+        sys.stderr.write("stdnetem: must run as root, to set up namespaces\n")
+        return(1)
+
+    if statsdir is None:
+        tmpdir = statsdir = tempfile.mkdtemp(prefix="stdnetem")
+    else:
+        tmpdir = None
+        os.makedirs(statsdir, exist_ok=True)
+    n = names(prefix)
+    results = []
+    sides = []
+    try:
+        setup(prefix)
+        for pname, settings in torun:
+            set_profile(prefix, settings)
+            sides.append("# profile %s: %s" % (pname, settings or "-"))
+            for sc in stdbench.scenarios:
+                name = pname + "/" + sc[0]
+                sys.stderr.write("stdnetem: running %s for %g sec\n" %
+                                 (name, dur))
+                before = dict([(k, tcp_counters(n[k][0])) for k in n])
+                stats = os.path.join(statsdir, pname + "." + sc[0])
+                r = stdbench.run_scenario(sc, stdserve, tcphammer, dur,
+                                          baseport, host=srv_addr,
+                                          srv_wrap=nsexec(n["srv"][0]),
+                                          cli_wrap=nsexec(n["cli"][0]),
+                                          stats=stats)
+                after = dict([(k, tcp_counters(n[k][0])) for k in n])
+                retrans = dict([(k, after[k].get("RetransSegs", 0) -
+                                 before[k].get("RetransSegs", 0))
+                                for k in n])
+                results.append((name, r))
+                sides += side_lines(name, stats, retrans)
+    finally:
+        if not keep:
+            teardown(prefix)
+        if tmpdir is not None:
+            shutil.rmtree(tmpdir, ignore_errors=True)
+
+    table = stdbench.format_table(results) + "\n".join(sides) + "\n"
+    sys.stdout.write(table)
+    if outfile:
+        with open(outfile, "w") as fp:
+            fp.write(table)
+
+    if basefile:
+        with open(basefile) as fp:
+            base = stdbench.parse_table(fp.read())
+        if stdbench.compare(base, stdbench.parse_table(table), tol):
+            return(1)
+    return(0)
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
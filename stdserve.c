@@ -20,6 +20,19 @@
  * production machine, or anywhere this software's bugs might
  * unacceptably impact security or utility. But for tests and experiments
  * it might be good enough.
+ *
+ * USDT static tracepoints (provider "stdserve") are compiled in when
+ * <sys/sdt.h> is available, unless built with -DNO_USDT.  When nothing is
+ * tracing them they're just no-op instructions.  List them with:
+ *	bpftrace -l 'usdt:./stdserve:*'
+ * They are:
+ *	accept(fd, listen_fd)
+ *	read(fd, bytes, errno)	- bytes < 0 on error
+ *	write(fd, bytes, errno)	- bytes < 0 on error
+ *	timer(fd, late_us)	- timer callback, and how late it is
+ *	close(fd, status, lifetime_us) - status is 'enum connstatus'
+ *	loop(nready, handle_us)	- one pass through the main loop after
+ *				  select(): number ready & time handling them
  */
 /*
  * stdserve.c - Jeremy Dilatush
@@ -57,22 +70,60 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <math.h>
+#include <stdarg.h>
 
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <time.h>
 #include <signal.h>
 
 #include <netdb.h>
 
+#include <pthread.h>
+
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#define HAVE_SENDFILE
+#endif
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#ifdef __linux__
+#include <netinet/tcp.h>
+#define HAVE_TCP_INFO
+#endif
+
+#if defined(__linux__) && !defined(NO_BPF) && defined(__has_include)
+#if __has_include(<linux/bpf.h>)
+#include <linux/bpf.h>
+#include <sys/syscall.h>
+#include <stddef.h>
+#include <stdint.h>
+#define HAVE_BPF
+#endif
+#endif
+
+#if !defined(NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_USDT
+#endif
+#endif
+#ifdef HAVE_USDT
+#define TRACE2(n,a,b) DTRACE_PROBE2(stdserve, n, a, b)
+#define TRACE3(n,a,b,c) DTRACE_PROBE3(stdserve, n, a, b, c)
+#else
+#define TRACE2(n,a,b) ((void)(a), (void)(b))
+#define TRACE3(n,a,b,c) ((void)(a), (void)(b), (void)(c))
+#endif
 
 static void usage(void)
 {
@@ -81,10 +132,41 @@ static void usage(void)
 	"\t$opts - options for stdserve\n"
 	"\t\t-N num - number of connections per process; default 100; 0 unlimited\n"
 	"\t\t-v - verbose output\n"
+	"\t\t-V chars - verbose output about particular things\n"
+	"\t\t-R num - most messages per second of each kind logged\n"
+	"\t\t\tby -v or -V while serving; default 1000; 0 = no limit\n"
 #ifdef DO_IPv6
 	"\t\t-6 - do IPv6 instead of IPv4\n"
 #endif
 	"\t\t-n - no lookups of addresses/ports; only use numeric ones\n"
+	"\t\t-S file - write statistics to file about once a second;\n"
+	"\t\t\tchild processes use file.pid (see stdtop)\n"
+	"\t\t-Q bytes - fair sharing: each connection may transfer this\n"
+	"\t\t\tmany bytes, times its weight, each time through the\n"
+	"\t\t\tmain loop, with unused allowance carried over\n"
+	"\t\t\t(deficit round robin); default 0 = no limit\n"
+	"\t\t-T usec - most time to spend handling connections each time\n"
+	"\t\t\tthrough the main loop; the rest wait for the next time;\n"
+	"\t\t\tdefault 0 = no limit\n"
+	"\t\t-w num - weight of each connection for -Q; default depends on\n"
+	"\t\t\tthe protocol: 1 for discard, chargen, file; 4 for others\n"
+	"\t\t-t num - threaded mode: serve connections in this many worker\n"
+	"\t\t\tthreads, in one process (so, no -N); a worker that's\n"
+	"\t\t\toverloaded hands connections to one that isn't\n"
+	"\t\t-L usec - threaded: a worker is overloaded when handling one\n"
+	"\t\t\tselect() result takes this long; default 1000\n"
+	"\t\t-D num - threaded: or when this many sockets are ready on\n"
+	"\t\t\taverage, each select(); default 0 = don't check\n"
+	"\t\t-B num - listen backlog: how many connections the kernel\n"
+	"\t\t\tmay queue up for accept(); default 25\n"
+#ifdef TCP_FASTOPEN
+	"\t\t-F num - accept TCP Fast Open (data in the SYN), with up to\n"
+	"\t\t\tthis many such connections pending; default 0 = don't\n"
+#endif
+#ifdef HAVE_BPF
+	"\t\t-K - echo: echo the data in the kernel (eBPF sockmap), not\n"
+	"\t\t\tin this program, on IPv4 connections\n"
+#endif
 	"\t$proto - protocol to use\n"
 	"\t\techo - RFC 862 protocol; default port 7\n"
 	"\t\tdiscard - RFC 863 protocol; default port 9\n"
@@ -103,6 +185,32 @@ static void usage(void)
 	"\t\t\t\t-r $sec - additional amount to \"randomize\" interval (0 sec)\n"
 	"\t\t\t\t-n $msgs - number of messages before terminating (0 = inf)\n"
 	"\t\t\t\t-d $sec - delay before terminating (0 = none)\n"
+	"\t\t\t\t-s $bytes - instead, send binary records of this\n"
+	"\t\t\t\t\tsize (16 or more), the same every run: 32 bit\n"
+	"\t\t\t\t\tsize, 64 bit sequence number from 0, 32 bit\n"
+	"\t\t\t\t\tCRC-32, then fixed pseudorandom payload; big\n"
+	"\t\t\t\t\tendian; the CRC covers the payload, then the\n"
+	"\t\t\t\t\tsize & sequence number\n"
+	"\t\t\t\t-p $num - with -s, records per second on each\n"
+	"\t\t\t\t\tconnection (0 = as fast as it goes, default)\n"
+	"\t\tdelay-echo - like echo, but sends each chunk of data back\n"
+	"\t\t\tafter a delay, in order; optional parameters:\n"
+	"\t\t\t\t-d $sec - fixed delay (default 0.1 sec)\n"
+	"\t\t\t\t-u $min-$max - delay uniformly distributed in range\n"
+	"\t\t\t\t-l $median/$sigma - delay log-normally distributed\n"
+	"\t\t\t\t-m $bytes - most data held per connection (65536)\n"
+	"\t\trr - request/response: each request is a 12 byte header,\n"
+	"\t\t\tthree 32 bit big endian numbers: response size in bytes,\n"
+	"\t\t\tthink time in microseconds, and number of request bytes\n"
+	"\t\t\tfollowing the header (ignored); requests may be\n"
+	"\t\t\tpipelined; optional parameters:\n"
+	"\t\t\t\t-b $bytes - size of response buffer (1048576)\n"
+	"\t\t\t\t-p $num - most requests outstanding per connection (256)\n"
+	"\t\tfile - sends the contents of a file, then closes; parameters:\n"
+	"\t\t\t\t-f $path - file to send; if given more than once, each\n"
+	"\t\t\t\t\tconnection gets the next one in turn\n"
+	"\t\t\t\t-o $bytes - offset in the file to start at (0)\n"
+	"\t\t\t\t-l $bytes - most bytes to send (0 = all)\n"
 	"\t$addr - optionally, one or more addresses/ports\n"
 	"\t\tIf none specified, uses default.\n"
 	"\t\tMay take the following forms:\n"
@@ -123,12 +231,241 @@ struct {
 #endif
   int numeric;
   int sigusr2_pending;
+  char *stats_file;
+  long long quantum; /* bytes per connection per loop, times weight (-Q) */
+  long long time_budget; /* microseconds handling connections per loop */
+  int weight; /* connection weight if not the protocol's default (-w) */
+  long long lag_limit; /* threaded: worker overloaded above this (-L) */
+  long long depth_limit; /* threaded: or above this (-D) */
+  int backlog; /* listen() backlog (-B) */
+  int fastopen; /* TCP Fast Open queue length (-F) */
+  int kecho; /* echo in the kernel (-K) */
 } gparm;
 
+#define New(v) v=malloc(sizeof(*(v)));if(!v){perror("memory management failure");exit(2);};memset(v,0,sizeof(*(v)))
+
 #define VERBOSE_EXTRA_BIT(c) (1ULL << (c & 63))
 #define MAYBE_VERBOSE(l,c) (gparm.verbose >= l || (gparm.verbose_extra & VERBOSE_EXTRA_BIT(c)))
 
-static long long usnow; /* time in microseconds since the epoch (1970) */
+static __thread long long usnow; /* time in microseconds since the epoch (1970) */
+
+/* Logging: Diagnostics that come up while serving connections go through
+ * slog(), not straight to stderr.  Each thread formats its messages into
+ * its own buffer, and a background thread writes the buffers to stderr
+ * every LOG_FLUSH_USEC, or sooner if one is filling up.  Each category
+ * of message -- the same characters as -V uses -- is limited to
+ * 'logs.rate' messages per second in each thread (-R).  Messages over
+ * that, or that don't fit in the buffer, are dropped and counted.
+ * Messages from startup, or just before exiting, still go to stderr.
+ */
+#define LOG_BUFSZ 65536
+#define LOG_FLUSH_USEC 50000
+#define LOG_RATE_MAX 1000000000LL /* most -R; so rate * 10^6 can't overflow */
+
+struct logbuf {
+  /* one thread's log buffer */
+  struct logbuf *next; /* list of them all */
+  pthread_mutex_t lock; /* for buf & len */
+  char buf[LOG_BUFSZ];
+  int len;
+};
+
+static struct {
+  pthread_mutex_t lock; /* for 'bufs' and 'cond' */
+  pthread_cond_t cond; /* to wake up the flusher early */
+  struct logbuf *bufs; /* every thread's buffer */
+  int running; /* is the flusher thread running? */
+  long long rate; /* most messages per second per category (-R); 0 no limit */
+  long long dropped; /* messages dropped */
+  long long dropped_told; /* and how many of those we've said so */
+} logs = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static pthread_mutex_t log_outlock = PTHREAD_MUTEX_INITIALIZER;
+  /* held while log_flush() writes */
+static __thread struct logbuf *mylog; /* this thread's buffer */
+static __thread struct {
+  long long tokens[64]; /* messages allowed, times 10^6, per category */
+  long long last[64]; /* usnow when tokens[] was last filled */
+} lograte;
+
+/* log_flush(): write out what's in the log buffers */
+static void log_flush(void)
+{
+  static char out[LOG_BUFSZ];
+  struct logbuf *lb;
+  long long d;
+  int len;
+
+  pthread_mutex_lock(&log_outlock);
+  pthread_mutex_lock(&logs.lock);
+  for (lb = logs.bufs; lb; lb = lb->next) {
+    pthread_mutex_lock(&lb->lock);
+    len = lb->len;
+    memcpy(out, lb->buf, len);
+    lb->len = 0;
+    pthread_mutex_unlock(&lb->lock);
+    if (len > 0 && write(2, out, len) < 0) {
+      /* nowhere to report it */
+    }
+  }
+  pthread_mutex_unlock(&logs.lock);
+  d = __atomic_load_n(&logs.dropped, __ATOMIC_RELAXED);
+  if (d != logs.dropped_told) {
+    len = snprintf(out, sizeof(out), "(%lld log messages dropped)\n",
+		   d - logs.dropped_told);
+    logs.dropped_told = d;
+    if (write(2, out, len) < 0) {
+      /* nowhere to report it */
+    }
+  }
+  pthread_mutex_unlock(&log_outlock);
+}
+
+/* log_flusher(): body of the thread that writes out the log buffers */
+static void *log_flusher(void *arg)
+{
+  struct timespec ts;
+  struct timeval tv;
+
+  for (;;) {
+    gettimeofday(&tv, NULL);
+    ts.tv_sec = tv.tv_sec;
+    ts.tv_nsec = (tv.tv_usec + LOG_FLUSH_USEC) * 1000LL;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&logs.lock);
+    pthread_cond_timedwait(&logs.cond, &logs.lock, &ts);
+    pthread_mutex_unlock(&logs.lock);
+    log_flush();
+  }
+  return(NULL);
+}
+
+/* log_start(): start the log flusher thread (again, after fork()) */
+static void log_start(void)
+{
+  pthread_t th;
+  int rv;
+
+  if ((rv = pthread_create(&th, NULL, &log_flusher, NULL)) != 0) {
+    fprintf(stderr, "pthread_create: %s\n", strerror(rv));
+    exit(2);
+  }
+  pthread_detach(th);
+  logs.running = 1;
+}
+
+/* fork() handlers: hold the logging locks across it, so the child
+ * doesn't get them in the middle of something (including a flush in
+ * progress).  The child then has no flusher thread, until it calls
+ * log_start(); and it starts with empty buffers, since what's in them
+ * is the parent's to write out.
+ */
+static void log_atfork_prepare(void)
+{
+  struct logbuf *lb;
+
+  pthread_mutex_lock(&log_outlock);
+  pthread_mutex_lock(&logs.lock);
+  for (lb = logs.bufs; lb; lb = lb->next) {
+    pthread_mutex_lock(&lb->lock);
+  }
+}
+
+static void log_atfork_parent(void)
+{
+  struct logbuf *lb;
+
+  for (lb = logs.bufs; lb; lb = lb->next) {
+    pthread_mutex_unlock(&lb->lock);
+  }
+  pthread_mutex_unlock(&logs.lock);
+  pthread_mutex_unlock(&log_outlock);
+}
+
+static void log_atfork_child(void)
+{
+  struct logbuf *lb;
+
+  for (lb = logs.bufs; lb; lb = lb->next) {
+    lb->len = 0;
+  }
+  logs.dropped = logs.dropped_told = 0; /* the parent reports those */
+  log_atfork_parent();
+  logs.running = 0;
+}
+
+/* slog(): log a message, of category 'c' */
+static void slog(int c, const char *fmt, ...)
+{
+  va_list ap;
+  struct logbuf *lb;
+  int n, room;
+  long long *tok, dt;
+
+  /* rate limit, by category */
+  if (logs.rate > 0) {
+    tok = &(lograte.tokens[c & 63]);
+    /* the bucket holds one second's worth, so any longer is the same;
+     * that includes a category's first message, when last[] is 0 */
+    dt = usnow - lograte.last[c & 63];
+    if (dt > 1000000) {
+      dt = 1000000;
+    } else if (dt < 0) {
+      dt = 0;
+    }
+    *tok += dt * logs.rate;
+    lograte.last[c & 63] = usnow;
+    if (*tok > logs.rate * 1000000) {
+      *tok = logs.rate * 1000000;
+    }
+    if (*tok < 1000000) {
+      __atomic_add_fetch(&logs.dropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    *tok -= 1000000;
+  }
+
+  if (!logs.running) {
+    /* no flusher thread (yet); just write it */
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    return;
+  }
+
+  if (!(lb = mylog)) {
+    /* this thread's first message: give it a buffer */
+    New(lb);
+    pthread_mutex_init(&lb->lock, NULL);
+    pthread_mutex_lock(&logs.lock);
+    lb->next = logs.bufs;
+    logs.bufs = lb;
+    pthread_mutex_unlock(&logs.lock);
+    mylog = lb;
+  }
+
+  pthread_mutex_lock(&lb->lock);
+  room = LOG_BUFSZ - lb->len;
+  va_start(ap, fmt);
+  n = vsnprintf(lb->buf + lb->len, room, fmt, ap);
+  va_end(ap);
+  if (n < 0 || n >= room) {
+    n = -1; /* didn't fit */
+  } else {
+    lb->len += n;
+  }
+  room = lb->len;
+  pthread_mutex_unlock(&lb->lock);
+  if (n < 0) {
+    __atomic_add_fetch(&logs.dropped, 1, __ATOMIC_RELAXED);
+  }
+  if (room > LOG_BUFSZ / 2) {
+    pthread_cond_signal(&logs.cond); /* getting full; flush now */
+  }
+}
 
 static void backoff_delay(int magnitude);
 
@@ -143,12 +480,12 @@ static void update_usnow(void)
   usnow = tv.tv_sec;
   usnow = usnow * 1000000 + tv.tv_usec;
   if (MAYBE_VERBOSE(2,'u')) {
-    fprintf(stderr, "usnow=%lld\n", (long long)usnow);
+    slog('u', "usnow=%lld\n", (long long)usnow);
   }
 }
 
 #define BACKOFF_USEC_INITIAL 1000
-static long long backoff_usec = BACKOFF_USEC_INITIAL;
+static __thread long long backoff_usec = BACKOFF_USEC_INITIAL;
 static void backoff_delay(int magnitude)
 {
   long long usold = usnow, sleepfor, elapsed;
@@ -174,21 +511,381 @@ static void backoff_delay(int magnitude)
     backoff_usec = 250000;
   }
   if (MAYBE_VERBOSE(1,'b')) {
-    fprintf(stderr, "Backoff delay %lld usec\n", (long long)backoff_usec);
+    slog('b', "Backoff delay %lld usec\n", (long long)backoff_usec);
   }
   usleep(sleepfor);
 }
 
-#define New(v) v=malloc(sizeof(*(v)));if(!v){perror("memory management failure");exit(2);};memset(v,0,sizeof(*(v)))
+#define STATS_HIST 32
+struct stdstats {
+  /* statistics, counted since the process started, for the -S file;
+   * in threaded mode, each thread counts its own
+   */
+  long long accepts, closes; /* connections */
+  long long reads, writes; /* successful calls */
+  long long bytes_in, bytes_out; /* bytes in those calls */
+  long long errors; /* fatal errors on connections */
+  long long timers; /* timer callbacks run */
+  long long deferred; /* connections put off by the -T time budget */
+  long long migrations; /* connections handed to another worker thread */
+  long long loop_hist[STATS_HIST]; /* time handling each select() result:
+				    * [0] under 1 usec, [i] under 2^i usec */
+  long long next_write; /* when to next write the file (usnow) */
+};
+static __thread struct stdstats stats;
+
+/* Counting in 'stats': each thread is the only one that changes its own,
+ * but another thread reads them for the -S file (stats_sum_workers()).
+ * So the counts are changed, and read from elsewhere, with relaxed atomic
+ * loads & stores: race free, but with no locked instructions, since
+ * there's only one writer.
+ */
+#define STAT_ADD(f, n) \
+  __atomic_store_n(&(f), __atomic_load_n(&(f), __ATOMIC_RELAXED) + (n), \
+		   __ATOMIC_RELAXED)
+#define STAT_GET(f) __atomic_load_n(&(f), __ATOMIC_RELAXED)
+
+/* Listen queue statistics, kept by the thread that accepts connections.
+ * How many connections are waiting to be accepted, on all the sockets
+ * we listen on, is sampled each time one of them is ready and once a
+ * second.  The kernel's counts of connections it dropped because a
+ * listen queue was full are for the whole network namespace, not just
+ * our sockets, but they're what tells you the queue overflowed; they
+ * come from /proc/net/netstat.
+ */
+static struct {
+  int active; /* are we listening at all? */
+  long long qlen; /* connections waiting, on all listen sockets */
+  long long qmax; /* largest that's allowed to get (the backlog) */
+  long long qhigh; /* most seen waiting on one of them */
+  long long overflows, drops; /* ListenOverflows, ListenDrops */
+  long long overflows0, drops0; /* their values when we started */
+  long long last_overflows; /* 'overflows' at the last check */
+  long long alerts; /* times we logged a listen queue alert */
+  long long next_check; /* when to check again (usnow) */
+} lq;
+
+#ifdef HAVE_BPF
+/* In-kernel echo (-K): each accepted IPv4 "echo" connection is put in a
+ * BPF sockhash, which has a stream parser & verdict program attached that
+ * send whatever arrives back out the same socket, so we aren't woken up
+ * for it.  The verdict program also counts bytes & messages in an array
+ * map, which stats_write() reads.  The programs are only a few
+ * instructions, assembled here, so this needs only the kernel (4.18 or
+ * later) and root, not libbpf or a BPF compiler.
+ *
+ * The connection keeps its usual echo callbacks: they see it closed,
+ * and echo anything that reached it before it was in the sockhash.
+ * The kernel takes it out of the sockhash when it's closed.
+ */
+struct bpfecho_key {
+  /* sockhash key; the same as the verdict program builds from the skb */
+  uint32_t rip4, lip4; /* addresses (network byte order) */
+  uint32_t rport; /* remote port (32 bit network byte order) */
+  uint32_t lport; /* local port (host byte order) */
+};
+
+struct bpfecho_counts {
+  /* array map value; the verdict program adds to these */
+  uint64_t bytes, msgs;
+};
 
 static struct {
+  int active; /* is -K in effect? */
+  int sockhash, counts; /* map file descriptors */
+  long long added, failed; /* sockets put in the sockhash, or not */
+} bpfecho;
+
+static int bpfecho_sys(int cmd, union bpf_attr *attr)
+{
+  return(syscall(__NR_bpf, cmd, attr, sizeof(*attr)));
+}
+
+static int bpfecho_map(int type, int ksz, int vsz, int n)
+{
+  union bpf_attr a;
+
+  memset(&a, 0, sizeof(a));
+  a.map_type = type;
+  a.key_size = ksz;
+  a.value_size = vsz;
+  a.max_entries = n;
+  return(bpfecho_sys(BPF_MAP_CREATE, &a));
+}
+
+/* bpfecho_prog(): load a BPF_PROG_TYPE_SK_SKB program & attach it to the
+ * sockhash; on failure, shows why and exits */
+static void bpfecho_prog(struct bpf_insn *insns, int n, int attach,
+			 char *what)
+{
+  static char vlog[65536];
+  union bpf_attr a;
+  int fd;
+
+  memset(&a, 0, sizeof(a));
+  a.prog_type = BPF_PROG_TYPE_SK_SKB;
+  a.insns = (uintptr_t)insns;
+  a.insn_cnt = n;
+  a.license = (uintptr_t)"Dual BSD/GPL";
+  if ((fd = bpfecho_sys(BPF_PROG_LOAD, &a)) < 0) {
+    fprintf(stderr, "-K: loading %s program: %s\n", what, strerror(errno));
+    if (gparm.verbose) {
+      /* again, to get the verifier's explanation */
+      a.log_buf = (uintptr_t)vlog;
+      a.log_size = sizeof(vlog);
+      a.log_level = 1;
+      bpfecho_sys(BPF_PROG_LOAD, &a);
+      fprintf(stderr, "%s", vlog);
+    }
+    exit(1);
+  }
+  memset(&a, 0, sizeof(a));
+  a.target_fd = bpfecho.sockhash;
+  a.attach_bpf_fd = fd;
+  a.attach_type = attach;
+  if (bpfecho_sys(BPF_PROG_ATTACH, &a) < 0) {
+    fprintf(stderr, "-K: attaching %s program: %s\n", what, strerror(errno));
+    exit(1);
+  }
+}
+
+#define BI(c, d, s, o, i) \
+  ((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s), \
+		      .off = (o), .imm = (i) })
+#define BI_SKB(f) offsetof(struct __sk_buff, f)
+
+/* bpfecho_start(): set up the maps & programs for -K */
+static void bpfecho_start(void)
+{
+  if ((bpfecho.counts = bpfecho_map(BPF_MAP_TYPE_ARRAY, sizeof(uint32_t),
+				    sizeof(struct bpfecho_counts), 1)) < 0 ||
+      (bpfecho.sockhash = bpfecho_map(BPF_MAP_TYPE_SOCKHASH,
+				      sizeof(struct bpfecho_key),
+				      sizeof(uint32_t), 65536)) < 0) {
+    fprintf(stderr, "-K: creating BPF maps: %s\n", strerror(errno));
+    exit(1);
+  }
+
+  {
+    /* stream parser: each message is whatever has arrived */
+    struct bpf_insn parser[] = {
+      BI(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_0, BPF_REG_1, BI_SKB(len), 0),
+      BI(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+    /* verdict: count it, and redirect it to the socket whose key matches
+     * the skb's addresses -- the one it came in on */
+    struct bpf_insn verdict[] = {
+      BI(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+      BI(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6,
+	 BI_SKB(remote_ip4), 0),
+      BI(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, -16, 0),
+      BI(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6,
+	 BI_SKB(local_ip4), 0),
+      BI(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, -12, 0),
+      BI(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6,
+	 BI_SKB(remote_port), 0),
+      BI(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, -8, 0),
+      BI(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6,
+	 BI_SKB(local_port), 0),
+      BI(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, -4, 0),
+      /* counts[0].bytes += len; counts[0].msgs += 1 */
+      BI(BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0, -20, 0),
+      BI(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0,
+	 bpfecho.counts),
+      BI(0, 0, 0, 0, 0),
+      BI(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+      BI(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -20),
+      BI(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+      BI(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 4, 0),
+      BI(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_1, BPF_REG_6, BI_SKB(len), 0),
+      BI(BPF_STX | BPF_XADD | BPF_DW, BPF_REG_0, BPF_REG_1, 0, 0),
+      BI(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_1, 0, 0, 1),
+      BI(BPF_STX | BPF_XADD | BPF_DW, BPF_REG_0, BPF_REG_1, 8, 0),
+      /* return bpf_sk_redirect_hash(skb, sockhash, &key, 0) */
+      BI(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_2, BPF_PSEUDO_MAP_FD, 0,
+	 bpfecho.sockhash),
+      BI(0, 0, 0, 0, 0),
+      BI(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+      BI(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0),
+      BI(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -16),
+      BI(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0),
+      BI(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_redirect_hash),
+      BI(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+
+    bpfecho_prog(parser, sizeof(parser) / sizeof(parser[0]),
+		 BPF_SK_SKB_STREAM_PARSER, "stream parser");
+    bpfecho_prog(verdict, sizeof(verdict) / sizeof(verdict[0]),
+		 BPF_SK_SKB_STREAM_VERDICT, "stream verdict");
+  }
+  bpfecho.active = 1;
+}
+
+/* bpfecho_add(): put an accepted socket in the sockhash, if it's IPv4 */
+static void bpfecho_add(int sok)
+{
+  struct sockaddr_in rsin, lsin;
+  socklen_t rlen = sizeof(rsin), llen = sizeof(lsin);
+  struct bpfecho_key k;
+  uint32_t v = sok;
+  union bpf_attr a;
+
+  if (getpeername(sok, (struct sockaddr *)&rsin, &rlen) < 0 ||
+      getsockname(sok, (struct sockaddr *)&lsin, &llen) < 0 ||
+      rsin.sin_family != AF_INET || lsin.sin_family != AF_INET) {
+    __atomic_fetch_add(&bpfecho.failed, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  memset(&k, 0, sizeof(k));
+  k.rip4 = rsin.sin_addr.s_addr;
+  k.lip4 = lsin.sin_addr.s_addr;
+  k.rport = htonl(ntohs(rsin.sin_port));
+  k.lport = ntohs(lsin.sin_port);
+  memset(&a, 0, sizeof(a));
+  a.map_fd = bpfecho.sockhash;
+  a.key = (uintptr_t)&k;
+  a.value = (uintptr_t)&v;
+  a.flags = BPF_ANY;
+  if (bpfecho_sys(BPF_MAP_UPDATE_ELEM, &a) < 0) {
+    slog('e', "-K: adding socket %d to sockhash: %s\n", sok, strerror(errno));
+    __atomic_fetch_add(&bpfecho.failed, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  __atomic_fetch_add(&bpfecho.added, 1, __ATOMIC_RELAXED);
+}
+
+/* bpfecho_counts(): read the verdict program's counts */
+static void bpfecho_counts(struct bpfecho_counts *c)
+{
+  uint32_t k = 0;
+  union bpf_attr a;
+
+  memset(c, 0, sizeof(*c));
+  memset(&a, 0, sizeof(a));
+  a.map_fd = bpfecho.counts;
+  a.key = (uintptr_t)&k;
+  a.value = (uintptr_t)c;
+  bpfecho_sys(BPF_MAP_LOOKUP_ELEM, &a);
+}
+#endif /* HAVE_BPF */
+
+struct worker; /* see below */
+static struct worker *workers; /* worker threads (-t) */
+static int nworkers;
+static void stats_sum_workers(struct stdstats *sum, int *nconns);
+
+/* stats_hist_add(): count a duration in a histogram of the 'stats' kind */
+static void stats_hist_add(long long *hist, long long usec)
+{
+  int i;
+  for (i = 0; i < STATS_HIST - 1 && usec >= (1LL << i); ++i)
+    ;
+  STAT_ADD(hist[i], 1);
+}
+
+/* stats_file_name(): name of the -S file for this process */
+static void stats_file_name(char *buf, int bufsz, int we_are_child)
+{
+  if (we_are_child) {
+    snprintf(buf, bufsz, "%s.%d", gparm.stats_file, (int)getpid());
+  } else {
+    snprintf(buf, bufsz, "%s", gparm.stats_file);
+  }
+}
+
+/* stats_write(): write out the -S statistics file, if it's due.  It's
+ * written to a temporary file and renamed, so a reader never sees
+ * part of one.
+ */
+static void stats_write(int nconns, int we_are_child)
+{
+  char path[512], tmp[528];
+  FILE *fp;
+  int i;
+  struct stdstats st;
+
+  if (!gparm.stats_file || usnow < stats.next_write) {
+    return;
+  }
+  stats.next_write = usnow + 1000000;
+  st = stats;
+  if (nworkers > 0) {
+    stats_sum_workers(&st, &nconns);
+  }
+  stats_file_name(path, sizeof(path), we_are_child);
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  if (!(fp = fopen(tmp, "w"))) {
+    if (gparm.verbose) {
+      fprintf(stderr, "%s: %s\n", tmp, strerror(errno));
+    }
+    return;
+  }
+  fprintf(fp, "stdserve\n"
+	  "pid %d\n"
+	  "time_us %lld\n"
+	  "conns %d\n"
+	  "accepts %lld\n"
+	  "closes %lld\n"
+	  "reads %lld\n"
+	  "writes %lld\n"
+	  "bytes_in %lld\n"
+	  "bytes_out %lld\n"
+	  "errors %lld\n"
+	  "timers %lld\n"
+	  "deferred %lld\n"
+	  "migrations %lld\n"
+	  "log_dropped %lld\n"
+	  "loop_hist",
+	  (int)getpid(), usnow, nconns,
+	  st.accepts, st.closes, st.reads, st.writes,
+	  st.bytes_in, st.bytes_out, st.errors, st.timers,
+	  st.deferred, st.migrations,
+	  __atomic_load_n(&logs.dropped, __ATOMIC_RELAXED));
+  for (i = 0; i < STATS_HIST; ++i) {
+    fprintf(fp, " %lld", st.loop_hist[i]);
+  }
+  fputc('\n', fp);
+  if (lq.active) {
+    fprintf(fp, "listen_qlen %lld\n"
+	    "listen_qmax %lld\n"
+	    "listen_qhigh %lld\n"
+	    "listen_overflows %lld\n"
+	    "listen_drops %lld\n"
+	    "listen_alerts %lld\n",
+	    lq.qlen, lq.qmax, lq.qhigh,
+	    lq.overflows, lq.drops, lq.alerts);
+  }
+#ifdef HAVE_BPF
+  if (bpfecho.active) {
+    struct bpfecho_counts bc;
+
+    bpfecho_counts(&bc);
+    fprintf(fp, "kecho_socks %lld\n"
+	    "kecho_failed %lld\n"
+	    "kecho_bytes %llu\n"
+	    "kecho_msgs %llu\n",
+	    __atomic_load_n(&bpfecho.added, __ATOMIC_RELAXED),
+	    __atomic_load_n(&bpfecho.failed, __ATOMIC_RELAXED),
+	    (unsigned long long)bc.bytes, (unsigned long long)bc.msgs);
+  }
+#endif
+  if (fclose(fp) != 0 || rename(tmp, path) < 0) {
+    if (gparm.verbose) {
+      fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    }
+    unlink(tmp);
+  }
+}
+
+struct prngstate {
   /* State for the *rand48() pseudo random number generator.
    *	xsubi - the current state
-   *	branch - state for when a new process gets forked
+   *	branch - state for when a new process (or thread) gets forked
    */
   unsigned short xsubi[3];
   unsigned short branch[9];
-} prng;
+};
+static __thread struct prngstate prng;
 
 static void prngmunge(void)
 {
@@ -281,6 +978,7 @@ struct protinfo {
   void *usr; /* arbitrary argument for the callback functions */
   struct protinst *(*initproc)(struct protinfo *pi, int argc, char **argv, int *argi); /* create context; parse arguments (using getopt()); any other setup */
   int defport; /* default TCP port number */
+  int weight; /* default weight of its connections, for -Q */
 };
 
 struct protinst {
@@ -309,6 +1007,10 @@ struct conninfo {
   enum connstatus (*writeproc)(struct conninfo *ci);
   long long timer; /* microsecond time to run timerproc() if there is one */
   enum connstatus (*timerproc)(struct conninfo *ci);
+  long long accepted; /* microsecond time it was accepted */
+  int weight; /* share of I/O it gets with -Q */
+  long long deficit; /* bytes it may still transfer with -Q */
+  int activity; /* callbacks run lately, for threaded load balancing */
 
   struct conninfo *next; /* so we can link these into a list */
 };
@@ -351,32 +1053,39 @@ static enum connstatus conn_read(struct conninfo *ci,
 {
   int rv;
   if (got) { *got = 0; }
-  if (gparm.verbose > 1) {
-    fprintf(stderr, "read(%d, %p, %d)\n", ci->sok, buf, (int)bufsz);
+  if (gparm.quantum > 0 && bufsz > ci->deficit) {
+    bufsz = ci->deficit; /* the main loop makes sure it's at least 1 */
+  }
+  if (MAYBE_VERBOSE(2, 'i')) {
+    slog('i', "read(%d, %p, %d)\n", ci->sok, buf, (int)bufsz);
   }
   rv = read(ci->sok, buf, bufsz);
+  TRACE3(read, ci->sok, rv, rv < 0 ? errno : 0);
   if (rv < 0) {
     if (errno == EAGAIN || errno == EINTR) {
       return(cs_transient);
     } else if (errno == ECONNRESET || errno == EPIPE) {
       return(cs_close);
     } else {
-      fprintf(stderr, "read%s: %s\n",
-	      ci->label ? ci->label : "", strerror(errno));
+      slog('e', "read%s: %s\n",
+	   ci->label ? ci->label : "", strerror(errno));
       return(cs_fatal);
     }
   }
-  if (gparm.verbose > 1) {
-    fprintf(stderr, "read() returned %d\n", (int)rv);
+  if (MAYBE_VERBOSE(2, 'i')) {
+    slog('i', "read() returned %d\n", (int)rv);
   }
   if (rv == 0) {
     return(cs_close);
   }
   if (rv > bufsz) {
-    fprintf(stderr, "read%s: internal error, buffer size\n",
-	    ci->label ? ci->label : "");
+    slog('e', "read%s: internal error, buffer size\n",
+	 ci->label ? ci->label : "");
     return(cs_fatal);
   }
+  STAT_ADD(stats.reads, 1);
+  STAT_ADD(stats.bytes_in, rv);
+  ci->deficit -= rv;
   if (got) { *got = rv; }
   return(cs_ok);
 }
@@ -387,36 +1096,102 @@ static enum connstatus conn_write(struct conninfo *ci, char *buf,
 {
   int rv;
   if (wrote) { *wrote = 0; }
-  if (gparm.verbose > 1) {
-    fprintf(stderr, "write(%d, %p, %d)\n", ci->sok, buf, (int)len);
+  if (gparm.quantum > 0 && len > ci->deficit) {
+    len = ci->deficit; /* the main loop makes sure it's at least 1 */
+  }
+  if (MAYBE_VERBOSE(2, 'i')) {
+    slog('i', "write(%d, %p, %d)\n", ci->sok, buf, (int)len);
   }
   rv = write(ci->sok, buf, len);
+  TRACE3(write, ci->sok, rv, rv < 0 ? errno : 0);
   if (rv < 0) {
     if (errno == EAGAIN || errno == EINTR) {
       return(cs_transient);
     } else if (errno == ECONNRESET || errno == EPIPE) {
       return(cs_close);
     } else {
-      fprintf(stderr, "write%s: %s\n",
-	      ci->label ? ci->label : "", strerror(errno));
+      slog('e', "write%s: %s\n",
+	   ci->label ? ci->label : "", strerror(errno));
       return(cs_fatal);
     }
   }
-  if (gparm.verbose > 1) {
-    fprintf(stderr, "write() returned %d\n", (int)rv);
+  if (MAYBE_VERBOSE(2, 'i')) {
+    slog('i', "write() returned %d\n", (int)rv);
   }
   if (rv == 0) {
     return(cs_close);
   }
   if (rv > len) {
-    fprintf(stderr, "write%s: internal error, buffer size\n",
-	    ci->label ? ci->label : "");
+    slog('e', "write%s: internal error, buffer size\n",
+	 ci->label ? ci->label : "");
     return(cs_fatal);
   }
+  STAT_ADD(stats.writes, 1);
+  STAT_ADD(stats.bytes_out, rv);
+  ci->deficit -= rv;
   if (wrote) { *wrote = rv; }
   return(cs_ok);
 }
 
+/* conn_sendfile(): send data from a file on a connection, starting at
+ * offset *off in the file, and advancing *off by however much was sent.
+ * This is meant for a nonblocking socket: when there's no room to send
+ * anything, that's not an error, it just sends nothing.  Uses sendfile()
+ * where available, so the data isn't copied through here.
+ */
+static enum connstatus conn_sendfile(struct conninfo *ci, int fd, off_t *off,
+				     long long len, long long *wrote)
+{
+  ssize_t rv;
+#ifndef HAVE_SENDFILE
+  char buf[65536];
+#endif
+
+  *wrote = 0;
+  if (gparm.quantum > 0 && len > ci->deficit) {
+    len = ci->deficit; /* the main loop makes sure it's at least 1 */
+  }
+  if (MAYBE_VERBOSE(2, 'i')) {
+    slog('i', "sendfile(%d, %d, %lld, %lld)\n",
+	 ci->sok, fd, (long long)*off, len);
+  }
+#ifdef HAVE_SENDFILE
+  if (len > 0x7ffff000) { len = 0x7ffff000; } /* Linux's limit */
+  rv = sendfile(ci->sok, fd, off, len);
+#else
+  if (len > sizeof(buf)) { len = sizeof(buf); }
+  rv = pread(fd, buf, len, *off);
+  if (rv > 0) {
+    rv = write(ci->sok, buf, rv);
+    if (rv > 0) { *off += rv; }
+  }
+#endif
+  TRACE3(write, ci->sok, (int)rv, rv < 0 ? errno : 0);
+  if (rv < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+      return(cs_ok);
+    } else if (errno == ECONNRESET || errno == EPIPE) {
+      return(cs_close);
+    } else {
+      slog('e', "sendfile%s: %s\n",
+	   ci->label ? ci->label : "", strerror(errno));
+      return(cs_fatal);
+    }
+  }
+  if (MAYBE_VERBOSE(2, 'i')) {
+    slog('i', "sendfile() returned %lld\n", (long long)rv);
+  }
+  if (rv == 0) {
+    /* the file must have gotten shorter */
+    return(cs_close);
+  }
+  STAT_ADD(stats.writes, 1);
+  STAT_ADD(stats.bytes_out, rv);
+  ci->deficit -= rv;
+  *wrote = rv;
+  return(cs_ok);
+}
+
 static enum connstatus echo_write(struct conninfo *ci);
 
 /* echo_read(): receive data in the ECHO protocol */
@@ -426,8 +1201,8 @@ static enum connstatus echo_read(struct conninfo *ci)
   enum connstatus cs;
 
   if ((cs = conn_read(ci, ob->buf, sizeof(ob->buf), &(ob->num))) != cs_ok) {
-    if (gparm.verbose > 1) {
-      fprintf(stderr, "echo_read() got status %d\n", (int)cs);
+    if (MAYBE_VERBOSE(2, 'p')) {
+      slog('p', "echo_read() got status %d\n", (int)cs);
     }
     return(cs);
   }
@@ -435,9 +1210,9 @@ static enum connstatus echo_read(struct conninfo *ci)
   if (ob->num > 0) {
     ci->readproc = NULL;
     ci->writeproc = &echo_write;
-    if (gparm.verbose > 1) {
-      fprintf(stderr, "echo_read(), conn '%s' has %d bytes, ready to write\n",
-	      ci->label, (int)ob->num);
+    if (MAYBE_VERBOSE(2, 'p')) {
+      slog('p', "echo_read(), conn '%s' has %d bytes, ready to write\n",
+	   ci->label, (int)ob->num);
     }
   }
   return(cs_ok);
@@ -469,8 +1244,8 @@ static struct conninfo *echo_conn(struct protinst *pi, int sok)
   struct conninfo *ci;
   struct onebuf *ob;
 
-  if (gparm.verbose > 1) {
-    fprintf(stderr, "echo_conn()\n");
+  if (MAYBE_VERBOSE(2, 'p')) {
+    slog('p', "echo_conn()\n");
   }
   New(ci);
   New(ob);
@@ -478,6 +1253,11 @@ static struct conninfo *echo_conn(struct protinst *pi, int sok)
   ci->sok = sok;
   ci->label = NULL; /* will be filled in later */
   ob->num = ob->used = 0;
+#ifdef HAVE_BPF
+  if (bpfecho.active) {
+    bpfecho_add(sok);
+  }
+#endif
   ci->closeproc = &simple_close;
   ci->readproc = &echo_read;
   ci->writeproc = NULL; /* will be set when there's something to write */
@@ -497,8 +1277,8 @@ static struct conninfo *disc_conn(struct protinst *pi, int sok)
 {
   struct conninfo *ci;
 
-  if (gparm.verbose > 1) {
-    fprintf(stderr, "disc_conn()\n");
+  if (MAYBE_VERBOSE(2, 'p')) {
+    slog('p', "disc_conn()\n");
   }
   New(ci);
   ci->sok = sok;
@@ -552,11 +1332,11 @@ static struct conninfo *daytime_conn(struct protinst *pi, int sok)
   struct conninfo *ci;
   struct onetime *ot;
   int bufsz = 128;
-  struct tm *tm;
+  struct tm *tm, tmbuf;
   time_t t;
 
-  if (gparm.verbose > 1) {
-    fprintf(stderr, "daytime_conn()\n");
+  if (MAYBE_VERBOSE(2, 'p')) {
+    slog('p', "daytime_conn()\n");
   }
   New(ci);
   New(ot);
@@ -569,7 +1349,7 @@ static struct conninfo *daytime_conn(struct protinst *pi, int sok)
   }
   ot->wrote = 0;
   t = time(NULL);
-  tm = localtime(&t);
+  tm = localtime_r(&t, &tmbuf);
   
   ot->len = strftime(ot->buf, bufsz, "%a %b %d %H:%M:%S %Y\r\n", tm);
   if (ot->len > bufsz) {
@@ -595,8 +1375,8 @@ static struct conninfo *time_conn(struct protinst *pi, int sok)
   time_t t;
   unsigned tt;
 
-  if (gparm.verbose > 1) {
-    fprintf(stderr, "time_conn()\n");
+  if (MAYBE_VERBOSE(2, 'p')) {
+    slog('p', "time_conn()\n");
   }
   New(ci);
   New(ot);
@@ -645,8 +1425,8 @@ static struct conninfo *qotd_conn(struct protinst *pi, int sok)
   struct qotd *q = pi->usr;
   int i, w, cap;
 
-  if (gparm.verbose > 1) {
-    fprintf(stderr, "qotd_conn()\n");
+  if (MAYBE_VERBOSE(2, 'p')) {
+    slog('p', "qotd_conn()\n");
   }
   New(ci);
   New(ci);
@@ -893,10 +1673,70 @@ struct gen_info {
   long long msg_ctr; /* messages sent so far */
   /* data to be sent */
   char buf[128];
-  int write, wrote; /* bytes written & left to write, in buf */
+  int write, wrote; /* bytes written & left to write, in buf (or rbuf) */
   char hn[128]; /* result of gethostname() if it succeeded */
+  /* record mode (-s) config */
+  int recsz; /* record size in bytes; 0 for text messages */
+  double rate; /* records per second; 0 for no limit */
+  unsigned char *payload; /* every record's payload; shared */
+  unsigned payload_crc; /* CRC-32 of payload */
+  /* record mode state */
+  long long start; /* microsecond time the connection started */
+  long long queued; /* records put in rbuf so far */
+  unsigned char *rbuf; /* records being sent */
+  int rbufsz; /* size of rbuf, a multiple of recsz */
 };
 
+/* Record mode of the "gen" protocol (-s): fixed size binary records,
+ * that are the same every run, and that a client can check:
+ *	bytes 0-3: record size (big endian)
+ *	bytes 4-11: sequence number, from 0 (big endian)
+ *	bytes 12-15: CRC-32 (as in zlib) of the payload followed by bytes 0-11
+ *	bytes 16-: payload, the same in every record
+ * The payload comes first in the CRC so its part is only computed once.
+ * Likewise rbuf holds as many records as fit in GEN_REC_BUF and their
+ * payloads are copied in once; only the headers change after that.
+ */
+#define GEN_REC_HDR 16
+#define GEN_REC_MAX (16 * 1024 * 1024)
+#define GEN_REC_BUF 65536
+
+static unsigned gen_crc_table[256];
+
+/* gen_crc(): continue a CRC-32 (reflected, polynomial 0xedb88320) */
+static unsigned gen_crc(unsigned crc, const unsigned char *p, int len)
+{
+  crc = ~crc;
+  while (len-- > 0) {
+    crc = gen_crc_table[(crc ^ *p++) & 255] ^ (crc >> 8);
+  }
+  return(~crc);
+}
+
+static void gen_put_be(unsigned char *p, unsigned long long v, int len)
+{
+  while (len-- > 0) {
+    p[len] = v & 255;
+    v >>= 8;
+  }
+}
+
+/* gen_rec_fill(): put the next 'n' records' headers in rbuf */
+static void gen_rec_fill(struct gen_info *gi, long long n)
+{
+  unsigned char *p = gi->rbuf;
+  long long i;
+
+  for (i = 0; i < n; ++i, p += gi->recsz) {
+    gen_put_be(p, gi->recsz, 4);
+    gen_put_be(p + 4, gi->queued + i, 8);
+    gen_put_be(p + 12, gen_crc(gi->payload_crc, p, 12), 4);
+  }
+  gi->queued += n;
+  gi->write = n * gi->recsz;
+  gi->wrote = 0;
+}
+
 /* gen_end_timer(): timer callback for "gen" protocol (during termination,
  * not normal operation)
  */
@@ -942,19 +1782,82 @@ static enum connstatus gen_write(struct conninfo *ci)
   return(cs_ok);
 }
 
+static enum connstatus gen_rec_timer(struct conninfo *ci);
+
+/* gen_rec_write(): write records for the "gen" service in record mode */
+static enum connstatus gen_rec_write(struct conninfo *ci)
+{
+  struct gen_info *gi = ci->usr;
+  enum connstatus cs;
+  long long n, due;
+  int wrote;
+
+  if (gi->write <= 0) {
+    /* rbuf has been sent; refill it with as many records as fit & are due */
+    n = gi->rbufsz / gi->recsz;
+    if (gi->nmsg > 0 && n > gi->nmsg - gi->queued) {
+      n = gi->nmsg - gi->queued;
+    }
+    if (gi->rate > 0) {
+      due = (long long)((usnow - gi->start) * gi->rate * 1e-6) + 1;
+      if (n > due - gi->queued) {
+	n = due - gi->queued;
+      }
+    }
+    if (n <= 0) {
+      /* nothing due yet; wait until the next one is */
+      ci->writeproc = NULL;
+      ci->timerproc = &gen_rec_timer;
+      ci->timer = gi->start + (long long)(gi->queued * 1e6 / gi->rate) + 1;
+      return(cs_ok);
+    }
+    gen_rec_fill(gi, n);
+  }
+
+  if ((cs = conn_write(ci, (char *)gi->rbuf + gi->wrote, gi->write,
+		       &wrote)) != cs_ok) {
+    return(cs);
+  }
+  gi->wrote += wrote;
+  gi->write -= wrote;
+  if (gi->write <= 0) {
+    gi->msg_ctr = gi->queued;
+    if (gi->nmsg > 0 && gi->msg_ctr >= gi->nmsg) {
+      /* no next record */
+      ci->writeproc = NULL;
+      if (gi->delay_usec < 1) {
+	return(cs_close);
+      }
+      ci->timerproc = &gen_end_timer;
+      ci->timer = usnow + gi->delay_usec;
+    }
+  }
+  return(cs_ok);
+}
+
+/* gen_rec_timer(): timer callback for "gen" protocol in record mode, when
+ * the next record is due
+ */
+static enum connstatus gen_rec_timer(struct conninfo *ci)
+{
+  ci->writeproc = &gen_rec_write;
+  ci->timerproc = NULL;
+  return(cs_ok);
+}
+
 /* gen_timer(): timer callback for "gen" protocol (during normal operation,
  * not termination)
  */
 static enum connstatus gen_timer(struct conninfo *ci)
 {
   struct gen_info *gi = ci->usr;
-  struct tm *tm;
+  struct tm *tm, tmbuf;
   struct timeval t;
   char tbuf[64];
 
   memset(&t, 0, sizeof(t));
   gettimeofday(&t, NULL);
-  tm = localtime(&(t.tv_sec));
+  tm = localtime_r(&(t.tv_sec), &tmbuf);
   memset(tbuf, 0, sizeof(tbuf));
   strftime(tbuf, sizeof(tbuf), "%F %H:%M:%S", tm);
 
@@ -979,8 +1882,36 @@ static struct conninfo *gen_conn(struct protinst *pi, int sok)
   struct gen_info *gi = pi->usr, *gi2;
 
   New(ci);
-  New(gi2);
   ci->sok = sok;
+  ci->label = NULL; /* will be filled in later */
+  ci->closeproc = &simple_close;
+  ci->readproc = &disc_read;
+
+  if (gi->recsz > 0) {
+    /* record mode: rbuf follows gen_info, so simple_close frees both */
+    int n = (GEN_REC_BUF > gi->recsz) ? GEN_REC_BUF / gi->recsz : 1;
+    unsigned char *p;
+
+    if (!(gi2 = malloc(sizeof(*gi2) + (size_t)n * gi->recsz))) {
+      perror("memory management failure");
+      exit(2);
+    }
+    *gi2 = *gi;
+    gi2->msg_ctr = gi2->queued = 0;
+    gi2->write = gi2->wrote = 0;
+    gi2->start = usnow;
+    gi2->rbuf = (unsigned char *)(gi2 + 1);
+    gi2->rbufsz = n * gi->recsz;
+    for (p = gi2->rbuf; n > 0; --n, p += gi->recsz) {
+      memcpy(p + GEN_REC_HDR, gi->payload, gi->recsz - GEN_REC_HDR);
+    }
+    ci->usr = gi2;
+    ci->writeproc = &gen_rec_write;
+    ci->timerproc = NULL;
+    return(ci);
+  }
+
+  New(gi2);
   *gi2 = *gi;
   gi2->msg_ctr = 0;
   gi2->write = gi2->wrote = 0;
@@ -991,10 +1922,6 @@ static struct conninfo *gen_conn(struct protinst *pi, int sok)
     gi2->hn[0] = '\0';
   }
 
-  ci->label = NULL; /* will be filled in later */
-
-  ci->closeproc = &simple_close;
-  ci->readproc = &disc_read;
   ci->writeproc = NULL;
   ci->timer = usnow;
   ci->timerproc = &gen_timer;
@@ -1049,26 +1976,792 @@ static struct protinst *gen_init(struct protinfo *pi, int argc, char **argv,
     } else if ((1+*argi) < argc && !strcmp(argv[*argi], "-d")) {
       gi->delay_usec = parse_interval_us(argv[1+*argi]);
       *argi += 2;
+    } else if ((1+*argi) < argc && !strcmp(argv[*argi], "-s")) {
+      e = NULL;
+      gi->recsz = strtol(argv[1+*argi], &e, 0);
+      if (gi->recsz < GEN_REC_HDR || gi->recsz > GEN_REC_MAX || (e && *e)) {
+	fprintf(stderr, "Invalid record size %s\n", argv[1+*argi]);
+	exit(1);
+      }
+      *argi += 2;
+    } else if ((1+*argi) < argc && !strcmp(argv[*argi], "-p")) {
+      e = NULL;
+      gi->rate = strtod(argv[1+*argi], &e);
+      if (!(gi->rate >= 0) || (e && *e)) {
+	fprintf(stderr, "Invalid record rate %s\n", argv[1+*argi]);
+	exit(1);
+      }
+      *argi += 2;
     } else {
       /* there must be no more options for "gen" */
       break;
     }
   }
 
-  pinst->connproc = &gen_conn;
+  if (gi->recsz > 0) {
+    /* record mode: make the payload, from a fixed xorshift32 sequence so
+     * it's the same every run, and its CRC */
+    unsigned x = 2463534242U, c;
+    int i, j;
+
+    for (i = 0; i < 256; ++i) {
+      for (c = i, j = 0; j < 8; ++j) {
+	c = (c & 1) ? (c >> 1) ^ 0xedb88320U : (c >> 1);
+      }
+      gen_crc_table[i] = c;
+    }
+    if (!(gi->payload = malloc(gi->recsz - GEN_REC_HDR + 1))) {
+      perror("memory management failure");
+      exit(2);
+    }
+    for (i = 0; i < gi->recsz - GEN_REC_HDR; ++i) {
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      gi->payload[i] = x >> 24;
+    }
+    gi->payload_crc = gen_crc(0, gi->payload, gi->recsz - GEN_REC_HDR);
+  }
+
+  pinst->connproc = &gen_conn;
+  return(pinst);
+}
+
+/* The "delay-echo" protocol: Like ECHO, but each chunk of data that's
+ * received is sent back after a delay.  The chunks are held in a queue
+ * on the connection, and the connection's timer is set to when the first
+ * of them is due; so a connection with data waiting costs memory, but
+ * nothing else until it's due.  The delay is chosen per chunk, but the
+ * data is always sent back in the order it arrived:  a chunk is never due
+ * before the one ahead of it.  When a connection is holding as much data
+ * as it may, it stops reading until some has been sent.
+ */
+enum dlecho_dist { dd_fixed, dd_uniform, dd_lognormal };
+
+struct dlecho {
+  /* configuration of the "delay-echo" protocol */
+  enum dlecho_dist dist; /* how the delay is chosen */
+  double a, b; /* fixed: a; uniform: a to b; log-normal: median a, sigma b */
+  int maxheld; /* most bytes held on one connection */
+};
+
+struct dlecho_chunk {
+  /* one chunk of data, to be sent back at a given time */
+  struct dlecho_chunk *next;
+  long long due; /* when to send it (usnow) */
+  int len, used; /* bytes in data[], and bytes of it already sent */
+  char data[];
+};
+
+struct dlecho_conn {
+  /* state of one "delay-echo" connection */
+  struct dlecho *de; /* configuration */
+  struct dlecho_chunk *head, *tail; /* queue of data to send back */
+  int held; /* bytes in the queue */
+  int eof; /* the other end has finished sending */
+};
+
+/* dlecho_delay(): choose a delay, in microseconds */
+static long long dlecho_delay(struct dlecho *de)
+{
+  double d, u;
+
+  switch (de->dist) {
+  case dd_uniform:
+    d = de->a + erand48(prng.xsubi) * (de->b - de->a);
+    break;
+  case dd_lognormal:
+    /* Box-Muller transform for a normally distributed value */
+    u = 1.0 - erand48(prng.xsubi);
+    d = de->a * exp(de->b * sqrt(-2.0 * log(u)) *
+		    cos(2.0 * M_PI * erand48(prng.xsubi)));
+    break;
+  default:
+    d = de->a;
+    break;
+  }
+  if (!(d < 86400.0)) { d = 86400.0; } /* no delay over a day */
+  return(d * 1000000 + 0.5);
+}
+
+static enum connstatus dlecho_timer(struct conninfo *ci);
+static enum connstatus dlecho_write(struct conninfo *ci);
+
+/* dlecho_read(): receive data in the "delay-echo" protocol, and queue it */
+static enum connstatus dlecho_read(struct conninfo *ci)
+{
+  struct dlecho_conn *dc = ci->usr;
+  struct dlecho_chunk *ck;
+  enum connstatus cs;
+  char buf[4096];
+  int got, room;
+  long long due;
+
+  room = dc->de->maxheld - dc->held;
+  if (room > sizeof(buf)) { room = sizeof(buf); }
+  if (room < 1) { room = 1; }
+  cs = conn_read(ci, buf, room, &got);
+  if (cs == cs_close && dc->head) {
+    /* nothing more coming in; but finish sending what we have */
+    dc->eof = 1;
+    ci->readproc = NULL;
+    return(cs_ok);
+  }
+  if (cs != cs_ok) {
+    return(cs);
+  }
+
+  ck = malloc(sizeof(*ck) + got);
+  if (!ck) {
+    perror("memory management failure");
+    exit(2);
+  }
+  memcpy(ck->data, buf, got);
+  ck->len = got;
+  ck->used = 0;
+  ck->next = NULL;
+  due = usnow + dlecho_delay(dc->de);
+  if (dc->tail) {
+    if (due < dc->tail->due) {
+      due = dc->tail->due; /* keep the data in order */
+    }
+    dc->tail->next = ck;
+  } else {
+    dc->head = ck;
+    if (!ci->writeproc) {
+      ci->timerproc = &dlecho_timer;
+      ci->timer = due;
+    }
+  }
+  ck->due = due;
+  dc->tail = ck;
+  dc->held += got;
+  if (dc->held >= dc->de->maxheld) {
+    ci->readproc = NULL; /* until some of it has been sent */
+  }
+  if (MAYBE_VERBOSE(2, 'D')) {
+    slog('D', "dlecho_read(), conn '%s' queued %d bytes for %lld us,"
+	 " holds %d\n", ci->label, got, due - usnow, dc->held);
+  }
+  return(cs_ok);
+}
+
+/* dlecho_timer(): timer callback for "delay-echo": data is due */
+static enum connstatus dlecho_timer(struct conninfo *ci)
+{
+  ci->timerproc = NULL;
+  ci->writeproc = &dlecho_write;
+  return(cs_ok);
+}
+
+/* dlecho_write(): send due data in the "delay-echo" protocol */
+static enum connstatus dlecho_write(struct conninfo *ci)
+{
+  struct dlecho_conn *dc = ci->usr;
+  struct dlecho_chunk *ck = dc->head;
+  enum connstatus cs;
+  int wrote;
+
+  if ((cs = conn_write(ci, ck->data + ck->used, ck->len - ck->used,
+		       &wrote)) != cs_ok) {
+    return(cs);
+  }
+  ck->used += wrote;
+  if (ck->used < ck->len) {
+    return(cs_ok); /* finish it next time */
+  }
+
+  /* done with this chunk */
+  dc->head = ck->next;
+  if (!dc->head) {
+    dc->tail = NULL;
+  }
+  dc->held -= ck->len;
+  free(ck);
+  if (dc->eof) {
+    if (!dc->head) {
+      return(cs_close);
+    }
+  } else if (dc->held < dc->de->maxheld) {
+    ci->readproc = &dlecho_read;
+  }
+  if (!dc->head) {
+    ci->writeproc = NULL;
+  } else if (dc->head->due > usnow) {
+    ci->writeproc = NULL;
+    ci->timerproc = &dlecho_timer;
+    ci->timer = dc->head->due;
+  }
+  return(cs_ok);
+}
+
+/* dlecho_close(): closeproc for "delay-echo", discards any queued data */
+static void dlecho_close(struct conninfo *ci)
+{
+  struct dlecho_conn *dc = ci->usr;
+  struct dlecho_chunk *ck;
+
+  while ((ck = dc->head) != NULL) {
+    dc->head = ck->next;
+    free(ck);
+  }
+  free(dc);
+}
+
+/* dlecho_conn(): initialize a connection in the "delay-echo" protocol */
+static struct conninfo *dlecho_conn(struct protinst *pi, int sok)
+{
+  struct conninfo *ci;
+  struct dlecho_conn *dc;
+
+  New(ci);
+  New(dc);
+  dc->de = pi->usr;
+  ci->sok = sok;
+  ci->usr = dc;
+  ci->label = NULL; /* will be filled in later */
+  ci->closeproc = &dlecho_close;
+  ci->readproc = &dlecho_read;
+  ci->writeproc = NULL; /* will be set when something's due */
+  ci->timerproc = NULL; /* will be set when something's queued */
+  return(ci);
+}
+
+/* dlecho_init(): initialize the "delay-echo" protocol, parsing its
+ * options
+ */
+static struct protinst *dlecho_init(struct protinfo *pi, int argc,
+				    char **argv, int *argi)
+{
+  struct protinst *pinst;
+  struct dlecho *de;
+  char *e;
+
+  New(pinst);
+  New(de);
+  pinst->usr = de;
+  pinst->connproc = &dlecho_conn;
+
+  de->dist = dd_fixed;
+  de->a = 0.1;
+  de->maxheld = 65536;
+  for (;;) {
+    if ((1+*argi) < argc && !strcmp(argv[*argi], "-d")) {
+      de->dist = dd_fixed;
+      de->a = parse_interval_us(argv[1+*argi]) / 1e+6;
+      *argi += 2;
+    } else if ((1+*argi) < argc && !strcmp(argv[*argi], "-u")) {
+      de->dist = dd_uniform;
+      if (sscanf(argv[1+*argi], "%lf-%lf", &de->a, &de->b) != 2 ||
+	  !(de->a >= 0 && de->b >= de->a)) {
+	fprintf(stderr, "Bad -u argument to 'delay-echo': %s\n",
+		argv[1+*argi]);
+	usage();
+      }
+      *argi += 2;
+    } else if ((1+*argi) < argc && !strcmp(argv[*argi], "-l")) {
+      de->dist = dd_lognormal;
+      if (sscanf(argv[1+*argi], "%lf/%lf", &de->a, &de->b) != 2 ||
+	  !(de->a > 0 && de->b >= 0)) {
+	fprintf(stderr, "Bad -l argument to 'delay-echo': %s\n",
+		argv[1+*argi]);
+	usage();
+      }
+      *argi += 2;
+    } else if ((1+*argi) < argc && !strcmp(argv[*argi], "-m")) {
+      e = NULL;
+      de->maxheld = strtol(argv[1+*argi], &e, 0);
+      if (de->maxheld < 1 || (e && *e)) {
+	fprintf(stderr, "Bad -m argument to 'delay-echo': %s\n",
+		argv[1+*argi]);
+	usage();
+      }
+      *argi += 2;
+    } else {
+      /* there must be no more options for "delay-echo" */
+      break;
+    }
+  }
+  return(pinst);
+}
+
+/* The "rr" (request/response) protocol: The client sends requests, each
+ * of which is a 12 byte header, optionally followed by more bytes which
+ * are ignored.  The header is three 32 bit unsigned numbers, most
+ * significant byte first:
+ *	response size in bytes
+ *	think time in microseconds: how long to wait before responding
+ *	number of request bytes following the header
+ * The server sends back a response of the requested size, whose content
+ * comes from a buffer shared by all connections; it's the chargen
+ * pattern, starting over every 'bufsz' bytes.  A client may send more
+ * requests without waiting for the responses; they're handled in order,
+ * one at a time: a request's think time starts when it's come in and the
+ * response before it has been sent.  When a connection has too many
+ * requests waiting, it stops reading until some are answered.
+ */
+#define RR_HDR 12
+
+struct rr {
+  /* configuration of the "rr" protocol */
+  char *buf; /* response data, shared by all connections */
+  int bufsz; /* size of buf */
+  int maxpend; /* most requests outstanding on a connection */
+};
+
+struct rr_txn {
+  /* a request waiting for its response to be sent */
+  unsigned long think; /* think time, microseconds */
+  long long due; /* when to start sending it (usnow), once it's first */
+  long long left; /* response bytes left to send */
+  long long off; /* and how many have been sent */
+};
+
+struct rr_conn {
+  /* state of one "rr" connection */
+  struct rr *rr; /* configuration */
+  unsigned char hdr[RR_HDR]; /* header of the request being read */
+  int hdrgot; /* bytes of hdr[] read so far */
+  long long skip; /* request bytes after the header, left to read */
+  struct rr_txn *q; /* queue of requests: circular buffer */
+  int qall, qhead, qn; /* its size, its first entry, entries in it */
+  int eof; /* the other end has finished sending */
+};
+
+static enum connstatus rr_timer(struct conninfo *ci);
+static enum connstatus rr_write(struct conninfo *ci);
+
+/* rr_request(): queue up a request that's been read, in "rr" protocol */
+static void rr_request(struct conninfo *ci, struct rr_conn *rc)
+{
+  struct rr_txn *t, *nq;
+  unsigned long size, think;
+  int i;
+
+  size = ((unsigned long)rc->hdr[0] << 24) | (rc->hdr[1] << 16) |
+    (rc->hdr[2] << 8) | rc->hdr[3];
+  think = ((unsigned long)rc->hdr[4] << 24) | (rc->hdr[5] << 16) |
+    (rc->hdr[6] << 8) | rc->hdr[7];
+  rc->skip = ((unsigned long)rc->hdr[8] << 24) | (rc->hdr[9] << 16) |
+    (rc->hdr[10] << 8) | rc->hdr[11];
+
+  if (rc->qn >= rc->qall) {
+    /* queue is full; make it bigger */
+    nq = malloc(sizeof(nq[0]) * rc->qall * 2);
+    if (!nq) {
+      perror("memory management failure");
+      exit(2);
+    }
+    for (i = 0; i < rc->qn; ++i) {
+      nq[i] = rc->q[(rc->qhead + i) % rc->qall];
+    }
+    free(rc->q);
+    rc->q = nq;
+    rc->qhead = 0;
+    rc->qall *= 2;
+  }
+
+  /* requests are handled one at a time; if others are ahead of this
+   * one, its think time starts when rr_write() is done with them */
+  t = &(rc->q[(rc->qhead + rc->qn) % rc->qall]);
+  t->think = think;
+  t->due = usnow + think;
+  t->left = size;
+  t->off = 0;
+  rc->qn++;
+  if (rc->qn == 1 && !ci->writeproc) {
+    ci->timerproc = &rr_timer;
+    ci->timer = t->due;
+  }
+  if (MAYBE_VERBOSE(2, 'R')) {
+    slog('R', "rr_request(), conn '%s' response %lu bytes in %lu us,"
+	 " %d outstanding\n", ci->label, size, think, rc->qn);
+  }
+}
+
+/* rr_read(): receive requests in the "rr" protocol */
+static enum connstatus rr_read(struct conninfo *ci)
+{
+  struct rr_conn *rc = ci->usr;
+  enum connstatus cs;
+  char buf[16384];
+  int got, i, n;
+
+  cs = conn_read(ci, buf, sizeof(buf), &got);
+  if (cs == cs_close && rc->qn) {
+    /* nothing more coming in; but finish answering what we have */
+    rc->eof = 1;
+    ci->readproc = NULL;
+    return(cs_ok);
+  }
+  if (cs != cs_ok) {
+    return(cs);
+  }
+
+  for (i = 0; i < got; ) {
+    if (rc->skip > 0) {
+      /* in the ignored part of a request */
+      n = got - i;
+      if (n > rc->skip) { n = rc->skip; }
+      rc->skip -= n;
+      i += n;
+    } else {
+      /* in a header */
+      n = got - i;
+      if (n > RR_HDR - rc->hdrgot) { n = RR_HDR - rc->hdrgot; }
+      memcpy(rc->hdr + rc->hdrgot, buf + i, n);
+      rc->hdrgot += n;
+      i += n;
+      if (rc->hdrgot == RR_HDR) {
+	rc->hdrgot = 0;
+	rr_request(ci, rc);
+      }
+    }
+  }
+  if (rc->qn >= rc->rr->maxpend) {
+    ci->readproc = NULL; /* until some are answered */
+  }
+  return(cs_ok);
+}
+
+/* rr_timer(): timer callback for "rr": a response is due */
+static enum connstatus rr_timer(struct conninfo *ci)
+{
+  ci->timerproc = NULL;
+  ci->writeproc = &rr_write;
+  return(cs_ok);
+}
+
+/* rr_write(): send responses in the "rr" protocol */
+static enum connstatus rr_write(struct conninfo *ci)
+{
+  struct rr_conn *rc = ci->usr;
+  struct rr *rr = rc->rr;
+  struct rr_txn *t;
+  enum connstatus cs;
+  int len, wrote = 0, boff;
+
+  while (rc->qn) {
+    t = &(rc->q[rc->qhead]);
+    if (t->due > usnow) {
+      /* nothing more to send until then */
+      ci->writeproc = NULL;
+      ci->timerproc = &rr_timer;
+      ci->timer = t->due;
+      return(cs_ok);
+    }
+    if (t->left > 0) {
+      /* send as much of the response as the buffer allows */
+      boff = t->off % rr->bufsz;
+      len = rr->bufsz - boff;
+      if (len > t->left) { len = t->left; }
+      if ((cs = conn_write(ci, rr->buf + boff, len, &wrote)) != cs_ok) {
+	return(cs);
+      }
+      t->left -= wrote;
+      t->off += wrote;
+      if (t->left > 0) {
+	return(cs_ok); /* more next time */
+      }
+    }
+
+    /* done with this request; the next one's think time starts now */
+    rc->qhead = (rc->qhead + 1) % rc->qall;
+    rc->qn--;
+    if (rc->qn) {
+      rc->q[rc->qhead].due = usnow + rc->q[rc->qhead].think;
+    }
+    if (!rc->eof && rc->qn < rr->maxpend) {
+      ci->readproc = &rr_read;
+    }
+    if (wrote > 0) {
+      /* only one write() per call, since the socket might block */
+      break;
+    }
+  }
+  if (!rc->qn) {
+    ci->writeproc = NULL;
+    if (rc->eof) {
+      return(cs_close);
+    }
+  }
+  return(cs_ok);
+}
+
+/* rr_close(): closeproc for "rr" */
+static void rr_close(struct conninfo *ci)
+{
+  struct rr_conn *rc = ci->usr;
+
+  free(rc->q);
+  free(rc);
+}
+
+/* rr_conn(): initialize a connection in the "rr" protocol */
+static struct conninfo *rr_conn(struct protinst *pi, int sok)
+{
+  struct conninfo *ci;
+  struct rr_conn *rc;
+
+  New(ci);
+  New(rc);
+  rc->rr = pi->usr;
+  rc->qall = 4;
+  rc->q = malloc(sizeof(rc->q[0]) * rc->qall);
+  if (!rc->q) {
+    perror("memory management failure");
+    exit(2);
+  }
+  ci->sok = sok;
+  ci->usr = rc;
+  ci->label = NULL; /* will be filled in later */
+  ci->closeproc = &rr_close;
+  ci->readproc = &rr_read;
+  ci->writeproc = NULL; /* will be set when a response is due */
+  ci->timerproc = NULL; /* will be set when a request comes in */
+  return(ci);
+}
+
+/* rr_init(): initialize the "rr" protocol, parsing its options and
+ * filling in the response buffer
+ */
+static struct protinst *rr_init(struct protinfo *pi, int argc, char **argv,
+				int *argi)
+{
+  struct protinst *pinst;
+  struct rr *rr;
+  char *e;
+  int i, pil;
+
+  New(pinst);
+  New(rr);
+  pinst->usr = rr;
+  pinst->connproc = &rr_conn;
+
+  rr->bufsz = 1048576;
+  rr->maxpend = 256;
+  for (;;) {
+    if ((1+*argi) < argc && !strcmp(argv[*argi], "-b")) {
+      e = NULL;
+      rr->bufsz = strtol(argv[1+*argi], &e, 0);
+      if (rr->bufsz < 1 || (e && *e)) {
+	fprintf(stderr, "Bad -b argument to 'rr': %s\n", argv[1+*argi]);
+	usage();
+      }
+      *argi += 2;
+    } else if ((1+*argi) < argc && !strcmp(argv[*argi], "-p")) {
+      e = NULL;
+      rr->maxpend = strtol(argv[1+*argi], &e, 0);
+      if (rr->maxpend < 1 || (e && *e)) {
+	fprintf(stderr, "Bad -p argument to 'rr': %s\n", argv[1+*argi]);
+	usage();
+      }
+      *argi += 2;
+    } else {
+      /* there must be no more options for "rr" */
+      break;
+    }
+  }
+
+  /* the response buffer has the same pattern as chargen_write() */
+  if (!(rr->buf = malloc(rr->bufsz))) {
+    perror("memory management failure");
+    exit(2);
+  }
+  for (i = 0; i < rr->bufsz; ++i) {
+    pil = i % 74;
+    if (pil >= 72) {
+      rr->buf[i] = (pil == 72) ? '\r' : '\n';
+    } else {
+      rr->buf[i] = 32 + ((i / 74 + pil) % 95);
+    }
+  }
+  return(pinst);
+}
+
+/* The "file" protocol: Sends the contents of a file, or part of it, and
+ * then closes the connection.  The files are opened once, at startup,
+ * and shared by all connections (and child processes).  The data is
+ * sent with conn_sendfile(), on a nonblocking socket, so each time the
+ * socket is writable we send as much as it will take.
+ */
+struct file1 {
+  /* one of the files to send */
+  char *path;
+  int fd;
+  off_t size;
+};
+
+struct fileproto {
+  /* configuration of the "file" protocol */
+  struct file1 *files; /* the files */
+  int nfiles; /* how many */
+  int next; /* which the next connection gets */
+  long long off, len; /* range to send: offset and maximum length */
+};
+
+struct file_conn {
+  /* state of one "file" connection */
+  int fd; /* file to send from */
+  off_t pos, end; /* where we are in it, and where to stop */
+};
+
+/* file_write(): send data in the "file" protocol */
+static enum connstatus file_write(struct conninfo *ci)
+{
+  struct file_conn *fc = ci->usr;
+  enum connstatus cs;
+  long long wrote;
+
+  if (fc->pos < fc->end) {
+    cs = conn_sendfile(ci, fc->fd, &fc->pos, fc->end - fc->pos, &wrote);
+    if (cs != cs_ok) {
+      return(cs);
+    }
+  }
+  if (fc->pos >= fc->end) {
+    return(cs_close); /* all sent */
+  }
+  return(cs_ok);
+}
+
+/* file_read(): receive (and discard) data in the "file" protocol */
+static enum connstatus file_read(struct conninfo *ci)
+{
+  struct file_conn *fc = ci->usr;
+  enum connstatus cs;
+
+  cs = disc_read(ci);
+  if (cs == cs_close && fc->pos < fc->end) {
+    /* the client's done sending; but finish sending it the file */
+    ci->readproc = NULL;
+    return(cs_ok);
+  }
+  return(cs);
+}
+
+/* file_conn(): initialize a connection in the "file" protocol */
+static struct conninfo *file_conn(struct protinst *pi, int sok)
+{
+  struct conninfo *ci;
+  struct fileproto *fp = pi->usr;
+  struct file1 *f;
+  struct file_conn *fc;
+  int fl;
+
+  New(ci);
+  New(fc);
+  f = &(fp->files[fp->next]);
+  fp->next = (fp->next + 1) % fp->nfiles;
+  fc->fd = f->fd;
+  fc->pos = (fp->off < f->size) ? fp->off : f->size;
+  fc->end = f->size;
+  if (fp->len > 0 && fc->end - fc->pos > fp->len) {
+    fc->end = fc->pos + fp->len;
+  }
+  fl = fcntl(sok, F_GETFL);
+  if (fl < 0 || fcntl(sok, F_SETFL, fl | O_NONBLOCK) < 0) {
+    perror("fcntl(O_NONBLOCK)");
+  }
+  if (MAYBE_VERBOSE(2, 'p')) {
+    slog('p', "file_conn(), sending '%s' bytes %lld-%lld\n",
+	 f->path, (long long)fc->pos, (long long)fc->end);
+  }
+
+  ci->sok = sok;
+  ci->usr = fc;
+  ci->label = NULL; /* will be filled in later */
+  ci->closeproc = &simple_close;
+  ci->readproc = &file_read;
+  ci->writeproc = &file_write;
+  ci->timerproc = NULL; /* not used in this protocol */
+  return(ci);
+}
+
+/* file_init(): initialize the "file" protocol, parsing its options and
+ * opening the files
+ */
+static struct protinst *file_init(struct protinfo *pi, int argc, char **argv,
+				  int *argi)
+{
+  struct protinst *pinst;
+  struct fileproto *fp;
+  struct file1 *f;
+  struct stat st;
+  char *e;
+
+  New(pinst);
+  New(fp);
+  pinst->usr = fp;
+  pinst->connproc = &file_conn;
+
+  for (;;) {
+    if ((1+*argi) < argc && !strcmp(argv[*argi], "-f")) {
+      fp->files = realloc(fp->files, sizeof(fp->files[0]) * (fp->nfiles + 1));
+      if (!fp->files) {
+	perror("memory management failure");
+	exit(2);
+      }
+      f = &(fp->files[fp->nfiles++]);
+      f->path = argv[1+*argi];
+      if ((f->fd = open(f->path, O_RDONLY)) < 0 || fstat(f->fd, &st) < 0) {
+	fprintf(stderr, "%s: %s\n", f->path, strerror(errno));
+	exit(1);
+      }
+      if (!S_ISREG(st.st_mode)) {
+	fprintf(stderr, "%s: not a regular file\n", f->path);
+	exit(1);
+      }
+      f->size = st.st_size;
+#ifdef POSIX_FADV_WILLNEED
+      /* we'll be reading it all, over and over: start reading it into
+       * memory now
+       */
+      posix_fadvise(f->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+      posix_fadvise(f->fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+      *argi += 2;
+    } else if ((1+*argi) < argc && !strcmp(argv[*argi], "-o")) {
+      e = NULL;
+      fp->off = strtoll(argv[1+*argi], &e, 0);
+      if (fp->off < 0 || (e && *e)) {
+	fprintf(stderr, "Bad -o argument to 'file': %s\n", argv[1+*argi]);
+	usage();
+      }
+      *argi += 2;
+    } else if ((1+*argi) < argc && !strcmp(argv[*argi], "-l")) {
+      e = NULL;
+      fp->len = strtoll(argv[1+*argi], &e, 0);
+      if (fp->len < 0 || (e && *e)) {
+	fprintf(stderr, "Bad -l argument to 'file': %s\n", argv[1+*argi]);
+	usage();
+      }
+      *argi += 2;
+    } else {
+      /* there must be no more options for "file" */
+      break;
+    }
+  }
+  if (fp->nfiles < 1) {
+    fprintf(stderr, "Protocol 'file' needs at least one -f $path\n");
+    usage();
+  }
   return(pinst);
 }
 
 static struct protinfo protos[] = {
-  { "echo", &echo_conn, &simple_init, 7 },
-  { "discard", &disc_conn, &simple_init, 9 },
-  { "daytime", &daytime_conn, &simple_init, 13 },
-  { "time", &time_conn, &simple_init, 37 },
-  { "chargen", &chargen_conn, &simple_init, 19 },
-  { "qotd", NULL, &qotd_init, 17 },
-  { "gen", NULL, &gen_init, -1 },
-
-  { NULL, NULL, NULL, -1 }
+  { "echo", &echo_conn, &simple_init, 7, 4 },
+  { "discard", &disc_conn, &simple_init, 9, 1 },
+  { "daytime", &daytime_conn, &simple_init, 13, 4 },
+  { "time", &time_conn, &simple_init, 37, 4 },
+  { "chargen", &chargen_conn, &simple_init, 19, 1 },
+  { "qotd", NULL, &qotd_init, 17, 4 },
+  { "gen", NULL, &gen_init, -1, 4 },
+  { "delay-echo", NULL, &dlecho_init, -1, 4 },
+  { "rr", NULL, &rr_init, -1, 4 },
+  { "file", NULL, &file_init, -1, 1 },
+
+  { NULL, NULL, NULL, -1, 0 }
 };
 
 struct listen1 {
@@ -1078,8 +2771,121 @@ struct listen1 {
   int lsok; /* file descriptor of socket we listen on */
   struct sockaddr *addr; /* the address of it */
   socklen_t alen; /* length of that address */
+  long long qlen; /* connections waiting to be accepted, last we checked */
+  long long qmax; /* and the most there can be */
+  int full; /* was the queue full, last we checked? */
 };
 
+/* listen_counters(): get the kernel's ListenOverflows and ListenDrops
+ * counters, from the "TcpExt:" lines of /proc/net/netstat (names on
+ * the first, values on the second).  Returns 0 on success, -1 if
+ * they're not available.
+ */
+static int listen_counters(long long *overflows, long long *drops)
+{
+  static char buf[32768];
+  FILE *fp;
+  size_t n;
+  char *names, *vals, *e, *sn, *sv, *tn, *tv;
+  int got = 0;
+
+  if (!(fp = fopen("/proc/net/netstat", "r"))) {
+    return(-1);
+  }
+  n = fread(buf, 1, sizeof(buf) - 1, fp);
+  fclose(fp);
+  buf[n] = '\0';
+  if (!(names = strstr(buf, "TcpExt:")) ||
+      !(vals = strstr(names + 1, "TcpExt:"))) {
+    return(-1);
+  }
+  if ((e = strchr(names, '\n'))) { *e = '\0'; }
+  if ((e = strchr(vals, '\n'))) { *e = '\0'; }
+  tn = strtok_r(names, " ", &sn);
+  tv = strtok_r(vals, " ", &sv);
+  while (tn && tv) {
+    if (!strcmp(tn, "ListenOverflows")) {
+      *overflows = strtoll(tv, NULL, 10);
+      got |= 1;
+    } else if (!strcmp(tn, "ListenDrops")) {
+      *drops = strtoll(tv, NULL, 10);
+      got |= 2;
+    }
+    tn = strtok_r(NULL, " ", &sn);
+    tv = strtok_r(NULL, " ", &sv);
+  }
+  return((got == 3) ? 0 : -1);
+}
+
+/* listen_sample(): see how many connections are waiting on a listen
+ * socket.  On Linux, TCP_INFO on a listening socket gives that in
+ * 'tcpi_unacked' and the backlog in 'tcpi_sacked'.
+ */
+static void listen_sample(struct listen1 *lt)
+{
+#ifdef HAVE_TCP_INFO
+  struct tcp_info ti;
+  socklen_t len = sizeof(ti);
+
+  if (getsockopt(lt->lsok, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0) {
+    return;
+  }
+  lt->qlen = ti.tcpi_unacked;
+  lt->qmax = ti.tcpi_sacked;
+  if (lt->qlen > lq.qhigh) {
+    lq.qhigh = lt->qlen;
+  }
+  if (lt->qlen >= lt->qmax && lt->qmax > 0 && !lt->full) {
+    /* just filled up; say so, once until it's not full */
+    lq.alerts++;
+    slog('l', "Listen queue on %s is full (%lld connections)\n",
+	 lt->aspec, lt->qmax);
+  }
+  lt->full = (lt->qlen >= lt->qmax && lt->qmax > 0);
+#endif /* HAVE_TCP_INFO */
+}
+
+/* listen_check(): about once a second, sample all the listen sockets,
+ * and check the kernel's counters for overflows of the listen queue
+ */
+static void listen_check(struct listen1 *listens)
+{
+  struct listen1 *lt;
+  long long o, d, n;
+
+  if (!lq.active) {
+    /* first time */
+    lq.active = 1;
+    if (listen_counters(&lq.overflows0, &lq.drops0) < 0) {
+      lq.overflows0 = lq.drops0 = -1;
+    }
+  }
+  if (usnow < lq.next_check) {
+    return;
+  }
+  lq.next_check = usnow + 1000000;
+  lq.qlen = lq.qmax = 0;
+  for (lt = listens; lt; lt = lt->next) {
+    listen_sample(lt);
+    lq.qlen += lt->qlen;
+    if (lt->qmax > lq.qmax) {
+      lq.qmax = lt->qmax;
+    }
+  }
+  if (lq.overflows0 < 0 || listen_counters(&o, &d) < 0) {
+    return;
+  }
+  lq.overflows = o - lq.overflows0;
+  lq.drops = d - lq.drops0;
+  n = lq.overflows - lq.last_overflows;
+  lq.last_overflows = lq.overflows;
+  if (n > 0) {
+    lq.alerts++;
+    slog('l', "Listen queue overflowed %lld times in the last second"
+	 " (backlog %d; see -B)\n", n, gparm.backlog);
+  }
+}
+
 static void handle_sigchld(int i)
 {
   /* This function does nothing.  It's just there so that we're not, technically,
@@ -1100,31 +2906,251 @@ static void handle_sigusr2(int i)
   gparm.sigusr2_pending = 1;
 }
 
+/* Threaded mode (-t): The main thread listens, accepts connections, and
+ * hands each one to the worker thread with the fewest connections.  Each
+ * worker runs its own copy of the main loop, serve(), on its own
+ * connections.  Every BALANCE_USEC, a worker measures how loaded it is:
+ * the longest time it took handling one select() result ("lag"), and
+ * the average number of sockets ready each time ("depth").  If that's
+ * over the limits (-L, -D), it hands its busiest connection to the least
+ * loaded worker, as long as that one is well under them.
+ *
+ * A connection is handed over whole -- its 'struct conninfo', with the
+ * socket, protocol state, and timer -- through the receiving worker's
+ * handoff queue.  That's a lock free stack: any thread pushes onto it
+ * with compare-and-swap, and its owner takes everything on it at once
+ * with an atomic exchange.  A byte written to the owner's wakeup pipe
+ * gets it out of select().
+ */
+#define BALANCE_USEC 100000
+
+struct worker {
+  int num; /* which one it is, 0 to nworkers-1 */
+  pthread_t thread;
+  struct conninfo *handoff; /* connections handed to it, not yet taken */
+  int wake[2]; /* wakeup pipe; it reads [0], others write [1] */
+  struct prngstate prng; /* its initial random number state */
+  struct stdstats *stats; /* its statistics */
+  /* published by the worker for other threads to see */
+  int nconns; /* number of connections it has */
+  long long lag; /* most usec handling one select() result, lately */
+  long long depth; /* average number of sockets ready each select() */
+};
+
+/* handoff_push(): hand a connection to a worker */
+static void handoff_push(struct worker *w, struct conninfo *ci)
+{
+  struct conninfo *old;
+  char c = 0;
+
+  old = __atomic_load_n(&w->handoff, __ATOMIC_RELAXED);
+  do {
+    ci->next = old;
+  } while (!__atomic_compare_exchange_n(&w->handoff, &old, ci, 1,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  if (!old) {
+    /* it was empty, so the worker might not know to look: wake it */
+    if (write(w->wake[1], &c, 1) < 0 && errno != EAGAIN) {
+      perror("write(wakeup pipe)");
+    }
+  }
+}
+
+/* handoff_take(): a worker takes the connections handed to it */
+static void handoff_take(struct worker *w, struct conninfo **conns,
+			 int *nconns)
+{
+  struct conninfo *ci, *list;
+  char buf[64];
+
+  while (read(w->wake[0], buf, sizeof(buf)) > 0)
+    ;
+  list = __atomic_exchange_n(&w->handoff, NULL, __ATOMIC_ACQUIRE);
+  while ((ci = list) != NULL) {
+    list = ci->next;
+    ci->next = *conns;
+    *conns = ci;
+    ++*nconns;
+  }
+  __atomic_store_n(&w->nconns, *nconns, __ATOMIC_RELAXED);
+}
+
+/* worker_balance(): a worker publishes how loaded it's been lately, and
+ * if it's overloaded, hands its busiest connection to another worker
+ */
+static void worker_balance(struct worker *w, struct conninfo **conns,
+			   int *nconns, long long passes, long long lag,
+			   long long ready)
+{
+  long long depth, l;
+  struct worker *wt;
+  struct conninfo *ct, **ctp, **best;
+  int i, nactive;
+
+  depth = passes ? ready / passes : 0;
+  __atomic_store_n(&w->lag, lag, __ATOMIC_RELAXED);
+  __atomic_store_n(&w->depth, depth, __ATOMIC_RELAXED);
+
+  /* find the busiest connection, and forget how busy they all were */
+  best = NULL;
+  nactive = 0;
+  for (ctp = conns; (ct = *ctp) != NULL; ctp = &(ct->next)) {
+    if (ct->activity > 0) {
+      ++nactive;
+      if (!best || ct->activity > (*best)->activity) {
+	best = ctp;
+      }
+    }
+  }
+  for (ct = *conns; ct; ct = ct->next) {
+    ct->activity = 0;
+  }
+
+  /* Are we overloaded?  And would it help to move one?  Not if there's
+   * only one busy connection: that would just move the problem.
+   */
+  if (!((gparm.lag_limit > 0 && lag > gparm.lag_limit) ||
+	(gparm.depth_limit > 0 && depth > gparm.depth_limit)) ||
+      nactive < 2) {
+    return;
+  }
+
+  /* find the least loaded other worker, if it's idle enough */
+  wt = NULL;
+  for (i = 0; i < nworkers; ++i) {
+    if (&(workers[i]) == w) {
+      continue;
+    }
+    l = __atomic_load_n(&workers[i].lag, __ATOMIC_RELAXED);
+    if (gparm.lag_limit > 0 && l * 2 >= gparm.lag_limit) {
+      continue;
+    }
+    if (gparm.depth_limit > 0 &&
+	__atomic_load_n(&workers[i].depth, __ATOMIC_RELAXED) * 2 >=
+	gparm.depth_limit) {
+      continue;
+    }
+    if (!wt || l < __atomic_load_n(&wt->lag, __ATOMIC_RELAXED)) {
+      wt = &(workers[i]);
+    }
+  }
+  if (!wt) {
+    return;
+  }
+
+  /* and hand it over */
+  ct = *best;
+  *best = ct->next;
+  --*nconns;
+  __atomic_store_n(&w->nconns, *nconns, __ATOMIC_RELAXED);
+  STAT_ADD(stats.migrations, 1);
+  if (MAYBE_VERBOSE(1, 'm')) {
+    slog('m', "Worker %d (lag %lld us, depth %lld) handing"
+	 " connection '%s' to worker %d\n",
+	 w->num, lag, depth, ct->label, wt->num);
+  }
+  /* the receiving worker will think it's busy, until it finds out */
+  __atomic_store_n(&wt->lag, gparm.lag_limit, __ATOMIC_RELAXED);
+  handoff_push(wt, ct);
+}
+
+/* stats_sum_workers(): add the worker threads' statistics to 'sum' */
+static void stats_sum_workers(struct stdstats *sum, int *nconns)
+{
+  struct stdstats *st;
+  int i, j;
+
+  for (i = 0; i < nworkers; ++i) {
+    *nconns += __atomic_load_n(&workers[i].nconns, __ATOMIC_RELAXED);
+    st = __atomic_load_n(&workers[i].stats, __ATOMIC_ACQUIRE);
+    if (!st) {
+      continue; /* not started yet */
+    }
+    sum->accepts += STAT_GET(st->accepts);
+    sum->closes += STAT_GET(st->closes);
+    sum->reads += STAT_GET(st->reads);
+    sum->writes += STAT_GET(st->writes);
+    sum->bytes_in += STAT_GET(st->bytes_in);
+    sum->bytes_out += STAT_GET(st->bytes_out);
+    sum->errors += STAT_GET(st->errors);
+    sum->timers += STAT_GET(st->timers);
+    sum->deferred += STAT_GET(st->deferred);
+    sum->migrations += STAT_GET(st->migrations);
+    for (j = 0; j < STATS_HIST; ++j) {
+      sum->loop_hist[j] += STAT_GET(st->loop_hist[j]);
+    }
+  }
+}
+
+static void serve(struct worker *w, struct listen1 *listens,
+		  struct protinfo *proto, struct protinst *pinst);
+
+/* worker_main(): body of a worker thread */
+static void *worker_main(void *arg)
+{
+  struct worker *w = arg;
+
+  prng = w->prng;
+  __atomic_store_n(&w->stats, &stats, __ATOMIC_RELEASE);
+  serve(w, NULL, NULL, NULL);
+  return(NULL);
+}
+
+/* workers_start(): start the worker threads */
+static void workers_start(void)
+{
+  struct worker *w;
+  int i, j;
+
+  workers = calloc(nworkers, sizeof(workers[0]));
+  if (!workers) {
+    perror("memory management failure");
+    exit(2);
+  }
+  for (i = 0; i < nworkers; ++i) {
+    w = &(workers[i]);
+    w->num = i;
+    if (pipe(w->wake) < 0) {
+      perror("pipe");
+      exit(2);
+    }
+    for (j = 0; j < 2; ++j) {
+      fcntl(w->wake[j], F_SETFL, fcntl(w->wake[j], F_GETFL) | O_NONBLOCK);
+    }
+    /* like fork(): the new thread branches off the random number state */
+    w->prng = prng;
+    for (j = 0; j < 3; ++j) { w->prng.xsubi[j] = prng.branch[j]; }
+    prngmunge();
+  }
+  for (i = 0; i < nworkers; ++i) {
+    if ((j = pthread_create(&(workers[i].thread), NULL, &worker_main,
+			    &(workers[i]))) != 0) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(j));
+      exit(2);
+    }
+  }
+  if (gparm.verbose) {
+    fprintf(stderr, "Started %d worker threads\n", nworkers);
+  }
+}
+
 /* main(): As always, the "main body" of the program.  Calls whatever other
  * functions are needed to make things happen.
  */
 int main(int argc, char *argv[])
 {
-  char pbuf[16], lbuf[512];
+  char pbuf[16];
   char hbuf[256], sbuf[64];
   char *pname, *host, *port, *hostport, *e;
-  int oc, i, rv, af, boff, closit, max_fd, nconns = 0;
-  int selnr, selnw, selnc, we_are_child = 0;
-  long long togo, least_togo;
-  socklen_t alen;
-  enum connstatus cs;
-  fd_set rfds, wfds;
-  struct timeval tv;
+  int oc, i, rv, af;
   struct sigaction siga;
   struct addrinfo aihints, *aires;
 #ifdef DO_IPv6
-  struct sockaddr_in6 *a6, ab6;
+  struct sockaddr_in6 *a6;
 #endif
-  struct sockaddr_in *a, ab;
-  struct sockaddr *sap;
+  struct sockaddr_in *a;
   struct protinfo *proto;
   struct protinst *pinst;
-  struct conninfo *conns = NULL, *ct, **ctp, **ctp2;
   struct listen1 *listens = NULL, *lt;
 
   /* *** *** Defaults *** *** */
@@ -1137,11 +3163,19 @@ int main(int argc, char *argv[])
 #endif
   gparm.numeric = 0;
   gparm.sigusr2_pending = 0;
+  gparm.stats_file = NULL;
+  gparm.quantum = 0;
+  gparm.time_budget = 0;
+  gparm.weight = 0;
+  gparm.lag_limit = 1000;
+  gparm.depth_limit = 0;
+  gparm.backlog = 25;
+  logs.rate = 1000;
 
   /* *** *** Parse the command line *** *** */
   /* Parse global options */
   for (;;) {
-    oc = getopt(argc, argv, "N:vV:n"
+    oc = getopt(argc, argv, "N:vV:nS:Q:T:w:t:L:D:R:B:F:K"
 #ifdef DO_IPv6
 		"6"
 #endif
@@ -1164,6 +3198,15 @@ int main(int argc, char *argv[])
 	/* individual characters in optarg, identify specific
 	 * messages.
 	 *	'b' - in backoff_delay()
+	 *	'c' - connections coming and going, and child processes
+	 *	'e' - errors on connections (always logged)
+	 *	'i' - every read & write
+	 *	'l' - listen queue alerts (always logged)
+	 *	'p' - in the protocols' callbacks
+	 *	's' - select() and what it finds
+	 *	'D' - in the "delay-echo" protocol
+	 *	'R' - in the "rr" protocol
+	 *	'm' - threaded mode, connections moving between workers
 	 *	'u' - in update_usnow()
 	 */
 	gparm.verbose_extra ^= VERBOSE_EXTRA_BIT(optarg[i]);
@@ -1172,10 +3215,88 @@ int main(int argc, char *argv[])
     case '6': gparm.ipv6 = 1; break;
 #endif
     case 'n': gparm.numeric = 1; break;
+    case 'S': gparm.stats_file = optarg; break;
+    case 'Q':
+      e = NULL;
+      if ((gparm.quantum = strtoll(optarg, &e, 0)) < 0 || (e && *e)) {
+	fprintf(stderr, "option -Q must be a number at least 0\n");
+	usage();
+      }
+      break;
+    case 'T':
+      e = NULL;
+      if ((gparm.time_budget = strtoll(optarg, &e, 0)) < 0 || (e && *e)) {
+	fprintf(stderr, "option -T must be a number at least 0\n");
+	usage();
+      }
+      break;
+    case 'w':
+      e = NULL;
+      if ((gparm.weight = strtol(optarg, &e, 0)) < 1 || (e && *e)) {
+	fprintf(stderr, "option -w must be a number at least 1\n");
+	usage();
+      }
+      break;
+    case 't':
+      e = NULL;
+      if ((nworkers = strtol(optarg, &e, 0)) < 0 || nworkers > 1024 ||
+	  (e && *e)) {
+	fprintf(stderr, "option -t must be a number from 0 to 1024\n");
+	usage();
+      }
+      break;
+    case 'L':
+      e = NULL;
+      if ((gparm.lag_limit = strtoll(optarg, &e, 0)) < 0 || (e && *e)) {
+	fprintf(stderr, "option -L must be a number at least 0\n");
+	usage();
+      }
+      break;
+    case 'R':
+      e = NULL;
+      logs.rate = strtoll(optarg, &e, 0);
+      if (logs.rate < 0 || logs.rate > LOG_RATE_MAX || (e && *e)) {
+	fprintf(stderr, "option -R must be a number, 0 to %lld\n",
+		LOG_RATE_MAX);
+	usage();
+      }
+      break;
+    case 'B':
+      e = NULL;
+      if ((gparm.backlog = strtol(optarg, &e, 0)) < 1 || (e && *e)) {
+	fprintf(stderr, "option -B must be a number at least 1\n");
+	usage();
+      }
+      break;
+#ifdef TCP_FASTOPEN
+    case 'F':
+      e = NULL;
+      if ((gparm.fastopen = strtol(optarg, &e, 0)) < 0 || (e && *e)) {
+	fprintf(stderr, "option -F must be a number at least 0\n");
+	usage();
+      }
+      break;
+#endif
+#ifdef HAVE_BPF
+    case 'K':
+      gparm.kecho = 1;
+      break;
+#endif
+    case 'D':
+      e = NULL;
+      if ((gparm.depth_limit = strtoll(optarg, &e, 0)) < 0 || (e && *e)) {
+	fprintf(stderr, "option -D must be a number at least 0\n");
+	usage();
+      }
+      break;
     default: usage();
     }
   }
 
+  if (nworkers > 0) {
+    gparm.conns_per_proc = 0; /* threads, not processes */
+  }
+
   /* parse the protocol name */
   if (optind >= argc) {
     usage();
@@ -1207,6 +3328,15 @@ int main(int argc, char *argv[])
     fprintf(stderr, "Error initializing protocol '%s'\n", pname);
     exit(1);
   }
+#ifdef HAVE_BPF
+  if (gparm.kecho) {
+    if (pinst->connproc != &echo_conn) {
+      fprintf(stderr, "option -K only works with the echo protocol\n");
+      exit(1);
+    }
+    bpfecho_start();
+  }
+#endif
 
   if (gparm.verbose) {
     fprintf(stderr, "Global parameters: verbose=%d verbose_extra=0x%llx"
@@ -1345,7 +3475,6 @@ int main(int argc, char *argv[])
   }
 
   /* *** *** set up sockets to listen on the specified addresses *** *** */
-  max_fd = 0;
   for (lt = listens; lt; lt = lt->next) {
     af = AF_INET;
 #ifdef DO_IPv6
@@ -1358,9 +3487,6 @@ int main(int argc, char *argv[])
 	      lt->aspec, strerror(errno));
       exit(2);
     }
-    if (max_fd < lt->lsok) {
-      max_fd = lt->lsok;
-    }
     if (gparm.verbose) {
       hbuf[0] = sbuf[0] = '\0';
       rv = getnameinfo(lt->addr, lt->alen,
@@ -1376,7 +3502,16 @@ int main(int argc, char *argv[])
 	      lt->aspec, strerror(errno));
       exit(2);
     }
-    if (listen(lt->lsok, 25) < 0) {
+#ifdef TCP_FASTOPEN
+    if (gparm.fastopen > 0 &&
+	setsockopt(lt->lsok, IPPROTO_TCP, TCP_FASTOPEN,
+		   &gparm.fastopen, sizeof(gparm.fastopen)) < 0) {
+      fprintf(stderr, "Error trying to listen on '%s': TCP_FASTOPEN: %s\n",
+	      lt->aspec, strerror(errno));
+      exit(2);
+    }
+#endif
+    if (listen(lt->lsok, gparm.backlog) < 0) {
       fprintf(stderr, "Error trying to listen on '%s': listen(): %s\n",
 	      lt->aspec, strerror(errno));
       exit(2);
@@ -1402,8 +3537,44 @@ int main(int argc, char *argv[])
   sigemptyset(&siga.sa_mask);
   siga.sa_handler = &handle_sigusr2;
   sigaction(SIGUSR2, &siga, NULL);
+  pthread_atfork(&log_atfork_prepare, &log_atfork_parent, &log_atfork_child);
+  atexit(&log_flush);
+  log_start();
+  if (nworkers > 0) {
+    workers_start();
+  }
+  serve(NULL, listens, proto, pinst);
+  return(0);
+}
+
+/* serve(): the main loop: listen for connections and serve them.  In
+ * threaded mode, each worker thread runs this, with 'w' pointing to its
+ * 'struct worker' and no 'listens'; and the main thread runs it with
+ * 'w' NULL, and hands the connections it accepts to the workers.
+ */
+static void serve(struct worker *w, struct listen1 *listens,
+		  struct protinfo *proto, struct protinst *pinst)
+{
+  char lbuf[512], hbuf[256], sbuf[64];
+  int i, rv, boff, closit, max_fd, nconns = 0;
+  int selnr, selnw, selnc, nready, we_are_child = 0;
+  long long togo, least_togo, usselect, allow;
+  long long bal_next = 0, bal_passes = 0, bal_lag = 0, bal_ready = 0;
+  socklen_t alen;
+  enum connstatus cs;
+  fd_set rfds, wfds;
+  struct timeval tv;
+#ifdef DO_IPv6
+  struct sockaddr_in6 ab6;
+#endif
+  struct sockaddr_in ab;
+  struct sockaddr *sap;
+  struct conninfo *conns = NULL, *ct, **ctp, **ctp2;
+  struct listen1 *lt;
+  struct worker *wt;
+
   for (;;) {
-    if (gparm.sigusr2_pending) {
+    if (!w && gparm.sigusr2_pending) {
       gparm.sigusr2_pending = 0;
       fprintf(stderr, "SIGUSR2 INFO DUMP:\n");
       fprintf(stderr, "\tListening ports:\n");
@@ -1412,6 +3583,13 @@ int main(int argc, char *argv[])
 		lt, lt->aspec, (int)lt->lsok);
       }
       fprintf(stderr, "\tNumber of connections: %d\n", (int)nconns);
+      for (i = 0; i < nworkers; ++i) {
+	fprintf(stderr, "\tWorker %d: %d connections, lag %lld us,"
+		" depth %lld\n", i,
+		__atomic_load_n(&workers[i].nconns, __ATOMIC_RELAXED),
+		__atomic_load_n(&workers[i].lag, __ATOMIC_RELAXED),
+		__atomic_load_n(&workers[i].depth, __ATOMIC_RELAXED));
+      }
       fprintf(stderr, "\tConnections:\n");
       for (ct = conns; ct; ct = ct->next) {
 	fprintf(stderr, "\t\tstruct %p usr %p label '%s' sok %d",
@@ -1435,17 +3613,17 @@ int main(int argc, char *argv[])
 
     /* reap any child processes */
 #ifdef WAITPID_MINUS_ONE
-    if (gparm.conns_per_proc > 1) {
+    if (!w && gparm.conns_per_proc > 1) {
       while ((rv = waitpid(-1, &i, WNOHANG)) > 0) {
-	if (gparm.verbose) {
+	if (MAYBE_VERBOSE(1, 'c')) {
 	  if (WIFEXITED(i)) {
-	    fprintf(stderr, "Child process %d exited with status %d%s\n",
-		    (int)rv, (int)WEXITSTATUS(i),
-		    WEXITSTATUS(i) ? "" : " (normal)");
+	    slog('c', "Child process %d exited with status %d%s\n",
+		 (int)rv, (int)WEXITSTATUS(i),
+		 WEXITSTATUS(i) ? "" : " (normal)");
 	  } else if (WIFSIGNALED(i)) {
-	    fprintf(stderr, "Child process %d terminated with signal %d%s\n",
-		    (int)rv, (int)WTERMSIG(i),
-		    WCOREDUMP(i) ? " (core dumped)" : "");
+	    slog('c', "Child process %d terminated with signal %d%s\n",
+		 (int)rv, (int)WTERMSIG(i),
+		 WCOREDUMP(i) ? " (core dumped)" : "");
 	  }
 	}
       }
@@ -1462,7 +3640,15 @@ int main(int argc, char *argv[])
 
     /* figure out what time it is now */
     update_usnow();
-    
+    if (w) {
+      handoff_take(w, &conns, &nconns);
+    } else {
+      if (!we_are_child) {
+	listen_check(listens);
+      }
+      stats_write(nconns, we_are_child);
+    }
+
     /* Go through the sockets we listen on, and the connections we've got open,
      * and any timers on them, and prepare them all for select().
      */
@@ -1471,31 +3657,48 @@ int main(int argc, char *argv[])
     least_togo = 20000000;
 
     selnr = selnw = selnc = 0;
+    max_fd = -1;
 
     for (lt = listens; lt && !we_are_child; lt = lt->next) {
       /* see if a connection is coming in on this socket */
       FD_SET(lt->lsok, &rfds);
       ++selnc;
+      if (max_fd < lt->lsok) { max_fd = lt->lsok; }
     }
     for (ct = conns; ct; ct = ct->next) {
-      if (gparm.verbose > 1) {
-	fprintf(stderr, "Select preparation, %p '%s' fd=%d\n",
-		ct, ct->label, ct->sok);
+      if (MAYBE_VERBOSE(2, 's')) {
+	slog('s', "Select preparation, %p '%s' fd=%d\n",
+	     ct, ct->label, ct->sok);
       }
       if (ct->readproc) { FD_SET(ct->sok, &rfds); ++selnr; }
       if (ct->writeproc) { FD_SET(ct->sok, &wfds); ++selnw; }
+      if ((ct->readproc || ct->writeproc) && max_fd < ct->sok) {
+	max_fd = ct->sok;
+      }
       if (ct->timerproc) {
 	togo = ct->timer - usnow;
 	if (togo < 0) { togo = 0; }
 	if (least_togo > togo) { least_togo = togo; }
       }
     }
+    if (w) {
+      /* wakeup when something's handed to us; and time to balance load */
+      FD_SET(w->wake[0], &rfds);
+      if (max_fd < w->wake[0]) { max_fd = w->wake[0]; }
+      togo = bal_next - usnow;
+      if (togo < 0) { togo = 0; }
+      if (least_togo > togo) { least_togo = togo; }
+    } else if (gparm.stats_file) {
+      togo = stats.next_write - usnow;
+      if (togo < 0) { togo = 0; }
+      if (least_togo > togo) { least_togo = togo; }
+    }
 
-    if (gparm.verbose) {
-      fprintf(stderr,
-	      "About to select(), time %lld usec, %d read, %d write, %d listen, nfds %d\n",
-	      (long long)least_togo, (int)selnr, (int)selnw, (int)selnc,
-	      (int)(max_fd + 1));
+    if (MAYBE_VERBOSE(1, 's')) {
+      slog('s',
+	   "About to select(), time %lld usec, %d read, %d write, %d listen, nfds %d\n",
+	   (long long)least_togo, (int)selnr, (int)selnw, (int)selnc,
+	   (int)(max_fd + 1));
     }
 
     /* Now, use select() to wait until something happens or a timer runs out */
@@ -1507,7 +3710,8 @@ int main(int argc, char *argv[])
 	/* not really errors */
 	backoff_delay(0);
       } else {
-	perror("system error while waiting using select()");
+	slog('e', "system error while waiting using select(): %s\n",
+	     strerror(errno));
 	backoff_delay(1);
       }
       continue;
@@ -1515,18 +3719,57 @@ int main(int argc, char *argv[])
 
     /* and see what select() has given us */
 
+    nready = rv;
     boff = 0;
+    bal_ready += nready;
     update_usnow();
+    usselect = usnow;
 
     for (ctp = &conns; *ctp; ctp = ctp2) {
+      if (gparm.time_budget > 0 && ctp != &conns) {
+	update_usnow();
+	if (usnow - usselect >= gparm.time_budget) {
+	  /* Out of time; the rest wait until next time, and go first
+	   * then: rotate the list so it starts with them.
+	   */
+	  for (ct = *ctp; ct; ct = ct->next) {
+	    STAT_ADD(stats.deferred, 1);
+	    if (!ct->next) {
+	      ct->next = conns;
+	      break;
+	    }
+	  }
+	  conns = *ctp;
+	  *ctp = NULL;
+	  break;
+	}
+      }
       ct = *ctp;
       ctp2 = &(ct->next);
       closit = 0;
+      if (gparm.quantum > 0) {
+	/* deficit round robin: each time it's ready for I/O a connection
+	 * gets an allowance of bytes, and what it doesn't use carries
+	 * over (up to a limit) while it stays ready
+	 */
+	if ((ct->writeproc && FD_ISSET(ct->sok, &wfds)) ||
+	    (ct->readproc && FD_ISSET(ct->sok, &rfds))) {
+	  allow = gparm.quantum * ct->weight;
+	  ct->deficit += allow;
+	  if (ct->deficit > 2 * allow) {
+	    ct->deficit = 2 * allow;
+	  }
+	} else {
+	  ct->deficit = 0;
+	}
+      }
       if (ct->timerproc && ct->timer <= usnow) {
 	/* This one. */
-	if (gparm.verbose) {
-	  fprintf(stderr, "Timer activated on connection '%s'\n", ct->label);
+	if (MAYBE_VERBOSE(1, 's')) {
+	  slog('s', "Timer activated on connection '%s'\n", ct->label);
 	}
+	STAT_ADD(stats.timers, 1);
+	TRACE2(timer, ct->sok, usnow - ct->timer);
 	cs = ct->timerproc(ct);
 	switch(cs) {
 	case cs_ok: /* all was ok */ break;
@@ -1537,9 +3780,10 @@ int main(int argc, char *argv[])
       }
       if (!closit && ct->writeproc && FD_ISSET(ct->sok, &wfds)) {
 	/* This connection can be written to */
-	if (gparm.verbose) {
-	  fprintf(stderr, "Write possible on connection '%s'\n", ct->label);
+	if (MAYBE_VERBOSE(1, 's')) {
+	  slog('s', "Write possible on connection '%s'\n", ct->label);
 	}
+	ct->activity++;
 	cs = ct->writeproc(ct);
 	switch (cs) {
 	case cs_ok: /* all was ok */ break;
@@ -1548,11 +3792,13 @@ int main(int argc, char *argv[])
 	case cs_transient: /* error, try again */ boff++; break;
 	}
       }
-      if (!closit && ct->readproc && FD_ISSET(ct->sok, &rfds)) {
+      if (!closit && ct->readproc && FD_ISSET(ct->sok, &rfds) &&
+	  (gparm.quantum < 1 || ct->deficit > 0)) {
 	/* This connection can be read from */
-	if (gparm.verbose) {
-	  fprintf(stderr, "Read possible on connection '%s'\n", ct->label);
+	if (MAYBE_VERBOSE(1, 's')) {
+	  slog('s', "Read possible on connection '%s'\n", ct->label);
 	}
+	ct->activity++;
 	cs = ct->readproc(ct);
 	switch (cs) {
 	case cs_ok: /* all was ok */ break;
@@ -1563,9 +3809,14 @@ int main(int argc, char *argv[])
       }
       if (closit) {
 	/* close the connection and remove it from the list */
-	if (gparm.verbose) {
-	  fprintf(stderr, "Closing connection '%s'\n", ct->label);
+	if (MAYBE_VERBOSE(1, 'c')) {
+	  slog('c', "Closing connection '%s'\n", ct->label);
+	}
+	STAT_ADD(stats.closes, 1);
+	if (cs == cs_fatal) {
+	  STAT_ADD(stats.errors, 1);
 	}
+	TRACE3(close, ct->sok, (int)cs, usnow - ct->accepted);
 	*ctp = ct->next;
 	ctp2 = ctp;
 	if (ct->closeproc) {
@@ -1576,6 +3827,10 @@ int main(int argc, char *argv[])
 	free(ct);
 	--nconns;
 	if (we_are_child && nconns < 1) {
+	  if (gparm.stats_file) {
+	    stats_file_name(lbuf, sizeof(lbuf), we_are_child);
+	    unlink(lbuf);
+	  }
 	  exit(0);
 	}
       }
@@ -1584,6 +3839,7 @@ int main(int argc, char *argv[])
     for (lt = listens; lt && !we_are_child; lt = lt->next) {
       if (FD_ISSET(lt->lsok, &rfds)) {
 	/* a connection is coming in on this socket */
+	listen_sample(lt);
 	sap = (void *)&ab;
 	alen = sizeof(ab);
 #ifdef DO_IPv6
@@ -1608,33 +3864,29 @@ int main(int argc, char *argv[])
 	    continue;
 	  } else {
 	    /* error! */
-	    fprintf(stderr, "Error accepting connection on %s: %s\n",
-		    lt->aspec, strerror(errno));
+	    slog('e', "Error accepting connection on %s: %s\n",
+		 lt->aspec, strerror(errno));
 	    ++boff;
 	    continue;
 	  }
 	}
-	if (max_fd < rv) {
-	  max_fd = rv;
-	}
-	if (gparm.verbose > 1) {
-	  fprintf(stderr, "On accept(), got address:\n");
+	if (MAYBE_VERBOSE(2, 'c')) {
+	  slog('c', "On accept(), got address:\n");
 	  for (i = 0; i < alen; ++i) {
-	    fprintf(stderr, "%s%02x%s",
-		    (!(i & 7)) ? "\t" : " ",
-		    (int)(((unsigned char *)sap)[i]),
-		    ((i & 7) == 7 || (i == alen - 1)) ? "\n" : "");
+	    slog('c', "%s%02x%s",
+		 (!(i & 7)) ? "\t" : " ",
+		 (int)(((unsigned char *)sap)[i]),
+		 ((i & 7) == 7 || (i == alen - 1)) ? "\n" : "");
 	  }
 	}
 
 	/* So, we have a connection; record it */
 	ct = pinst->connproc(pinst, rv);
 	if (!ct) {
-	  fprintf(stderr, "Error setting up connection on %s\n", lt->aspec);
+	  slog('e', "Error setting up connection on %s\n", lt->aspec);
 	  close(rv);
 	  ++boff;
 	}
-	ct->next = conns;
 	hbuf[0] = sbuf[0] = '\0';
 
 	rv = getnameinfo(sap, alen, hbuf, sizeof(hbuf), sbuf, sizeof(sbuf),
@@ -1644,22 +3896,54 @@ int main(int argc, char *argv[])
 		 (rv || !hbuf[0]) ? "?" : hbuf,
 		 (rv || !sbuf[0]) ? "?" : sbuf, lt->aspec);
 	ct->label = strdup(lbuf);
-	conns = ct;
-	++nconns;
-
-	if (gparm.verbose) {
-	  fprintf(stderr, "Connection '%s' received on '%s' (fd=%d)\n",
-		  ct->label, lt->aspec, (int)ct->sok);
+	ct->accepted = usnow;
+	ct->weight = gparm.weight ? gparm.weight : proto->weight;
+	STAT_ADD(stats.accepts, 1);
+	TRACE2(accept, ct->sok, lt->lsok);
+
+	if (MAYBE_VERBOSE(1, 'c')) {
+	  slog('c', "Connection '%s' received on '%s' (fd=%d)\n",
+	       ct->label, lt->aspec, (int)ct->sok);
+	}
+	if (nworkers > 0) {
+	  /* threaded: give it to the worker with the fewest connections */
+	  wt = &(workers[0]);
+	  for (i = 1; i < nworkers; ++i) {
+	    if (__atomic_load_n(&workers[i].nconns, __ATOMIC_RELAXED) <
+		__atomic_load_n(&wt->nconns, __ATOMIC_RELAXED)) {
+	      wt = &(workers[i]);
+	    }
+	  }
+	  handoff_push(wt, ct);
+	} else {
+	  ct->next = conns;
+	  conns = ct;
+	  ++nconns;
 	}
 
       }
     }
 
+    update_usnow();
+    stats_hist_add(stats.loop_hist, usnow - usselect);
+    TRACE2(loop, nready, usnow - usselect);
+    if (w) {
+      bal_passes++;
+      if (bal_lag < usnow - usselect) {
+	bal_lag = usnow - usselect;
+      }
+      if (usnow >= bal_next) {
+	worker_balance(w, &conns, &nconns, bal_passes, bal_lag, bal_ready);
+	bal_passes = bal_lag = bal_ready = 0;
+	bal_next = usnow + BALANCE_USEC;
+      }
+    }
+
     if (boff) {
       backoff_delay(0);
     }
 
-    if ((!we_are_child) &&
+    if ((!we_are_child) && !w &&
 	gparm.conns_per_proc > 0 &&
 	nconns >= gparm.conns_per_proc) {
       /* So, we've got a bunch of connections; fork a new process
@@ -1670,12 +3954,15 @@ int main(int argc, char *argv[])
 	if (errno == EAGAIN) {
 	  ++boff;
 	}
-	if (gparm.verbose > 0) {
-	  fprintf(stderr, "fork() failed: %s\n", strerror(errno));
+	if (MAYBE_VERBOSE(1, 'c')) {
+	  slog('c', "fork() failed: %s\n", strerror(errno));
 	}
       } else if (rv == 0) {
 	/* child process */
 	we_are_child = 1;
+	log_start();
+	memset(&stats, 0, sizeof(stats)); /* child counts its own */
+	lq.active = 0;
 	for (lt = listens; lt; lt = lt->next) {
 	  /* only the parent listens */
 	  close(lt->lsok);
@@ -1684,9 +3971,9 @@ int main(int argc, char *argv[])
 	for (i = 0; i < 3; ++i) { prng.xsubi[i] = prng.branch[i]; }
       } else {
 	/* parent process */
-	if (gparm.verbose) {
-	  fprintf(stderr, "Migrating %d connections to child process, pid %d\n",
-		  (int)nconns, (int)rv);
+	if (MAYBE_VERBOSE(1, 'c')) {
+	  slog('c', "Migrating %d connections to child process, pid %d\n",
+	       (int)nconns, (int)rv);
 	}
 	prngmunge();
 	while (conns) {
@@ -0,0 +1,652 @@
+/*
+ * stdtop.c - Jeremy Dilatush
+ *
+ * Copyright (C) 2026, Jeremy Dilatush.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY JEREMY DILATUSH AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL JEREMY DILATUSH OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * stdtop - Live dashboard for "stdserve" and "tcphammer" on the terminal.
+ *
+ * Reads the statistics files they write (stdserve -S, tcphammer "m"
+ * configuration line) and shows recent history of connections, operation
+ * rates, errors and latency percentiles as sparklines.  Reading those
+ * files doesn't disturb the programs writing them.
+ *
+ * The display is built of "widgets" the same way as in tty-clock.c.
+ * Each widget's 'change_by' handler tells whether its display would
+ * change, and only then is its 'redraw' handler called; and curses only
+ * sends what changed on the screen.  The display is updated at most once
+ * per interval (-i).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <locale.h>
+#include <glob.h>
+#include <curses.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/select.h>
+
+static char *progname = "stdtop";
+
+#define MIN_INTERVAL    0.1     /* shortest interval: 1/10 second */
+#define MAX_HISTORY     512     /* most samples of history kept */
+#define STATS_HIST      32      /* histogram buckets in statistics files */
+#define MAX_SOURCES     16      /* most -s and -t options */
+#define STALE_USEC      3000000 /* ignore files not rewritten this long */
+
+static void usage(void)
+{
+    fprintf(stderr, "USAGE:\n"
+            "    %s [options]\n"
+            "OPTIONS:\n"
+            "    -s file -- statistics file written by stdserve -S; also\n"
+            "               reads those of its child processes (file.pid)\n"
+            "    -t file -- statistics file written by tcphammer (\"m\")\n"
+            "    -i sec -- interval between updates; default 1\n"
+            "(-s and -t may be repeated, and their values are added up.)\n"
+            "Keys: q to quit, ^L to redraw the screen.\n"
+            , progname);
+    exit(1);
+}
+
+/* statistics files */
+
+/* names of the values that may appear in the statistics files */
+static char *stat_keys[] = {
+    "time_us", "pid", "conns",
+    "accepts", "closes", "reads", "writes", "bytes_in", "bytes_out",
+    "errors", "timers", "opens", "datas",
+    NULL
+};
+enum {
+    SK_TIME, SK_PID, SK_CONNS,
+    SK_ACCEPTS, SK_CLOSES, SK_READS, SK_WRITES, SK_BYTES_IN, SK_BYTES_OUT,
+    SK_ERRORS, SK_TIMERS, SK_OPENS, SK_DATAS,
+    SK_NUM
+};
+
+struct snap {
+    /* contents of one statistics file */
+    long long v[SK_NUM];            /* values, by SK_* */
+    long long hist[STATS_HIST];     /* latency histogram */
+};
+
+struct filestate {
+    /* what we know about one statistics file */
+    char *name;                     /* file name */
+    int seen;                       /* seen in the latest scan? */
+    struct snap last;               /* last contents read */
+    double rate[SK_NUM];            /* counters' rates per second */
+    long long hdelta[STATS_HIST];   /* histogram counts in last interval */
+    int have_rate;                  /* are rate[] & hdelta[] valid yet? */
+};
+
+struct source {
+    /* a -s or -t option, and the files it takes in */
+    char *path;                     /* the file name given */
+    int kind;                       /* 's' (stdserve) or 't' (tcphammer) */
+    struct filestate *files;        /* files read */
+    int nfiles, afiles;             /* used & allocated entries in files[] */
+};
+
+/* read_snap(): read a statistics file; returns 0 on success, -1 if the
+ * file can't be read or isn't the expected kind
+ */
+static int read_snap(char *name, int kind, struct snap *sn)
+{
+    FILE *fp;
+    char line[1024], *cp, *e;
+    int i;
+
+    memset(sn, 0, sizeof(*sn));
+    if (!(fp = fopen(name, "r"))) {
+        return(-1);
+    }
+    if (!fgets(line, sizeof(line), fp) ||
+        strcmp(line, kind == 's' ? "stdserve\n" : "tcphammer\n")) {
+        fclose(fp);
+        return(-1);
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        cp = line + strcspn(line, " \n");
+        if (*cp != ' ') {
+            continue;
+        }
+        *cp++ = '\0';
+        if (!strcmp(line, "loop_hist") || !strcmp(line, "lat_hist")) {
+            for (i = 0; i < STATS_HIST; ++i) {
+                sn->hist[i] = strtoll(cp, &e, 10);
+                if (e == cp) {
+                    break;
+                }
+                cp = e;
+            }
+            continue;
+        }
+        for (i = 0; stat_keys[i]; ++i) {
+            if (!strcmp(line, stat_keys[i])) {
+                sn->v[i] = strtoll(cp, NULL, 10);
+                break;
+            }
+        }
+    }
+    fclose(fp);
+    return(0);
+}
+
+/* update_file(): take in the latest contents of one statistics file */
+static void update_file(struct source *src, char *name)
+{
+    struct filestate *fs;
+    struct snap sn;
+    double dt;
+    int i;
+
+    if (read_snap(name, src->kind, &sn) < 0) {
+        return;
+    }
+
+    /* find it among the files already known, or add it */
+    for (i = 0; i < src->nfiles; ++i) {
+        if (!strcmp(src->files[i].name, name)) {
+            break;
+        }
+    }
+    if (i >= src->nfiles) {
+        if (src->nfiles >= src->afiles) {
+            src->afiles += 4 + (src->afiles >> 1);
+            src->files = realloc(src->files,
+                                 src->afiles * sizeof(src->files[0]));
+            if (!src->files) {
+                endwin();
+                perror("memory management failure");
+                exit(2);
+            }
+        }
+        fs = &(src->files[src->nfiles++]);
+        memset(fs, 0, sizeof(*fs));
+        fs->name = strdup(name);
+        fs->last = sn;
+        fs->seen = 1;
+        return;
+    }
+    fs = &(src->files[i]);
+    fs->seen = 1;
+
+    /* a different process writing it now means starting over */
+    if (sn.v[SK_PID] != fs->last.v[SK_PID] ||
+        sn.v[SK_TIME] < fs->last.v[SK_TIME]) {
+        fs->last = sn;
+        fs->have_rate = 0;
+        return;
+    }
+
+    /* if it's been rewritten, figure the rates since the last time */
+    dt = (sn.v[SK_TIME] - fs->last.v[SK_TIME]) * 1e-6;
+    if (dt <= 0) {
+        return; /* not rewritten; keep the rates we had */
+    }
+    for (i = 0; i < SK_NUM; ++i) {
+        fs->rate[i] = (sn.v[i] - fs->last.v[i]) / dt;
+    }
+    for (i = 0; i < STATS_HIST; ++i) {
+        fs->hdelta[i] = sn.hist[i] - fs->last.hist[i];
+    }
+    fs->have_rate = 1;
+    fs->last = sn;
+}
+
+/* scan_source(): read all the files of a source; forget those that
+ * have gone away
+ */
+static void scan_source(struct source *src)
+{
+    char pat[1100];
+    glob_t gl;
+    size_t n, len;
+    int i, j;
+
+    for (i = 0; i < src->nfiles; ++i) {
+        src->files[i].seen = 0;
+    }
+    update_file(src, src->path);
+    if (src->kind == 's') {
+        /* child processes of stdserve write file.pid */
+        snprintf(pat, sizeof(pat), "%s.[0-9]*", src->path);
+        memset(&gl, 0, sizeof(gl));
+        if (glob(pat, GLOB_NOSORT, NULL, &gl) == 0) {
+            for (n = 0; n < gl.gl_pathc; ++n) {
+                len = strlen(gl.gl_pathv[n]);
+                if (len > 4 && !strcmp(gl.gl_pathv[n] + len - 4, ".tmp")) {
+                    continue; /* one being written */
+                }
+                update_file(src, gl.gl_pathv[n]);
+            }
+        }
+        globfree(&gl);
+    }
+    for (i = j = 0; i < src->nfiles; ++i) {
+        if (src->files[i].seen) {
+            src->files[j++] = src->files[i];
+        } else {
+            free(src->files[i].name);
+        }
+    }
+    src->nfiles = j;
+}
+
+/* metrics shown on the display */
+
+enum {
+    M_SCONNS, M_SACCEPTS, M_SIO, M_SERRORS, M_SLOOP99,
+    M_TCONNS, M_TOPS, M_TERRORS, M_TLAT50, M_TLAT99,
+    M_NUM
+};
+
+static struct {
+    char *label;                    /* shown at the left */
+    int kind;                       /* 's' or 't': what source it's from */
+} metric_info[M_NUM] = {
+    { "stdserve conns",     's' },
+    { "stdserve accepts/s", 's' },
+    { "stdserve I/O/s",     's' },
+    { "stdserve errors/s",  's' },
+    { "stdserve loop p99us",'s' },
+    { "tcphammer conns",    't' },
+    { "tcphammer ops/s",    't' },
+    { "tcphammer errors/s", 't' },
+    { "tcphammer p50 us",   't' },
+    { "tcphammer p99 us",   't' },
+};
+
+static struct {
+    /* recent history of all the metrics */
+    double v[M_NUM][MAX_HISTORY];   /* values; NAN for unknown */
+    int nsamp;                      /* number of samples taken so far */
+    time_t when;                    /* time of the latest one */
+} history;
+
+/* hist_percentile(): percentile 'p' of a histogram of the kind in the
+ * statistics files, as the upper bound of the bucket it falls in; NAN if
+ * the histogram is empty
+ */
+static double hist_percentile(long long *hist, int p)
+{
+    long long total = 0, sum = 0;
+    int i;
+
+    for (i = 0; i < STATS_HIST; ++i) {
+        total += hist[i];
+    }
+    if (total < 1) {
+        return(NAN);
+    }
+    for (i = 0; i < STATS_HIST; ++i) {
+        sum += hist[i];
+        if (sum * 100 >= total * p) {
+            break;
+        }
+    }
+    return((double)(1LL << (i < STATS_HIST ? i : STATS_HIST - 1)));
+}
+
+/* take_sample(): read all the sources and add a sample to 'history' */
+static void take_sample(struct source *srcs, int nsrcs)
+{
+    double m[M_NUM];
+    long long hist[2][STATS_HIST], now;
+    int have[2], i, j, k, s, slot;
+    struct timeval tv;
+
+    for (i = 0; i < M_NUM; ++i) {
+        m[i] = 0;
+    }
+    memset(hist, 0, sizeof(hist));
+    have[0] = have[1] = 0;
+    gettimeofday(&tv, NULL);
+    now = (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+    for (s = 0; s < nsrcs; ++s) {
+        scan_source(&(srcs[s]));
+        k = (srcs[s].kind == 't');
+        for (j = 0; j < srcs[s].nfiles; ++j) {
+            struct filestate *fs = &(srcs[s].files[j]);
+            if (now - fs->last.v[SK_TIME] > STALE_USEC) {
+                continue; /* its process is probably gone */
+            }
+            have[k] = 1;
+            if (k) {
+                m[M_TCONNS] += fs->last.v[SK_CONNS];
+            } else {
+                m[M_SCONNS] += fs->last.v[SK_CONNS];
+            }
+            if (!fs->have_rate) {
+                continue;
+            }
+            if (k) {
+                m[M_TOPS] += fs->rate[SK_OPENS] + fs->rate[SK_CLOSES] +
+                    fs->rate[SK_DATAS];
+                m[M_TERRORS] += fs->rate[SK_ERRORS];
+            } else {
+                m[M_SACCEPTS] += fs->rate[SK_ACCEPTS];
+                m[M_SIO] += fs->rate[SK_READS] + fs->rate[SK_WRITES];
+                m[M_SERRORS] += fs->rate[SK_ERRORS];
+            }
+            for (i = 0; i < STATS_HIST; ++i) {
+                hist[k][i] += fs->hdelta[i];
+            }
+        }
+    }
+    m[M_SLOOP99] = hist_percentile(hist[0], 99);
+    m[M_TLAT50] = hist_percentile(hist[1], 50);
+    m[M_TLAT99] = hist_percentile(hist[1], 99);
+
+    slot = history.nsamp % MAX_HISTORY;
+    for (i = 0; i < M_NUM; ++i) {
+        history.v[i][slot] = have[metric_info[i].kind == 't'] ? m[i] : NAN;
+    }
+    history.nsamp++;
+    history.when = time(NULL);
+}
+
+/* display "widgets" making up part of the screen; see tty-clock.c */
+
+struct widget {
+    void *data; /* type specific data */
+    WINDOW *ww; /* where displayed */
+    int rowmn, rowmx; /* row number range */
+    char *name; /* label for debugging */
+    /* change_by -- will display change for the latest sample? */
+    /* redraw -- redraw for the latest sample */
+    int (*change_by)(struct widget *w, int nsamp);
+    void (*redraw)(struct widget *w, int nsamp);
+    int last_drawn; /* sample number it was last drawn for */
+};
+
+static void generic_widget_init(struct widget *w, WINDOW *ww,
+                                int *row, int nrows)
+{
+    memset(w, 0, sizeof(*w));
+    w->ww = ww;
+    w->rowmn = *row;
+    *row += nrows;
+    w->rowmx = (*row) - 1;
+    w->name = "?";
+    w->last_drawn = -1;
+    /* caller should set w->data, w->change_by, w->redraw, w->name */
+}
+
+/* text widgets: a line of text that's only redrawn when it changes;
+ * 'data' is a 'struct text_widget' with a handler that formats it
+ */
+struct text_widget {
+    void (*format)(struct widget *w, int nsamp, char *buf, int bufsz);
+    int metric;         /* for the format handler's use */
+    char cur[512];      /* text to show now */
+    char shown[512];    /* text that was last shown */
+};
+
+static int text_widget_change_by(struct widget *w, int nsamp)
+{
+    struct text_widget *tw = w->data;
+
+    tw->format(w, nsamp, tw->cur, sizeof(tw->cur));
+    return(strcmp(tw->cur, tw->shown) != 0);
+}
+
+static void text_widget_redraw(struct widget *w, int nsamp)
+{
+    struct text_widget *tw = w->data;
+
+    tw->format(w, nsamp, tw->cur, sizeof(tw->cur));
+    mvwaddstr(w->ww, w->rowmn, 0, tw->cur);
+    wclrtoeol(w->ww);
+    memcpy(tw->shown, tw->cur, sizeof(tw->shown));
+}
+
+static void text_widget_init(struct widget *w, WINDOW *ww, int *row,
+                             char *name, int metric,
+                             void (*format)(struct widget *, int,
+                                            char *, int))
+{
+    struct text_widget *tw;
+
+    generic_widget_init(w, ww, row, 1);
+    w->change_by = &text_widget_change_by;
+    w->redraw = &text_widget_redraw;
+    w->name = name;
+    w->data = tw = calloc(1, sizeof(*tw));
+    if (!tw) {
+        endwin();
+        perror("memory management failure");
+        exit(2);
+    }
+    tw->format = format;
+    tw->metric = metric;
+}
+
+/* "title" widget: the top line */
+
+static void title_format(struct widget *w, int nsamp, char *buf, int bufsz)
+{
+    struct tm tm;
+    char tbuf[32];
+
+    localtime_r(&history.when, &tm);
+    strftime(tbuf, sizeof(tbuf), "%H:%M:%S", &tm);
+    snprintf(buf, bufsz, "%s  %s  (%d samples)", progname, tbuf, nsamp);
+}
+
+/* "spark" widget: one metric's label, latest value, and sparkline */
+
+static void spark_format(struct widget *w, int nsamp, char *buf, int bufsz)
+{
+    static const char levels[] = " .:-=+*#%@"; /* 10 levels, ASCII only */
+    struct text_widget *tw = w->data;
+    double *v = history.v[tw->metric], x, mx;
+    int width, n, i, len;
+
+    len = snprintf(buf, bufsz, "%-20s ", metric_info[tw->metric].label);
+    if (nsamp < 1 || isnan(v[(nsamp - 1) % MAX_HISTORY])) {
+        len += snprintf(buf + len, bufsz - len, "%10s |", "-");
+    } else {
+        len += snprintf(buf + len, bufsz - len, "%10.1f |",
+                        v[(nsamp - 1) % MAX_HISTORY]);
+    }
+
+    /* the sparkline: as many of the latest samples as fit */
+    width = COLS - len - 2;
+    if (width > bufsz - len - 2) {
+        width = bufsz - len - 2;
+    }
+    if (width > MAX_HISTORY) {
+        width = MAX_HISTORY;
+    }
+    n = (nsamp < width) ? nsamp : width;
+    mx = 0;
+    for (i = nsamp - n; i < nsamp; ++i) {
+        x = v[i % MAX_HISTORY];
+        if (!isnan(x) && x > mx) {
+            mx = x;
+        }
+    }
+    for (i = nsamp - n; i < nsamp && len < bufsz - 2; ++i) {
+        x = v[i % MAX_HISTORY];
+        if (isnan(x) || mx <= 0) {
+            buf[len++] = ' ';
+        } else {
+            buf[len++] = levels[(int)(x / mx * (sizeof(levels) - 2) + 0.5)];
+        }
+    }
+    buf[len++] = '|';
+    buf[len] = '\0';
+}
+
+/* main program */
+
+int main(int argc, char **argv)
+{
+    int oc, row, num_widgets, ch, i, k;
+    struct widget widgets[1 + M_NUM], *w;
+    struct source srcs[MAX_SOURCES];
+    int nsrcs = 0, have[2] = { 0, 0 };
+    double interval = 1;
+    WINDOW *ww;
+    struct timeval tnow, tnext, dly;
+    int draw_all = 1;       /* forces (re)drawing of whole display */
+    fd_set rfds;
+
+    if (argc > 0) {
+        progname = basename(argv[0]);
+    }
+
+    /* parse the command line options */
+
+    memset(srcs, 0, sizeof(srcs));
+    while ((oc = getopt(argc, argv, "s:t:i:")) >= 0) {
+        switch (oc) {
+        case 's': /* -s file -- stdserve statistics */
+        case 't': /* -t file -- tcphammer statistics */
+            if (nsrcs >= MAX_SOURCES) {
+                fprintf(stderr, "%s: Too many -s and -t options.\n",
+                        progname);
+                usage();
+            }
+            srcs[nsrcs].path = optarg;
+            srcs[nsrcs].kind = oc;
+            have[oc == 't'] = 1;
+            ++nsrcs;
+            break;
+        case 'i': /* -i sec -- interval between updates */
+            interval = atof(optarg);
+            if (!isfinite(interval) || interval < MIN_INTERVAL) {
+                fprintf(stderr, "%s: Invalid interval '%s'\n",
+                        progname, optarg);
+                usage();
+            }
+            break;
+        default:
+            fprintf(stderr, "%s: Invalid option flag.\n", progname);
+            usage();
+        }
+    }
+    if (optind < argc || nsrcs < 1) {
+        usage();
+    }
+
+    /* initialize curses display */
+
+    setlocale(LC_ALL, "");
+    ww = initscr();
+    cbreak();
+    noecho();
+    nonl();
+    intrflush(stdscr, FALSE);
+    nodelay(stdscr, TRUE);
+    keypad(stdscr, TRUE);
+    curs_set(0);
+
+    /* build the widgets: a title, and a sparkline for each metric
+     * that comes from a source we have
+     */
+
+    row = num_widgets = 0;
+    text_widget_init(&(widgets[num_widgets++]), ww, &row, "title", -1,
+                     &title_format);
+    ++row; /* blank line */
+    for (i = 0; i < M_NUM; ++i) {
+        k = (metric_info[i].kind == 't');
+        if (!have[k]) {
+            continue;
+        }
+        if (i == M_TCONNS && have[0]) {
+            ++row; /* blank line between stdserve & tcphammer */
+        }
+        text_widget_init(&(widgets[num_widgets++]), ww, &row,
+                         metric_info[i].label, i, &spark_format);
+    }
+
+    /* now keep sampling and updating the display */
+
+    gettimeofday(&tnext, NULL);
+    for (;;) {
+        /* See if there are any interesting keys typed on the keyboard */
+        while ((ch = getch()) != ERR) {
+            switch (ch) {
+            case 12:                /* ^L - redraw screen */
+            case KEY_CLEAR:
+                draw_all = 1;
+                break;
+            case 'q':
+            case 'Q':
+                endwin();
+                return(0);
+            default:
+                break;
+            }
+        }
+
+        /* Is it time for a sample?  If not, wait until it is, unless a
+         * key is pressed first.
+         */
+        gettimeofday(&tnow, NULL);
+        if (!draw_all && timercmp(&tnow, &tnext, <)) {
+            timersub(&tnext, &tnow, &dly);
+            FD_ZERO(&rfds);
+            FD_SET(STDIN_FILENO, &rfds);
+            select(STDIN_FILENO + 1, &rfds, NULL, NULL, &dly);
+            continue;
+        }
+        if (!timercmp(&tnow, &tnext, <)) {
+            take_sample(srcs, nsrcs);
+            dly.tv_sec = floor(interval);
+            dly.tv_usec = rint((interval - dly.tv_sec) * 1e+6);
+            timeradd(&tnext, &dly, &tnext);
+            if (timercmp(&tnext, &tnow, <)) {
+                /* fell behind; don't try to catch up */
+                timeradd(&tnow, &dly, &tnext);
+            }
+        }
+
+        /* Figure out what it's time to redraw, and do so */
+        if (draw_all) {
+            wclear(ww);
+        }
+        for (i = 0; i < num_widgets; ++i) {
+            w = &(widgets[i]);
+            if (draw_all || w->change_by(w, history.nsamp)) {
+                w->redraw(w, history.nsamp);
+                w->last_drawn = history.nsamp;
+            }
+        }
+        refresh();
+        draw_all = 0;
+    }
+}
@@ -16,6 +16,19 @@
  *
  * Has some kind of problem on macOS (and probably FreeBSD) where it gets
  * EPIPE a lot. The problem is not seen on Linux.
+ *
+ * USDT static tracepoints (provider "tcphammer") are compiled in when
+ * <sys/sdt.h> is available, unless built with -DNO_USDT. They cost only a
+ * no-op instruction each when not being traced. They are:
+ *      action(action, permille, ncmds) -- main loop chose an action, a
+ *          selection probability, and gave that many slots commands
+ *      dispatch(slot, cmd) -- main loop gave a slot a command
+ *      cmd_start(slot, cmd, fd) -- slot thread starts on a command
+ *      cmd_done(slot, cmd, err, duration_us, fd) -- and finishes it
+ *      connect(slot, fd, errno) -- connect() in an open
+ *      exchange(slot, fd, bytes, err) -- data exchange; bytes echoed
+ *      close(slot, fd, errno)
+ * where 'cmd' and 'action' are characters ('o', 'c', 'd', 't').
  */
 /*
  * tcphammer.c - Jeremy Dilatush
@@ -45,6 +58,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE /* for RUSAGE_THREAD */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -57,9 +71,36 @@
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0
+#endif
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#if !defined(NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_USDT
+#endif
+#endif
+#ifdef HAVE_USDT
+#define TRACE2(n,a,b) DTRACE_PROBE2(tcphammer, n, a, b)
+#define TRACE3(n,a,b,c) DTRACE_PROBE3(tcphammer, n, a, b, c)
+#define TRACE4(n,a,b,c,d) DTRACE_PROBE4(tcphammer, n, a, b, c, d)
+#define TRACE5(n,a,b,c,d,e) DTRACE_PROBE5(tcphammer, n, a, b, c, d, e)
+#else
+#define TRACE2(n,a,b) ((void)(a), (void)(b))
+#define TRACE3(n,a,b,c) ((void)(a), (void)(b), (void)(c))
+#define TRACE4(n,a,b,c,d) ((void)(a), (void)(b), (void)(c), (void)(d))
+#define TRACE5(n,a,b,c,d,e) \
+    ((void)(a), (void)(b), (void)(c), (void)(d), (void)(e))
+#endif
 
 void usage(void)
 {
@@ -73,6 +114,19 @@ void usage(void)
           "        50 connection slots: to 127.0.0.1 TCP port 1011. Can be\n"
           "        repeated to connect to different things. Optionally\n"
           "        followed by \"/\" and a name used in reporting.\n"
+          "    c50f/127.0.0.1/11011\n"
+          "        The same, but open with TCP Fast Open: with kopendata,\n"
+          "        the data goes in the SYN. Reports say whether the\n"
+          "        server took it, and the time from the start of the open\n"
+          "        to the first byte of the reply.\n"
+          "    f500 targets.txt\n"
+          "        500 connection slots, spread over the targets listed in\n"
+          "        a file: one per line, with address, TCP port, and\n"
+          "        optionally a relative weight (default 1) and a name\n"
+          "        (the rest of the line), separated by spaces. Each open\n"
+          "        goes to the next target, so they get connections in\n"
+          "        proportion to their weights. Duplicates are merged.\n"
+          "        An \"f\" after the count means TCP Fast Open, as above.\n"
           "    i5.0\n"
           "        typical interval between actions in seconds\n"
           "    s5/0/4\n"
@@ -88,6 +142,7 @@ void usage(void)
           "    kclosedata -- send data immediately before close\n"
           "    ksilentdata -- don't report successful data\n"
           "    kverbose -- detailed reporting for debug purposes\n"
+          "    kusec -- report times in microseconds, not milliseconds\n"
           "    p...\n"
           "        Relative probability of the various actions.\n"
           "        They are:\n"
@@ -99,8 +154,51 @@ void usage(void)
           "                are open and not selected\n"
           "            pt1 -- Toggle; both Open (of selected, not yet open\n"   
           "                slots) and Close (of unselected, open ones)\n"
+          "    w0.2/u\n"
+          "        Spread each action's commands over a window of this many\n"
+          "        seconds, instead of giving them out all at once, which\n"
+          "        makes a burst. After the \"/\", how:\n"
+          "            u -- uniform: each at a random time in the window\n"
+          "            p -- Poisson: random (exponential) gaps between them,\n"
+          "                averaging the window divided by their number\n"
+          "            s -- synchronized burst: all at the end of the\n"
+          "                window, at the same moment\n"
+          "        Put an action letter after the \"w\" (e.g. wo0.5/p) to\n"
+          "        set it only for that action. The spread actually seen,\n"
+          "        from the first command starting to the last, is\n"
+          "        reported at the end.\n"
+          "    zzipf/1.2\n"
+          "        How actions select slots. Normally each slot is selected\n"
+          "        independently, with the same probability, so all are\n"
+          "        alike. These make some slots \"hotter\" than others:\n"
+          "            zzipf/s -- Zipf: a slot's share goes by 1/rank^s,\n"
+          "                with the slots ranked in random order\n"
+          "            zhot/0.1/0.9 -- hot set: 10% of the slots (chosen\n"
+          "                at random) get 90% of the selections\n"
+          "            zweight -- by the weight of the slot's target,\n"
+          "                from an \"f\" file: the one it's connected to,\n"
+          "                or if it's closed, the one it'll connect to\n"
+          "                next (slots from \"c\" lines count as 1)\n"
+          "            zuniform -- the normal way\n"
+          "        The action then picks about as many slots as it would\n"
+          "        have, drawing them from that distribution. Put an action\n"
+          "        letter after the \"z\" (e.g. zdzipf/1) to set it only for\n"
+          "        that action.\n"
           "    t60.0\n"
           "        Send/receive timeout in seconds.\n"
+          "    m/tmp/tcphammer.stats\n"
+          "        Write statistics to the named file about once a second,\n"
+          "        for use by 'stdtop'.\n"
+          "    e30.0\n"
+          "        End after this many seconds, reporting whatever is still\n"
+          "        in progress. By default it runs until killed.\n"
+          "tcphammer also watches whether it's keeping up itself. Once a\n"
+          "second, if its main thread was more than 90% busy, or all its\n"
+          "threads kept the CPUs that busy, or a command started more than\n"
+          "10 ms after it was meant to, it reports that second as\n"
+          "\"saturated\" in a \"#\" line: times measured then are suspect.\n"
+          "At the end it summarizes scheduling delay, CPU time, context\n"
+          "switches and the backlog of unfinished commands.\n"
           , stderr);
     exit(1);
 }
@@ -112,7 +210,11 @@ struct cslot {
     int                     cs_num;     /* slot number */
     struct sockaddr_storage cs_adr;     /* remote address & port */
     int                     cs_adr_len; /* length of cs_adr */
-    char                    cs_name[128];/* name used in reporting */
+    const char             *cs_name;    /* name used in reporting */
+    int                     cs_tfo;     /* open with TCP Fast Open */
+    struct targetlist      *cs_tl;      /* targets from an "f" line, if any */
+    int                     cs_tpos;    /* next target in its spread; the
+                                         * main thread moves it along */
 
     /* connection state */
     int                     cs_sok;     /* socket if connected, -1 otherwise */
@@ -125,10 +227,15 @@ struct cslot {
     pthread_mutex_t         cs_lock;
     unsigned char           cs_cbuf[512];
     int                     cs_cmd;
+    struct timespec         cs_due;     /* when to start the command */
+    int                     cs_action;  /* number of the action it's for */
+    struct timeval          cs_meant;   /* when it was meant to start */
+    struct rusage           cs_ru;      /* thread's resource usage so far */
     pthread_cond_t          cs_wake;
     /*
      * How the above are used for communication with the thread:
-     *      cs_lock is a lock covering cs_cmd, cs_cbuf, and cs_wake
+     *      cs_lock is a lock covering cs_cmd, cs_cbuf, cs_wake, and
+     *          the other fields here
      *      cs_cbuf contains a command or response
      *      cs_cmd identifies a command or response
      *          == 0: nothing
@@ -160,12 +267,113 @@ int *scale_choices;             /* scale control: which ones to choose */
 int scale_nchoices;             /* size of scale_choices */
 const int rand_limit = 5000;    /* max value of scale_nrand */
 int opt_opendata, opt_closedata, opt_verbose; /* option flags */
-int opt_silentdata;             /* more option flags */
+int opt_silentdata, opt_usec;   /* more option flags */
 float prob_data = 15;           /* probability of operation: data */
 float prob_open = 5;            /* probability of operation: open */
 float prob_close = 5;           /* probability of operation: close */
 float prob_toggle = 1;          /* probability of operation: toggle */
 struct timeval rtimeo = { 60, 0 }; /* send/receive timeout */
+float run_time = 0;             /* seconds to run; 0 for no limit */
+
+#define STATS_HIST 32
+char *stats_file;               /* where to write statistics, if anywhere */
+struct timespec stats_next;     /* when to write them (& self_check()) next */
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER; /* covers 'stats' */
+struct {
+    /* statistics for the stats_file, counted since startup */
+    long long   opens, closes, datas;   /* successful operations */
+    long long   errors;                 /* failed operations */
+    int         nsok;                   /* sockets open */
+    long long   lat_hist[STATS_HIST];   /* duration of successful operations:
+                                         * [0] under 1 usec, [i] under 2^i */
+    long long   tfo_opens;              /* opens that tried TCP Fast Open */
+    long long   tfo_used;               /* and had their SYN data taken */
+    long long   fb_num[2];              /* opens with data, [1] if they used
+                                         * TCP Fast Open, [0] if not */
+    long long   fb_us[2];               /* total time from open to first
+                                         * byte back, for them */
+    long long   fb_hist[2][STATS_HIST]; /* and histograms of that */
+    long long   skew_num;               /* actions, with more than one
+                                         * command, whose skew we know */
+    long long   skew_us, skew_max;      /* total & most skew, usec */
+    long long   skew_hist[STATS_HIST];  /* histogram of skew */
+    long long   sched_num;              /* commands started */
+    long long   sched_us, sched_max;    /* total & most scheduling delay:
+                                         * from when each was meant to start
+                                         * to when its thread started it */
+    long long   sched_hist[STATS_HIST]; /* histogram of that */
+    long long   sched_ivmax;            /* most, in this interval */
+    int         backlog, backlog_max;   /* commands still outstanding when
+                                         * the latest action was given out,
+                                         * & the most that's been */
+    long long   cpu_main_us;            /* CPU time: main thread */
+    long long   cpu_slots_us;           /* CPU time: all slot threads */
+    long long   cpu_slot_max_us;        /* CPU time: the busiest one */
+    long long   nvcsw, nivcsw;          /* context switches, all threads:
+                                         * voluntary & involuntary */
+    long long   intervals;              /* self_check() intervals */
+    long long   sat_intervals;          /* and how many were saturated */
+    int         saturated;              /* why the latest one was (SAT_*) */
+} stats;
+
+/*
+ * Self-monitoring: is tcphammer keeping up with what it's asked to do?
+ * Once a second, self_check() looks at the last second ("interval"), and
+ * calls it "saturated" if the main thread, which decides & gives out all
+ * the commands, was busy most of it; or all the threads together kept most
+ * of the CPUs busy; or a command started well after it was meant to. Then
+ * the durations measured in that interval say more about tcphammer than
+ * about what it's testing, and should be discounted.
+ */
+#define SAT_CPU 0.9             /* fraction of a CPU, or of all of them */
+#define SAT_CPU_WALL_US 100000  /* shortest interval to judge CPU use by */
+#define SAT_DELAY_US 10000      /* scheduling delay that's too much */
+#define SAT_MAIN 1              /* saturated: main thread's CPU */
+#define SAT_ALL 2               /* saturated: all threads' CPU */
+#define SAT_DELAY 4             /* saturated: scheduling delay */
+int any_tfo;                    /* are any slots using TCP Fast Open? */
+
+/*
+ * Spreading out each action's commands over time ("w" lines). Each
+ * command gets a time to start, and the slot's thread waits for it.
+ * The "skew" of an action is the time from when the first of its
+ * commands started, to when the last one did; the slot threads keep
+ * track of it in skew_recs[], for the last several actions.
+ */
+struct spread {
+    float       sp_window;      /* seconds; 0 for no spreading */
+    int         sp_how;         /* 'u' uniform, 'p' Poisson, 's' sync */
+} spreads[4];                   /* for actions 'd', 'o', 'c', 't' */
+int any_spread;                 /* were any "w" lines given? */
+
+/*
+ * Skewed selection of slots ("z" lines). Each slot gets a weight, and
+ * an action makes about as many draws from that distribution as it would
+ * have selected slots; the slots drawn at least once are selected. Draws
+ * use an alias table (Walker's method, built as Vose describes), so each
+ * is O(1) however skewed the weights are. Slots are ranked, for Zipf and
+ * the hot set, in one random order shared by all actions, so a slot
+ * that's hot for one action is hot for the others. For "zweight" a slot's
+ * weight follows its target, which changes as it opens and closes; so
+ * those tables are rebuilt before an action, if there's been any of that.
+ */
+struct seldist {
+    int         sd_how;         /* 0 uniform, 'z' Zipf, 'h' hot, 'w' weight */
+    double      sd_a, sd_b;     /* Zipf: exponent; hot: fraction, share */
+    double     *sd_prob;        /* alias table: chance of keeping column */
+    int        *sd_alias;       /* and the slot to take if not */
+} seldists[4];                  /* for actions 'd', 'o', 'c', 't' */
+unsigned char *selmark;         /* slots drawn in this action */
+int *sellist;                   /* the same, as a list */
+double *selw;                   /* scratch space for building alias tables */
+int *selsmall, *sellarge;
+int selw_stale;                 /* "zweight" tables need rebuilding */
+#define SKEW_RECS 16
+struct skewrec {
+    int             action;     /* number of the action, or 0 */
+    int             left;       /* commands that haven't started yet */
+    struct timeval  first, last;/* when the first & last started */
+} skew_recs[SKEW_RECS];         /* covered by stats_lock */
 
 char *timediff(struct timeval *t1, struct timeval *t2, char *buf, int sz)
 {
@@ -184,157 +392,1317 @@ char *timediff(struct timeval *t1, struct timeval *t2, char *buf, int sz)
     }
     buf[0] = '\0';
     buf[sz - 1] = '\0';
-    snprintf(buf, sz, "%s%lu.%03u",
-             sgn, (unsigned long)(dus / 1000000),
-             (unsigned)((dus % 1000000) / 1000));
+    if (opt_usec) {
+        snprintf(buf, sz, "%s%lu.%06u",
+                 sgn, (unsigned long)(dus / 1000000),
+                 (unsigned)(dus % 1000000));
+    } else {
+        snprintf(buf, sz, "%s%lu.%03u",
+                 sgn, (unsigned long)(dus / 1000000),
+                 (unsigned)((dus % 1000000) / 1000));
+    }
+    return(buf);
+}
+
+/* timenum() -- show a time numerically, as seconds since 1970 */
+char *timenum(struct timeval *t, char *buf, int sz)
+{
+    buf[0] = '\0';
+    buf[sz - 1] = '\0';
+    if (opt_usec) {
+        snprintf(buf, sz, "%u.%06u",
+                 (unsigned)t->tv_sec, (unsigned)t->tv_usec);
+    } else {
+        snprintf(buf, sz, "%u.%03u",
+                 (unsigned)t->tv_sec, (unsigned)(t->tv_usec / 1000));
+    }
     return(buf);
 }
 
-char *timeshow(struct timeval *t, char *buf, int sz)
+char *timeshow(struct timeval *t, char *buf, int sz)
+{
+    struct tm tm;
+    char fbuf[64];
+    time_t tt = t->tv_sec;
+
+    memset(&tm, 0, sizeof(tm));
+    localtime_r(&tt, &tm);
+    if (opt_usec) {
+        snprintf(fbuf, sizeof(fbuf), "%%Y-%%m-%%dt%%H:%%M:%%S.%06u",
+                 (unsigned)t->tv_usec);
+    } else {
+        snprintf(fbuf, sizeof(fbuf), "%%Y-%%m-%%dt%%H:%%M:%%S.%03u",
+                 (unsigned)(t->tv_usec / 1000));
+    }
+    buf[0] = '\0';
+    buf[sz - 1] = '\0';
+    strftime(buf, sz, fbuf, &tm);
+    return(buf);
+}
+
+/* stats_count() -- count one operation in 'stats' */
+void stats_count(int cmd, int err, int sokdelta,
+                 struct timeval *tstart, struct timeval *tend)
+{
+    long long us;
+    int i;
+
+    us = tend->tv_sec - tstart->tv_sec;
+    us = us * 1000000 + tend->tv_usec - tstart->tv_usec;
+    pthread_mutex_lock(&stats_lock);
+    stats.nsok += sokdelta;
+    if (err) {
+        stats.errors++;
+    } else {
+        if (cmd == NEGCHAR('o')) { stats.opens++; }
+        if (cmd == NEGCHAR('c')) { stats.closes++; }
+        if (cmd == NEGCHAR('d')) { stats.datas++; }
+        for (i = 0; i < STATS_HIST - 1 && us >= (1LL << i); ++i)
+            ;
+        stats.lat_hist[i]++;
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+ * stats_first_byte() -- count an open with TCP Fast Open ('tfo' 0 if not
+ * tried, 1 if tried but not used, 2 if used), and if data was sent on
+ * it, the time until the first byte came back ('tfirst'; NULL if none)
+ */
+void stats_first_byte(int tfo, struct timeval *tstart, struct timeval *tfirst)
+{
+    long long us;
+    int i, u = (tfo == 2);
+
+    pthread_mutex_lock(&stats_lock);
+    if (tfo) {
+        stats.tfo_opens++;
+        stats.tfo_used += u;
+    }
+    if (tfirst) {
+        us = tfirst->tv_sec - tstart->tv_sec;
+        us = us * 1000000 + tfirst->tv_usec - tstart->tv_usec;
+        stats.fb_num[u]++;
+        stats.fb_us[u] += us;
+        for (i = 0; i < STATS_HIST - 1 && us >= (1LL << i); ++i)
+            ;
+        stats.fb_hist[u][i]++;
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+ * skew_count() -- note that a command of action number 'action' started
+ * at 'tstart'; when that's all of them, count the action's skew
+ */
+void skew_count(int action, struct timeval *tstart)
+{
+    long long us;
+    int i;
+    struct skewrec *sr = &(skew_recs[action % SKEW_RECS]);
+
+    pthread_mutex_lock(&stats_lock);
+    if (sr->action == action && sr->left > 0) {
+        if (timercmp(tstart, &(sr->first), <)) { sr->first = *tstart; }
+        if (timercmp(tstart, &(sr->last), >)) { sr->last = *tstart; }
+        if (--sr->left == 0) {
+            us = sr->last.tv_sec - sr->first.tv_sec;
+            us = us * 1000000 + sr->last.tv_usec - sr->first.tv_usec;
+            stats.skew_num++;
+            stats.skew_us += us;
+            if (us > stats.skew_max) { stats.skew_max = us; }
+            for (i = 0; i < STATS_HIST - 1 && us >= (1LL << i); ++i)
+                ;
+            stats.skew_hist[i]++;
+            if (opt_verbose) {
+                fprintf(stderr, "# action %d skew %lld usec\n",
+                        action, us);
+            }
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+ * sched_count() -- note that a command meant to start at 'tmeant' started
+ * at 'tstart'
+ */
+void sched_count(struct timeval *tmeant, struct timeval *tstart)
+{
+    long long us;
+    int i;
+
+    us = tstart->tv_sec - tmeant->tv_sec;
+    us = us * 1000000 + tstart->tv_usec - tmeant->tv_usec;
+    if (us < 0) {
+        us = 0;
+    }
+    pthread_mutex_lock(&stats_lock);
+    stats.sched_num++;
+    stats.sched_us += us;
+    if (us > stats.sched_max) { stats.sched_max = us; }
+    if (us > stats.sched_ivmax) { stats.sched_ivmax = us; }
+    for (i = 0; i < STATS_HIST - 1 && us >= (1LL << i); ++i)
+        ;
+    stats.sched_hist[i]++;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/* tv_us() -- a struct timeval in microseconds */
+long long tv_us(struct timeval *tv)
+{
+    return((long long)tv->tv_sec * 1000000 + tv->tv_usec);
+}
+
+/*
+ * self_check() -- once a second: gather the threads' resource usage into
+ * 'stats', and decide whether the interval since last time was saturated
+ * (see SAT_*). Reports saturated intervals on stdout, as comments.
+ */
+void self_check(void)
+{
+    static struct timeval tlast;
+    static long long main_last, all_last;
+    static int ncpu;
+    struct timeval tnow;
+    struct rusage ru;
+    long long wall, us, main_us, slots_us, slot_max, vcsw, ivcsw, all_us;
+    long long ivmax;
+    int i, why;
+    struct cslot *slot;
+
+    gettimeofday(&tnow, NULL);
+    stats_next.tv_sec = tnow.tv_sec + 1;
+    stats_next.tv_nsec = tnow.tv_usec * 1000LL;
+    if (!ncpu) {
+        ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        if (ncpu < 1) {
+            ncpu = 1;
+        }
+    }
+
+    /* resource usage: the main thread (this one), and each slot thread
+     * as of the end of its latest command */
+    slots_us = slot_max = vcsw = ivcsw = 0;
+#ifdef RUSAGE_THREAD
+    getrusage(RUSAGE_THREAD, &ru);
+    main_us = tv_us(&(ru.ru_utime)) + tv_us(&(ru.ru_stime));
+    vcsw += ru.ru_nvcsw;
+    ivcsw += ru.ru_nivcsw;
+    for (i = 0; i < ncslots; ++i) {
+        slot = &(cslots[i]);
+        pthread_mutex_lock(&(slot->cs_lock));
+        us = tv_us(&(slot->cs_ru.ru_utime)) + tv_us(&(slot->cs_ru.ru_stime));
+        vcsw += slot->cs_ru.ru_nvcsw;
+        ivcsw += slot->cs_ru.ru_nivcsw;
+        pthread_mutex_unlock(&(slot->cs_lock));
+        slots_us += us;
+        if (us > slot_max) { slot_max = us; }
+    }
+#endif
+    getrusage(RUSAGE_SELF, &ru);
+    all_us = tv_us(&(ru.ru_utime)) + tv_us(&(ru.ru_stime));
+#ifndef RUSAGE_THREAD
+    /* can't tell the threads apart: count it all as the main thread's */
+    main_us = all_us;
+    vcsw = ru.ru_nvcsw;
+    ivcsw = ru.ru_nivcsw;
+#endif
+
+    /* was the interval saturated? */
+    why = 0;
+    wall = tv_us(&tnow) - tv_us(&tlast);
+    pthread_mutex_lock(&stats_lock);
+    ivmax = stats.sched_ivmax;
+    stats.sched_ivmax = 0;
+    if (timerisset(&tlast) && wall > 0) {
+        /* CPU time is counted in ticks, so in a very short interval (as
+         * at the end of the run) it says nothing */
+        if (wall >= SAT_CPU_WALL_US) {
+            if (main_us - main_last >= SAT_CPU * wall) { why |= SAT_MAIN; }
+            if (all_us - all_last >= SAT_CPU * wall * ncpu) {
+                why |= SAT_ALL;
+            }
+        }
+        if (ivmax >= SAT_DELAY_US) { why |= SAT_DELAY; }
+        stats.intervals++;
+        if (why) { stats.sat_intervals++; }
+    }
+    stats.saturated = why;
+    stats.cpu_main_us = main_us;
+    stats.cpu_slots_us = slots_us;
+    stats.cpu_slot_max_us = slot_max;
+    stats.nvcsw = vcsw;
+    stats.nivcsw = ivcsw;
+    pthread_mutex_unlock(&stats_lock);
+
+    if (why) {
+        printf("# saturated %.3f-%.3f:%s%s%s cpu main %.0f%% all %.0f%%,"
+               " scheduling delay max %lld usec\n",
+               tv_us(&tlast) / 1e+6, tv_us(&tnow) / 1e+6,
+               (why & SAT_MAIN) ? " main thread busy;" : "",
+               (why & SAT_ALL) ? " CPUs busy;" : "",
+               (why & SAT_DELAY) ? " commands late;" : "",
+               (main_us - main_last) * 100.0 / wall,
+               (all_us - all_last) * 100.0 / wall, ivmax);
+        fflush(stdout);
+    }
+    tlast = tnow;
+    main_last = main_us;
+    all_last = all_us;
+}
+
+/*
+ * stats_write() -- write the statistics file. It's written to a temporary
+ * file and renamed, so a reader never sees part of one.
+ */
+void stats_write(void)
+{
+    char tmp[512];
+    struct timeval tnow;
+    FILE *fp;
+    int i;
+
+    gettimeofday(&tnow, NULL);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", stats_file);
+    if (!(fp = fopen(tmp, "w"))) {
+        if (opt_verbose) {
+            fprintf(stderr, "# %s: %s\n", tmp, strerror(errno));
+        }
+        return;
+    }
+    pthread_mutex_lock(&stats_lock);
+    fprintf(fp, "tcphammer\n"
+            "pid %d\n"
+            "time_us %lld\n"
+            "conns %d\n"
+            "opens %lld\n"
+            "closes %lld\n"
+            "datas %lld\n"
+            "errors %lld\n"
+            "lat_hist",
+            (int)getpid(),
+            (long long)tnow.tv_sec * 1000000 + tnow.tv_usec,
+            stats.nsok, stats.opens, stats.closes, stats.datas,
+            stats.errors);
+    for (i = 0; i < STATS_HIST; ++i) {
+        fprintf(fp, " %lld", stats.lat_hist[i]);
+    }
+    fputc('\n', fp);
+    fprintf(fp, "sched_num %lld\n"
+            "sched_us %lld\n"
+            "sched_max %lld\n"
+            "sched_hist",
+            stats.sched_num, stats.sched_us, stats.sched_max);
+    for (i = 0; i < STATS_HIST; ++i) {
+        fprintf(fp, " %lld", stats.sched_hist[i]);
+    }
+    fprintf(fp, "\nbacklog %d\n"
+            "backlog_max %d\n"
+            "cpu_main_us %lld\n"
+            "cpu_slots_us %lld\n"
+            "cpu_slot_max_us %lld\n"
+            "nvcsw %lld\n"
+            "nivcsw %lld\n"
+            "intervals %lld\n"
+            "sat_intervals %lld\n"
+            "saturated %d\n",
+            stats.backlog, stats.backlog_max, stats.cpu_main_us,
+            stats.cpu_slots_us, stats.cpu_slot_max_us, stats.nvcsw,
+            stats.nivcsw, stats.intervals, stats.sat_intervals,
+            stats.saturated);
+    if (any_spread) {
+        fprintf(fp, "skew_num %lld\n"
+                "skew_us %lld\n"
+                "skew_max %lld\n"
+                "skew_hist",
+                stats.skew_num, stats.skew_us, stats.skew_max);
+        for (i = 0; i < STATS_HIST; ++i) {
+            fprintf(fp, " %lld", stats.skew_hist[i]);
+        }
+        fputc('\n', fp);
+    }
+    if (any_tfo) {
+        fprintf(fp, "tfo_opens %lld\n"
+                "tfo_used %lld\n"
+                "first_byte_tfo %lld %lld\n"
+                "first_byte_plain %lld %lld\n",
+                stats.tfo_opens, stats.tfo_used,
+                stats.fb_num[1], stats.fb_us[1],
+                stats.fb_num[0], stats.fb_us[0]);
+        fprintf(fp, "fb_hist_tfo");
+        for (i = 0; i < STATS_HIST; ++i) {
+            fprintf(fp, " %lld", stats.fb_hist[1][i]);
+        }
+        fprintf(fp, "\nfb_hist_plain");
+        for (i = 0; i < STATS_HIST; ++i) {
+            fprintf(fp, " %lld", stats.fb_hist[0][i]);
+        }
+        fputc('\n', fp);
+    }
+    pthread_mutex_unlock(&stats_lock);
+    if (fclose(fp) != 0 || rename(tmp, stats_file) < 0) {
+        if (opt_verbose) {
+            fprintf(stderr, "# %s: %s\n", stats_file, strerror(errno));
+        }
+        unlink(tmp);
+    }
+}
+
+/*
+ * hash_bytes() -- FNV-1a hash of some bytes, 'h' being the hash of what
+ * came before them (or 0); then mixed up some more, since FNV-1a's low
+ * bits don't depend much on the earlier bytes, and those are what pick
+ * a hash table entry.
+ */
+unsigned hash_bytes(unsigned h, const void *vp, int len)
+{
+    const unsigned char *p = vp;
+    int i;
+
+    h ^= 2166136261U;
+    for (i = 0; i < len; ++i) {
+        h = (h ^ p[i]) * 16777619U;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    return(h);
+}
+
+/* float_compare() -- comparator for qsort() to compare to floats */
+int float_compare(const void *x, const void *y)
+{
+    float xx = *(const float *)x;
+    float yy = *(const float *)y;
+    if (xx < yy) return -1;
+    if (xx > yy) return 1;
+    return 0;
+}
+
+/*
+ * intern() -- keep one copy of each distinct string, such as slot and
+ * target names, so there can be lots of them cheaply. Returns a pointer
+ * to the copy, which is never freed.
+ */
+const char *intern(const char *s, int len)
+{
+    static struct {
+        unsigned h;             /* hash of the string, to compare first */
+        const char *s;          /* the string, or NULL if unused */
+    } *tab, *ntab;              /* hash table of strings */
+    static int tabsz, tabn;     /* its size (a power of 2), and use */
+    static char *arena;         /* where new copies go */
+    static int arena_left;      /* and how much room is left there */
+    const char *cp;
+    unsigned h, k;
+    int i, j;
+
+    if (tabn * 2 >= tabsz) {
+        /* grow the table */
+        j = tabsz ? tabsz * 2 : 1024;
+        ntab = calloc(j, sizeof(ntab[0]));
+        if (!ntab) {
+            fprintf(stderr, "Memory allocation problem.\n");
+            exit(1);
+        }
+        for (i = 0; i < tabsz; ++i) {
+            if (!tab[i].s) {
+                continue;
+            }
+            for (k = tab[i].h; ntab[k & (j - 1)].s; ++k)
+                ;
+            ntab[k & (j - 1)] = tab[i];
+        }
+        free(tab);
+        tab = ntab;
+        tabsz = j;
+    }
+    h = hash_bytes(0, s, len);
+    for (k = h; (cp = tab[k & (tabsz - 1)].s); ++k) {
+        if (tab[k & (tabsz - 1)].h == h &&
+            !strncmp(cp, s, len) && cp[len] == '\0') {
+            return(cp);
+        }
+    }
+    if (len + 1 > arena_left) {
+        arena_left = (len + 1 > 65536) ? (len + 1) : 65536;
+        if (!(arena = malloc(arena_left))) {
+            fprintf(stderr, "Memory allocation problem.\n");
+            exit(1);
+        }
+    }
+    memcpy(arena, s, len);
+    arena[len] = '\0';
+    tab[k & (tabsz - 1)].h = h;
+    tab[k & (tabsz - 1)].s = cp = arena;
+    arena += len + 1;
+    arena_left -= len + 1;
+    ++tabn;
+    return(cp);
+}
+
+/*
+ * parse_address() -- fill in a socket address from an IPv4 or IPv6
+ * address string and a port number. Returns 0 on success, -1 if the
+ * address can't be parsed.
+ */
+int parse_address(const char *abuf, int port,
+                  struct sockaddr_storage *ss, int *lenp)
+{
+    struct sockaddr_in *sinp;
+    struct sockaddr_in6 *sin6p;
+
+    memset(ss, 0, sizeof(*ss));
+    if (strchr(abuf, ':')) {
+        /* IPv6 */
+        sin6p = (struct sockaddr_in6 *)ss;
+        sin6p->sin6_family = AF_INET6;
+        if (inet_pton(AF_INET6, abuf, &(sin6p->sin6_addr)) <= 0) {
+            return(-1);
+        }
+#ifdef USE_SIN_LEN
+        sin6p->sin_len = sizeof(*sin6p);
+#endif
+        sin6p->sin6_port = htons(port);
+        *lenp = sizeof(*sin6p);
+    } else {
+        /* IPv4 */
+        sinp = (struct sockaddr_in *)ss;
+        sinp->sin_family = AF_INET;
+        if (inet_pton(AF_INET, abuf, &(sinp->sin_addr)) <= 0) {
+            return(-1);
+        }
+#ifdef USE_SIN_LEN
+        sinp->sin_len = sizeof(*sinp);
+#endif
+        sinp->sin_port = htons(port);
+        *lenp = sizeof(*sinp);
+    }
+    return(0);
+}
+
+/*
+ * new_slots() -- allocate 'count' more connection slots, and set up the
+ * first of them with default values. Returns a pointer to that one, or
+ * NULL on error. The caller fills it in and then calls copy_slots().
+ */
+struct cslot *new_slots(int count)
+{
+    struct cslot *slot;
+
+    if (count < 1) {
+        fprintf(stderr, "Slot count must be positive\n");
+        return(NULL);
+    }
+    if (count + ncslots > slot_limit) {
+        fprintf(stderr, "Max number of connection slots is %d\n",
+                (int)slot_limit);
+        return(NULL);
+    }
+    if (count + ncslots > acslots) {
+        acslots = count + ncslots;
+        acslots += acslots >> 2;
+        acslots += 3;
+        cslots = realloc(cslots, acslots * sizeof(cslots[0]));
+        if (!cslots) {
+            fprintf(stderr, "Memory allocation problem.\n");
+            return(NULL);
+        }
+    }
+    slot = &(cslots[ncslots]);
+    memset(slot, 0, sizeof(*slot));
+    slot->cs_sok = -1;
+    slot->cs_is_open = 0;
+    slot->cs_dlen = slot->cs_dpos = 0;
+    slot->cs_cmd = 0;
+    slot->cs_num = ncslots;
+    ++ncslots;
+    return(slot);
+}
+
+/* copy_slots() -- make the rest of the slots new_slots() allocated */
+void copy_slots(struct cslot *template, int count)
+{
+    struct cslot *slot;
+    int i;
+
+    for (i = 1; i < count; ++i) {
+        slot = &(cslots[ncslots]);
+        memcpy(slot, template, sizeof(*slot));
+        slot->cs_num = ncslots;
+        ++ncslots;
+    }
+}
+
+/*
+ * parse_slot_count() -- parse the slot count at the start of a "c" or
+ * "f" line, and the "f" flag for TCP Fast Open after it. Returns a
+ * pointer to what follows the separator ('sep') after them, or NULL on
+ * error.
+ */
+char *parse_slot_count(char *line, int sep, int *countp, int *tfop)
+{
+    char *cp;
+
+    cp = line + 1;
+    *countp = atoi(cp);
+    cp += strspn(cp, "0123456789");
+    *tfop = 0;
+    if (*cp == 'f') {
+        *tfop = 1;
+        ++cp;
+    }
+    if (*cp != sep && *cp != '\0') {
+        fprintf(stderr, "Unknown slot flag '%c' in '%s'\n", (int)*cp, line);
+        return(NULL);
+    }
+    if (*cp == sep) {
+        ++cp;
+    } else {
+        fprintf(stderr, "Too few parts in '%s'\n", line);
+        return(NULL);
+    }
+#ifndef MSG_FASTOPEN
+    if (*tfop) {
+        fprintf(stderr, "TCP Fast Open isn't available here; ignoring 'f'\n");
+        *tfop = 0;
+    }
+#endif
+    any_tfo |= *tfop;
+    return(cp);
+}
+
+int parse_config_slots (char *line)
+{
+    /*
+     * 3 or 4 components separated by "/":
+     *      number of slots, optionally followed by "f" for TCP Fast Open
+     *      IPv4 or IPv6 address
+     *      TCP port number
+     *      optional label string
+     */
+    char *cp;
+    int count, i, j, tfo;
+    struct cslot *slot;
+    char abuf[64], nbuf[128];
+    struct sockaddr_storage adr;
+    int adr_len;
+
+    /* first argument: count */
+    if (!(cp = parse_slot_count(line, '/', &count, &tfo))) {
+        return(-1);
+    }
+
+    /* second argument: IPv4 or IPv6 address */
+    i = strcspn(cp, "/");
+    j = (i < sizeof(abuf)) ? i : (sizeof(abuf) - 1);
+    strncpy(abuf, cp, j);
+    abuf[j] = '\0';
+    cp += i;
+    if (*cp == '/') {
+        ++cp;
+    } else {
+        fprintf(stderr, "Too few parts in '%s'\n", line);
+        return(-1);
+    }
+
+    /* third argument: TCP port */
+    i = atoi(cp);
+    if (parse_address(abuf, i, &adr, &adr_len) < 0) {
+        fprintf(stderr, "Error parsing address '%s'\n", abuf);
+        return(-1);
+    }
+    cp += strcspn(cp, "/");
+
+    /* fourth argument, optional: name */
+    if (*cp == '/') {
+        ++cp;
+        snprintf(nbuf, sizeof(nbuf), "%s", cp);
+    } else {
+        snprintf(nbuf, sizeof(nbuf), "%s/%d", abuf, i);
+    }
+
+    /* make however many copies of the slot structure are desired */
+    if (!(slot = new_slots(count))) {
+        return(-1);
+    }
+    slot->cs_adr = adr;
+    slot->cs_adr_len = adr_len;
+    slot->cs_name = intern(nbuf, strlen(nbuf));
+    slot->cs_tfo = tfo;
+    copy_slots(slot, count);
+
+    return(0);
+}
+
+/*
+ * Target files, for the "f" line: lots of addresses to connect to, each
+ * with a weight and a name. The slots from an "f" line share a 'struct
+ * targetlist', and each time one of them opens a connection it takes
+ * the next target from the list's "spread" array. That lists each
+ * target a number of times proportional to its weight, and at least
+ * once if its weight isn't 0; it's made long enough (up to SPREAD_MAX
+ * entries) that the lightest target's share comes out as one entry.
+ * Each target's entries are spread evenly through it, not bunched
+ * together. The slots start out evenly spaced along it. So the targets get connections
+ * in proportion to their weights, as long as the slots keep up; except
+ * that past SPREAD_MAX, very light targets get a little more than their
+ * share, rather than none.
+ */
+#define SPREAD_MAX (1 << 20)
+struct target {
+    union {                             /* remote address & port; smaller
+                                         * than a sockaddr_storage */
+        struct sockaddr         sa;
+        struct sockaddr_in      sin;
+        struct sockaddr_in6     sin6;
+    }                       t_adr;
+    int                     t_adr_len;  /* length of t_adr */
+    const char             *t_name;     /* name used in reporting */
+    double                  t_weight;   /* relative share of connections */
+};
+
+struct targetlist {
+    struct target          *tl_targets; /* the distinct targets */
+    int                     tl_ntargets;
+    int                    *tl_spread;  /* indices into tl_targets[] */
+    int                     tl_nspread;
+};
+
+/* target_to_slot() -- set a slot to connect to a target */
+void target_to_slot(struct target *t, struct cslot *slot)
+{
+    memcpy(&(slot->cs_adr), &(t->t_adr), t->t_adr_len);
+    slot->cs_adr_len = t->t_adr_len;
+    slot->cs_name = t->t_name;
+}
+
+/* target_hash() -- hash of a target's address & port, for duplicates */
+unsigned target_hash(struct target *t)
+{
+    if (t->t_adr.sa.sa_family == AF_INET6) {
+        return(hash_bytes(t->t_adr.sin6.sin6_port,
+                          &(t->t_adr.sin6.sin6_addr),
+                          sizeof(t->t_adr.sin6.sin6_addr)));
+    } else {
+        return(hash_bytes(t->t_adr.sin.sin_port,
+                          &(t->t_adr.sin.sin_addr),
+                          sizeof(t->t_adr.sin.sin_addr)));
+    }
+}
+
+/* target_same() -- do two targets have the same address & port? */
+int target_same(struct target *t1, struct target *t2)
+{
+    if (t1->t_adr.sa.sa_family != t2->t_adr.sa.sa_family) {
+        return(0);
+    }
+    if (t1->t_adr.sa.sa_family == AF_INET6) {
+        return(t1->t_adr.sin6.sin6_port == t2->t_adr.sin6.sin6_port &&
+               !memcmp(&(t1->t_adr.sin6.sin6_addr), &(t2->t_adr.sin6.sin6_addr),
+                       sizeof(t1->t_adr.sin6.sin6_addr)));
+    } else {
+        return(t1->t_adr.sin.sin_port == t2->t_adr.sin.sin_port &&
+               t1->t_adr.sin.sin_addr.s_addr == t2->t_adr.sin.sin_addr.s_addr);
+    }
+}
+
+/*
+ * target_entries() -- how many entries target 't' gets in a spread of
+ * about 'n' entries, of weights adding up to 'total'
+ */
+int target_entries(struct target *t, double n, double total)
+{
+    double e;
+
+    if (!(t->t_weight > 0)) {
+        return(0);
+    }
+    e = floor(t->t_weight * n / total + 0.5);
+    return((e < 1) ? 1 : (int)e);
+}
+
+/* one entry of a spread, while it's being put in order */
+struct spread_ent {
+    double  se_key;     /* where it goes: (k + 0.5) / entries, k'th one */
+    int     se_target;  /* index into tl_targets[] */
+};
+
+int spread_ent_compare(const void *x, const void *y)
+{
+    const struct spread_ent *xx = x, *yy = y;
+    if (xx->se_key < yy->se_key) return -1;
+    if (xx->se_key > yy->se_key) return 1;
+    return xx->se_target - yy->se_target;
+}
+
+/*
+ * load_targets() -- read a target file into a target list. Each line
+ * has an address, a port, and optionally a weight (default 1) and a
+ * name (the rest of the line; default address/port), separated by
+ * spaces or tabs. Blank lines and lines starting with "#" are ignored.
+ * A target listed more than once gets the sum of its weights, and the
+ * first name it was given. The file is mapped into memory and scanned
+ * in place, so a big one loads fast. Returns NULL on error.
+ */
+struct targetlist *load_targets(const char *path, int nslots)
+{
+    struct targetlist *tl;
+    struct target t;
+    struct sockaddr_storage ss;
+    struct stat st;
+    const char *p, *end, *tok, *ptok, *base;
+    char abuf[64], nbuf[128];
+    int fd, lineno, port, plen, atargets, *hash, hsz, i, j, k, m, ndup = 0;
+    double w, frac, total, wmin, n;
+    struct spread_ent *se;
+    struct timeval t0, t1;
+    unsigned h;
+
+    gettimeofday(&t0, NULL);
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        if (fd >= 0) { close(fd); }
+        return(NULL);
+    }
+    base = NULL;
+    if (st.st_size > 0) {
+        base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+                    fd, 0);
+        if (base == MAP_FAILED) {
+            fprintf(stderr, "%s: mmap: %s\n", path, strerror(errno));
+            close(fd);
+            return(NULL);
+        }
+    }
+    close(fd);
+
+    /* size things for a guess at how many lines there are */
+    atargets = 1024;
+    while (atargets < st.st_size / 24 && atargets < (1 << 24)) {
+        atargets *= 2;
+    }
+    hsz = atargets * 2;
+    tl = calloc(1, sizeof(*tl));
+    hash = malloc(hsz * sizeof(hash[0]));
+    if (tl) {
+        tl->tl_targets = malloc(atargets * sizeof(tl->tl_targets[0]));
+    }
+    if (!tl || !tl->tl_targets || !hash) {
+        fprintf(stderr, "Memory allocation problem.\n");
+        exit(1);
+    }
+    memset(hash, 0xff, hsz * sizeof(hash[0]));
+
+    p = base;
+    end = base + st.st_size;
+    for (lineno = 1; p < end; ++lineno, ++p) {
+        /* address */
+        while (p < end && (*p == ' ' || *p == '\t')) { ++p; }
+        if (p >= end || *p == '\n' || *p == '\r' || *p == '#') {
+            while (p < end && *p != '\n') { ++p; }
+            continue;
+        }
+        for (tok = p; p < end && !isspace((unsigned char)*p); ++p)
+            ;
+        if (p - tok >= sizeof(abuf)) {
+            fprintf(stderr, "%s:%d: address too long\n", path, lineno);
+            goto bad;
+        }
+        memcpy(abuf, tok, p - tok);
+        abuf[p - tok] = '\0';
+
+        /* port */
+        while (p < end && (*p == ' ' || *p == '\t')) { ++p; }
+        for (port = 0, ptok = p; p < end && isdigit((unsigned char)*p); ++p) {
+            port = port * 10 + (*p - '0');
+        }
+        plen = p - ptok;
+        if (plen < 1 || plen > 5 || port > 65535) {
+            fprintf(stderr, "%s:%d: missing or bad port number\n",
+                    path, lineno);
+            goto bad;
+        }
+        if (parse_address(abuf, port, &ss, &(t.t_adr_len)) < 0) {
+            fprintf(stderr, "%s:%d: error parsing address '%s'\n",
+                    path, lineno, abuf);
+            goto bad;
+        }
+        memcpy(&(t.t_adr), &ss, t.t_adr_len);
+
+        /* weight, optional */
+        while (p < end && (*p == ' ' || *p == '\t')) { ++p; }
+        w = 1;
+        if (p < end && (isdigit((unsigned char)*p) || *p == '.')) {
+            for (w = 0; p < end && isdigit((unsigned char)*p); ++p) {
+                w = w * 10 + (*p - '0');
+            }
+            if (p < end && *p == '.') {
+                for (++p, frac = 0.1;
+                     p < end && isdigit((unsigned char)*p);
+                     ++p, frac /= 10) {
+                    w += frac * (*p - '0');
+                }
+            }
+            if (p < end && !isspace((unsigned char)*p)) {
+                fprintf(stderr, "%s:%d: bad weight\n", path, lineno);
+                goto bad;
+            }
+        }
+        t.t_weight = w;
+
+        /* name, optional: the rest of the line */
+        while (p < end && (*p == ' ' || *p == '\t')) { ++p; }
+        for (tok = p; p < end && *p != '\n'; ++p)
+            ;
+        j = p - tok;
+        while (j > 0 && isspace((unsigned char)tok[j - 1])) { --j; }
+        if (j >= sizeof(nbuf)) {
+            j = sizeof(nbuf) - 1;
+        }
+
+        /* is it a duplicate? */
+        for (h = target_hash(&t); (i = hash[h & (hsz - 1)]) >= 0; ++h) {
+            if (target_same(&t, &(tl->tl_targets[i]))) {
+                break;
+            }
+        }
+        if (i >= 0) {
+            tl->tl_targets[i].t_weight += t.t_weight;
+            ++ndup;
+            continue;
+        }
+
+        /* no; add it, with its name (default address/port) */
+        if (j > 0) {
+            t.t_name = intern(tok, j);
+        } else {
+            i = strlen(abuf);
+            memcpy(nbuf, abuf, i);
+            nbuf[i++] = '/';
+            memcpy(nbuf + i, ptok, plen);
+            t.t_name = intern(nbuf, i + plen);
+        }
+        if (tl->tl_ntargets >= atargets) {
+            atargets *= 2;
+            tl->tl_targets = realloc(tl->tl_targets,
+                                     atargets * sizeof(tl->tl_targets[0]));
+            if (!tl->tl_targets) {
+                fprintf(stderr, "Memory allocation problem.\n");
+                exit(1);
+            }
+        }
+        i = tl->tl_ntargets++;
+        tl->tl_targets[i] = t;
+        hash[h & (hsz - 1)] = i;
+        if (tl->tl_ntargets * 2 >= hsz) {
+            /* grow the hash table */
+            free(hash);
+            hsz *= 2;
+            if (!(hash = malloc(hsz * sizeof(hash[0])))) {
+                fprintf(stderr, "Memory allocation problem.\n");
+                exit(1);
+            }
+            memset(hash, 0xff, hsz * sizeof(hash[0]));
+            for (i = 0; i < tl->tl_ntargets; ++i) {
+                for (h = target_hash(&(tl->tl_targets[i]));
+                     hash[h & (hsz - 1)] >= 0; ++h)
+                    ;
+                hash[h & (hsz - 1)] = i;
+            }
+        }
+    }
+    free(hash);
+    hash = NULL;
+    if (base) {
+        munmap((void *)base, st.st_size);
+    }
+
+    /* spread the targets by weight */
+    wmin = 0;
+    for (total = 0, i = 0; i < tl->tl_ntargets; ++i) {
+        w = tl->tl_targets[i].t_weight;
+        total += w;
+        if (w > 0 && (wmin == 0 || w < wmin)) {
+            wmin = w;
+        }
+    }
+    if (!(total > 0)) {
+        fprintf(stderr, "%s: no targets, or all have weight 0\n", path);
+        return(NULL);
+    }
+    n = ceil(total / wmin); /* so the lightest gets one entry */
+    if (n > SPREAD_MAX) {
+        n = SPREAD_MAX;
+    }
+    if (n < tl->tl_ntargets) {
+        n = tl->tl_ntargets;
+    }
+    if (n < nslots) {
+        n = nslots;
+    }
+    for (tl->tl_nspread = 0, i = 0; i < tl->tl_ntargets; ++i) {
+        tl->tl_nspread += target_entries(&(tl->tl_targets[i]), n, total);
+    }
+    tl->tl_spread = malloc(tl->tl_nspread * sizeof(tl->tl_spread[0]));
+    se = malloc(tl->tl_nspread * sizeof(se[0]));
+    if (!tl->tl_spread || !se) {
+        fprintf(stderr, "Memory allocation problem.\n");
+        exit(1);
+    }
+    /* interleave them, as in stride scheduling: each target's entries
+     * are evenly spaced along the spread, so a slot stepping along it
+     * doesn't go to a heavy target many times in a row */
+    for (i = j = 0; i < tl->tl_ntargets; ++i) {
+        m = target_entries(&(tl->tl_targets[i]), n, total);
+        for (k = 0; k < m; ++k) {
+            se[j].se_key = (k + 0.5) / m;
+            se[j].se_target = i;
+            ++j;
+        }
+    }
+    qsort(se, tl->tl_nspread, sizeof(se[0]), &spread_ent_compare);
+    for (j = 0; j < tl->tl_nspread; ++j) {
+        tl->tl_spread[j] = se[j].se_target;
+    }
+    free(se);
+
+    if (opt_verbose) {
+        gettimeofday(&t1, NULL);
+        fprintf(stderr, "# %s: %d targets (%d duplicates) in %ld usec\n",
+                path, tl->tl_ntargets, ndup,
+                (long)((t1.tv_sec - t0.tv_sec) * 1000000 +
+                       (t1.tv_usec - t0.tv_usec)));
+    }
+    return(tl);
+
+bad:
+    free(hash);
+    if (base) {
+        munmap((void *)base, st.st_size);
+    }
+    return(NULL);
+}
+
+int parse_config_target_file(char *line)
+{
+    /*
+     * 2 components separated by a space:
+     *      number of slots, optionally followed by "f" for TCP Fast Open
+     *      name of the target file
+     */
+    char *cp;
+    int count, tfo, i;
+    struct cslot *slot;
+    struct targetlist *tl;
+
+    if (!(cp = parse_slot_count(line, ' ', &count, &tfo))) {
+        return(-1);
+    }
+    if (count < 1) {
+        fprintf(stderr, "Slot count must be positive\n");
+        return(-1);
+    }
+    if (!(tl = load_targets(cp, count))) {
+        return(-1);
+    }
+    if (!(slot = new_slots(count))) {
+        return(-1);
+    }
+    slot->cs_tl = tl;
+    slot->cs_tfo = tfo;
+    i = slot->cs_num;
+    copy_slots(slot, count);
+    for (; i < ncslots; ++i) {
+        /* start the slots evenly spaced along the spread */
+        slot = &(cslots[i]);
+        slot->cs_tpos = (long long)(i - (ncslots - count)) *
+            tl->tl_nspread / count;
+        target_to_slot(&(tl->tl_targets[tl->tl_spread[slot->cs_tpos]]),
+                       slot);
+    }
+
+    return(0);
+}
+
+int parse_config_spread(char *line)
+{
+    /*
+     * Optional action letter, window in seconds, and optionally "/"
+     * and how to spread: 'u', 'p', or 's'. Parsed into spreads[].
+     */
+    char *cp = line + 1;
+    const char *acts = "doct", *ap;
+    struct spread sp;
+    int i;
+
+    ap = NULL;
+    if (*cp && strchr(acts, *cp)) {
+        ap = strchr(acts, *cp);
+        ++cp;
+    }
+    sp.sp_window = atof(cp);
+    if (!(sp.sp_window >= 0 && sp.sp_window <= 86400)) {
+        fprintf(stderr, "Spread window %f out of range 0-86400\n",
+                sp.sp_window);
+        return(-1);
+    }
+    sp.sp_how = 'u';
+    cp += strcspn(cp, "/");
+    if (*cp == '/') {
+        sp.sp_how = cp[1];
+        if (!strchr("ups", sp.sp_how) || !sp.sp_how || cp[2]) {
+            fprintf(stderr, "Unknown spread type '%s'\n", cp + 1);
+            return(-1);
+        }
+    }
+    for (i = 0; i < 4; ++i) {
+        if (!ap || ap == acts + i) {
+            spreads[i] = sp;
+        }
+    }
+    any_spread = 1;
+    return(0);
+}
+
+int parse_config_seldist(char *line)
+{
+    /*
+     * Optional action letter, then "zipf/s", "hot/frac/share", "weight" or
+     * "uniform". Parsed into seldists[].
+     */
+    char *cp = line + 1, *e;
+    const char *acts = "doct", *ap;
+    struct seldist sd;
+    int i;
+
+    ap = NULL;
+    if (*cp && strchr(acts, *cp)) {
+        ap = strchr(acts, *cp);
+        ++cp;
+    }
+    memset(&sd, 0, sizeof(sd));
+    if (!strncasecmp(cp, "zipf/", 5)) {
+        sd.sd_how = 'z';
+        sd.sd_a = strtod(cp + 5, &e);
+        if (*e || !(sd.sd_a >= 0 && sd.sd_a <= 10)) {
+            fprintf(stderr, "Zipf exponent '%s' not in range 0-10\n", cp + 5);
+            return(-1);
+        }
+    } else if (!strncasecmp(cp, "hot/", 4)) {
+        sd.sd_how = 'h';
+        sd.sd_a = strtod(cp + 4, &e);
+        if (*e == '/') {
+            sd.sd_b = strtod(e + 1, &e);
+        } else {
+            sd.sd_b = -1; /* the share is required; this fails below */
+        }
+        if (*e || !(sd.sd_a > 0 && sd.sd_a <= 1) ||
+            !(sd.sd_b >= 0 && sd.sd_b <= 1)) {
+            fprintf(stderr, "Hot set '%s' must be two fractions,"
+                    " 0-1, separated by \"/\"\n", cp + 4);
+            return(-1);
+        }
+    } else if (!strcasecmp(cp, "weight")) {
+        sd.sd_how = 'w';
+    } else if (strcasecmp(cp, "uniform")) {
+        fprintf(stderr, "Unknown selection distribution '%s'\n", cp);
+        return(-1);
+    }
+    for (i = 0; i < 4; ++i) {
+        if (!ap || ap == acts + i) {
+            seldists[i] = sd;
+        }
+    }
+    return(0);
+}
+
+/*
+ * slot_target_weight() -- a slot's weight for "zweight": that of the
+ * target it's connected to, or if it's closed, of the one it'll connect
+ * to next.
+ */
+double slot_target_weight(struct cslot *slot)
 {
-    struct tm tm;
-    char fbuf[64];
-    time_t tt = t->tv_sec;
+    struct targetlist *tl = slot->cs_tl;
+    int pos;
 
-    memset(&tm, 0, sizeof(tm));
-    localtime_r(&tt, &tm);
-    snprintf(fbuf, sizeof(fbuf), "%%Y-%%m-%%dt%%H:%%M:%%S.%03u",
-             (unsigned)(t->tv_usec / 1000));
-    buf[0] = '\0';
-    buf[sz - 1] = '\0';
-    strftime(buf, sz, fbuf, &tm);
-    return(buf);
+    if (!tl) {
+        return(1); /* from a "c" line */
+    }
+    pos = slot->cs_tpos;
+    if (slot->cs_is_open) {
+        /* cs_tpos has moved on past the one it opened to */
+        pos = ((pos > 0) ? pos : tl->tl_nspread) - 1;
+    }
+    return(tl->tl_targets[tl->tl_spread[pos]].t_weight);
 }
 
-/* float_compare() -- comparator for qsort() to compare to floats */
-int float_compare(const void *x, const void *y)
+/*
+ * seldist_alias() -- build a "z" line's alias table from the slots'
+ * weights in w[].
+ */
+void seldist_alias(struct seldist *sd, double *w)
 {
-    float xx = *(const float *)x;
-    float yy = *(const float *)y;
-    if (xx < yy) return -1;
-    if (xx > yy) return 1;
-    return 0;
+    double total;
+    int ns, nl, i, j;
+
+    total = 0;
+    for (i = 0; i < ncslots; ++i) {
+        total += w[i];
+    }
+    if (!(total > 0)) {
+        for (i = 0; i < ncslots; ++i) {
+            w[i] = 1;
+        }
+        total = ncslots;
+    }
+
+    /* scale weights to average 1; then repeatedly fill up a column that's
+     * short with part of one that's over */
+    ns = nl = 0;
+    for (i = 0; i < ncslots; ++i) {
+        sd->sd_prob[i] = w[i] * ncslots / total;
+        sd->sd_alias[i] = i;
+        if (sd->sd_prob[i] < 1) {
+            selsmall[ns++] = i;
+        } else {
+            sellarge[nl++] = i;
+        }
+    }
+    while (ns > 0 && nl > 0) {
+        i = selsmall[--ns];
+        j = sellarge[nl - 1];
+        sd->sd_alias[i] = j;
+        sd->sd_prob[j] -= 1 - sd->sd_prob[i];
+        if (sd->sd_prob[j] < 1) {
+            --nl;
+            selsmall[ns++] = j;
+        }
+    }
+    while (nl > 0) {
+        sd->sd_prob[sellarge[--nl]] = 1; /* left over from rounding */
+    }
+    while (ns > 0) {
+        sd->sd_prob[selsmall[--ns]] = 1;
+    }
 }
 
-int parse_config_slots (char *line)
+/*
+ * seldist_setup() -- after the configuration's been read, build the alias
+ * tables for the "z" lines.
+ */
+void seldist_setup(void)
 {
-    /*
-     * 3 or 4 components separated by "/":
-     *      number of slots
-     *      IPv4 or IPv6 address
-     *      TCP port number
-     *      optional label string
-     */
-    char *cp;
-    int count, i, j;
-    struct cslot *slot, *template;
-    char abuf[64];
-    struct sockaddr_in *sinp;
-    struct sockaddr_in6 *sin6p;
+    int *rank, nh, i, j, k;
+    struct seldist *sd;
 
-    /* first argument: count */
-    cp = line + 1;
-    count = atoi(cp);
-    cp += strcspn(cp, "/");
-    if (*cp == '/') {
-        ++cp;
-    } else {
-        fprintf(stderr, "Too few parts in '%s'\n", line);
-        return(-1);
+    rank = calloc(ncslots + 1, sizeof(rank[0]));
+    selw = calloc(ncslots + 1, sizeof(selw[0]));
+    selsmall = calloc(ncslots + 1, sizeof(selsmall[0]));
+    sellarge = calloc(ncslots + 1, sizeof(sellarge[0]));
+    selmark = calloc(ncslots + 1, sizeof(selmark[0]));
+    sellist = calloc(ncslots + 1, sizeof(sellist[0]));
+    if (!rank || !selw || !selsmall || !sellarge || !selmark || !sellist) {
+        fprintf(stderr, "Memory allocation problem.\n");
+        exit(1);
     }
 
-    /* allocate space for that many connection slots */
-    if (count < 1) {
-        fprintf(stderr, "Slot count must be positive\n");
-        return(-1);
+    /* rank the slots in a random order (Fisher-Yates shuffle) */
+    for (i = 0; i < ncslots; ++i) {
+        rank[i] = i;
     }
-    if (count + ncslots > slot_limit) {
-        fprintf(stderr, "Max number of connection slots is %d\n",
-                (int)slot_limit);
-        return(-1);
+    for (i = ncslots - 1; i > 0; --i) {
+        j = lrand48() % (i + 1);
+        k = rank[i];
+        rank[i] = rank[j];
+        rank[j] = k;
     }
-    if (count + ncslots > acslots) {
-        acslots = count + ncslots;
-        acslots += acslots >> 2;
-        acslots += 3;
-        cslots = realloc(cslots, acslots * sizeof(cslots[0]));
-        if (!cslots) {
+
+    for (k = 0; k < 4; ++k) {
+        sd = &(seldists[k]);
+        if (!sd->sd_how) {
+            continue;
+        }
+        sd->sd_prob = calloc(ncslots + 1, sizeof(sd->sd_prob[0]));
+        sd->sd_alias = calloc(ncslots + 1, sizeof(sd->sd_alias[0]));
+        if (!sd->sd_prob || !sd->sd_alias) {
             fprintf(stderr, "Memory allocation problem.\n");
-            return(-1);
+            exit(1);
         }
-    }
-    slot = template = &(cslots[ncslots]);
-    memset(slot, 0, sizeof(*slot));
-    slot->cs_sok = -1;
-    slot->cs_is_open = 0;
-    slot->cs_dlen = slot->cs_dpos = 0;
-    slot->cs_cmd = 0;
-    slot->cs_num = ncslots;
-    ++ncslots;
 
-    /* second argument: IPv4 or IPv6 address */
-    i = strcspn(cp, "/");
-    j = (i < sizeof(abuf)) ? i : (sizeof(abuf) - 1);
-    strncpy(abuf, cp, j);
-    abuf[j] = '\0';
-    if (strchr(abuf, ':')) {
-        /* IPv6 */
-        sinp = NULL;
-        sin6p = (struct sockaddr_in6 *)&(slot->cs_adr);
-        sin6p->sin6_family = AF_INET6;
-        if (inet_pton(AF_INET6, abuf, &(sin6p->sin6_addr)) <= 0) {
-            fprintf(stderr, "Error parsing address '%s'\n", abuf);
-            return(-1);
+        /* each slot's weight */
+        nh = (int)floor(sd->sd_a * ncslots + 0.5);
+        if (nh < 1) {
+            nh = 1;
         }
-#ifdef USE_SIN_LEN
-        sin6p->sin_len = sizeof(*sin6p);
-#endif
-        slot->cs_adr_len = sizeof(*sin6p);
-    } else {
-        /* IPv4 */
-        sinp = (struct sockaddr_in *)&(slot->cs_adr);
-        sin6p = NULL;
-        sinp->sin_family = AF_INET;
-        if (inet_pton(AF_INET, abuf, &(sinp->sin_addr)) <= 0) {
-            fprintf(stderr, "Error parsing address '%s'\n", abuf);
-            return(-1);
+        for (i = 0; i < ncslots; ++i) {
+            if (sd->sd_how == 'z') {
+                selw[i] = pow(rank[i] + 1, -sd->sd_a);
+            } else if (sd->sd_how == 'h') {
+                selw[i] = (rank[i] < nh) ? sd->sd_b / nh :
+                    (1 - sd->sd_b) / (ncslots - nh);
+            } else {
+                selw[i] = slot_target_weight(&(cslots[i]));
+            }
         }
-#ifdef USE_SIN_LEN
-        sinp->sin_len = sizeof(*sinp);
-#endif
-        slot->cs_adr_len = sizeof(*sinp);
-    }
-    cp += i;
-    if (*cp == '/') {
-        ++cp;
-    } else {
-        fprintf(stderr, "Too few parts in '%s'\n", line);
-        return(-1);
+        seldist_alias(sd, selw);
     }
 
-    /* third argument: TCP port */
-    i = atoi(cp);
-    if (sinp)   sinp->sin_port = htons(i);
-    if (sin6p)  sin6p->sin6_port = htons(i);
-    cp += strcspn(cp, "/");
+    free(rank);
+}
 
-    /* fourth argument, optional: name */
-    if (*cp == '/') {
-        ++cp;
-        snprintf(slot->cs_name, sizeof(slot->cs_name), "%s", cp);
-    } else {
-        snprintf(slot->cs_name, sizeof(slot->cs_name), "%s/%d", abuf, i);
-    }
+/*
+ * seldist_reweight() -- rebuild the "zweight" alias tables, since slots
+ * have opened or closed and so moved to other targets.
+ */
+void seldist_reweight(void)
+{
+    int i, k;
 
-    /* make however many copies of the slot structure are desired */
-    for (i = 1; i < count; ++i) {
-        slot = &(cslots[ncslots]);
-        memcpy(slot, template, sizeof(*slot));
-        slot->cs_num = ncslots;
-        ++ncslots;
+    for (i = 0; i < ncslots; ++i) {
+        selw[i] = slot_target_weight(&(cslots[i]));
+    }
+    for (k = 0; k < 4; ++k) {
+        if (seldists[k].sd_how == 'w') {
+            seldist_alias(&(seldists[k]), selw);
+        }
     }
+    selw_stale = 0;
+}
 
-    return(0);
+/*
+ * seldist_select() -- select slots for an action with selection
+ * probability r, from a skewed distribution: mark them in selmark[] and
+ * list them in sellist[]. Returns how many.
+ */
+int seldist_select(struct seldist *sd, double r)
+{
+    int want, got, draws, limit, i;
+    double u;
+
+    want = (int)floor(r * ncslots + drand48());
+    limit = 4 * ncslots; /* with much skew, cold slots may never come up */
+    for (got = draws = 0; got < want && draws < limit; ++draws) {
+        u = drand48() * ncslots;
+        i = (int)u;
+        if (i >= ncslots) {
+            i = ncslots - 1;
+        }
+        if (u - i >= sd->sd_prob[i]) {
+            i = sd->sd_alias[i];
+        }
+        if (!selmark[i]) {
+            selmark[i] = 1;
+            sellist[got++] = i;
+        }
+    }
+    if (opt_verbose) {
+        fprintf(stderr, "# skewed selection: %d slots in %d draws\n",
+                got, draws);
+    }
+    return(got);
 }
 
 int parse_config_scale_control(char *line)
@@ -422,6 +1790,11 @@ int parse_config(FILE *fp)
                     return(-1);
                 }
                 break;
+            case 'f': /* connection slots for targets from a file */
+                if (parse_config_target_file(line) < 0) {
+                    return(-1);
+                }
+                break;
             case 'i': /* set interval */
                 interval = atof(line + 1);
                 if (!(interval >= 0 && interval <= 86400)) {
@@ -444,6 +1817,8 @@ int parse_config(FILE *fp)
                     opt_silentdata = 1;
                 } else if (!strcasecmp(line + 1, "verbose")) {
                     opt_verbose = 1;
+                } else if (!strcasecmp(line + 1, "usec")) {
+                    opt_usec = 1;
                 } else {
                     fprintf(stderr, "Unknown option keyword '%s'\n", line + 1);
                     return(-1);
@@ -482,6 +1857,32 @@ int parse_config(FILE *fp)
                 f *= 1e+6;
                 rtimeo.tv_usec = floor(f);
                 break;
+            case 'w': /* spread window */
+                if (parse_config_spread(line) < 0) {
+                    return(-1);
+                }
+                break;
+            case 'z': /* selection distribution */
+                if (parse_config_seldist(line) < 0) {
+                    return(-1);
+                }
+                break;
+            case 'm': /* statistics file */
+                free(stats_file);
+                stats_file = strdup(line + 1);
+                if (!stats_file || !stats_file[0]) {
+                    fprintf(stderr, "Missing statistics file name\n");
+                    return(-1);
+                }
+                break;
+            case 'e': /* end after this many seconds */
+                run_time = atof(line + 1);
+                if (!(run_time >= 0 && run_time <= 31536000)) {
+                    fprintf(stderr, "Run time %f out of range 0-31536000\n",
+                            run_time);
+                    return(-1);
+                }
+                break;
             default:
                 fprintf(stderr, "Unknown configuration class '%c'\n",
                         (int)line[0]);
@@ -529,11 +1930,18 @@ void *cslot_main(void *vp)
     struct cslot *slot = vp;
     int cmd;
     unsigned char cbuf[8], buf2[8];
-    struct timeval tstart, tend;
+    struct timeval tstart, tend, tfirst;
     char msg[512], *opstr, tbuf1[64], tbuf2[64], tbuf3[64];
-    int err, port, len, sent, got, rv;
+    char tbuf4[64], tbuf5[64];
+    int err, port, len, sent, got, rv, hadsok, presend, tfo, gotfirst;
+    int action;
+    struct timeval tmeant;
+    struct rusage ru;
     struct sockaddr_storage addr;
     socklen_t alen;
+#ifdef TCPI_OPT_SYN_DATA
+    struct tcp_info ti;
+#endif
 
     for (;;) {
         /* wait until we have a command */
@@ -542,15 +1950,32 @@ void *cslot_main(void *vp)
             pthread_cond_wait(&(slot->cs_wake), &(slot->cs_lock));
         }
 
+        /* wait until it's time to start it */
+        while (slot->cs_due.tv_sec &&
+               pthread_cond_timedwait(&(slot->cs_wake), &(slot->cs_lock),
+                                      &(slot->cs_due)) != ETIMEDOUT)
+            ;
+
         /* get the command */
         cmd = slot->cs_cmd;
         memcpy(cbuf, slot->cs_cbuf, 8);
+        action = slot->cs_action;
+        tmeant = slot->cs_meant;
         pthread_mutex_unlock(&(slot->cs_lock));
 
         /* perform the command */
+        TRACE3(cmd_start, slot->cs_num, -cmd, slot->cs_sok);
+        hadsok = slot->cs_sok >= 0;
         gettimeofday(&tstart, NULL);
+        sched_count(&tmeant, &tstart);
+        if (any_spread) {
+            skew_count(action, &tstart);
+        }
         snprintf(msg, sizeof(msg), "ok");
         err = 0;
+        presend = -1; /* data already sent with the SYN, if >= 0 */
+        tfo = gotfirst = 0;
+        len = (cbuf[7] % 7) + 1;
         if (cmd == NEGCHAR('o')) {
             /* open connection */
             if (slot->cs_sok >= 0) {
@@ -572,16 +1997,35 @@ void *cslot_main(void *vp)
                     setsockopt(slot->cs_sok, SOL_SOCKET, SO_SNDTIMEO,
                                &rtimeo, sizeof(rtimeo));
                 }
-                if (slot->cs_sok >= 0 &&
-                    connect(slot->cs_sok,
-                            (struct sockaddr *)&(slot->cs_adr),
-                            slot->cs_adr_len) < 0) {
+                rv = 0;
+#ifdef MSG_FASTOPEN
+                if (slot->cs_sok >= 0 && slot->cs_tfo && opt_opendata) {
+                    /* TCP Fast Open: connect and send the data at once,
+                     * in the SYN if the server gave us a cookie before
+                     */
+                    tfo = 1;
+                    presend = sendto(slot->cs_sok, cbuf, len, MSG_FASTOPEN,
+                                     (struct sockaddr *)&(slot->cs_adr),
+                                     slot->cs_adr_len);
+                    rv = (presend < 0) ? -1 : 0;
+                } else
+#endif
+                if (slot->cs_sok >= 0) {
+                    rv = connect(slot->cs_sok,
+                                 (struct sockaddr *)&(slot->cs_adr),
+                                 slot->cs_adr_len);
+                }
+                if (slot->cs_sok >= 0 && rv < 0) {
                     /* some kind of error */
-                    snprintf(msg, sizeof(msg), "connect: %s", strerror(errno));
+                    TRACE3(connect, slot->cs_num, slot->cs_sok, errno);
+                    snprintf(msg, sizeof(msg), "%s: %s",
+                             tfo ? "sendto" : "connect", strerror(errno));
                     err = 1;
+                    close(slot->cs_sok);
                     slot->cs_sok = -1;
-                } else {
+                } else if (slot->cs_sok >= 0) {
                     /* success */
+                    TRACE3(connect, slot->cs_num, slot->cs_sok, 0);
                     memset(&addr, 0, sizeof(addr));
                     alen = sizeof(addr);
                     if (getsockname(slot->cs_sok, (void *)&addr, &alen) < 0) {
@@ -613,8 +2057,11 @@ void *cslot_main(void *vp)
                 snprintf(msg, sizeof(msg), "was not open");
             } else {
                 /* send data and wait for a reply */
-                len = (cbuf[7] % 7) + 1;
-                sent = write(slot->cs_sok, cbuf, len);
+                if (presend >= 0) {
+                    sent = presend;
+                } else {
+                    sent = write(slot->cs_sok, cbuf, len);
+                }
                 if (sent < 0) {
                     /* some kind of error */
                     snprintf(msg, sizeof(msg), "write: %s", strerror(errno));
@@ -639,6 +2086,10 @@ void *cslot_main(void *vp)
                             break;
                         } else {
                             /* got some response */
+                            if (!got) {
+                                gettimeofday(&tfirst, NULL);
+                                gotfirst = 1;
+                            }
                             got += rv;
                         }
                     }
@@ -656,6 +2107,28 @@ void *cslot_main(void *vp)
                         }
                     }
                 }
+                TRACE4(exchange, slot->cs_num, slot->cs_sok,
+                       sent < 0 ? -1 : got, err);
+            }
+        }
+        if (cmd == NEGCHAR('o') && (tfo || gotfirst)) {
+            /* how did the open go, with TCP Fast Open or without? */
+#ifdef TCPI_OPT_SYN_DATA
+            alen = sizeof(ti);
+            if (tfo && slot->cs_sok >= 0 &&
+                getsockopt(slot->cs_sok, IPPROTO_TCP, TCP_INFO,
+                           &ti, &alen) == 0 &&
+                (ti.tcpi_options & TCPI_OPT_SYN_DATA)) {
+                tfo = 2;
+            }
+#endif
+            stats_first_byte(tfo, &tstart, gotfirst ? &tfirst : NULL);
+            if (!err && gotfirst) {
+                len = strlen(msg);
+                snprintf(msg + len, sizeof(msg) - len, "%s, first byte %s",
+                         (tfo == 2) ? ", tfo" :
+                         (tfo ? ", tfo not used" : ""),
+                         timediff(&tstart, &tfirst, tbuf1, sizeof(tbuf1)));
             }
         }
         if (cmd == NEGCHAR('c')) {
@@ -666,10 +2139,12 @@ void *cslot_main(void *vp)
             } else {
                 if (close(slot->cs_sok) < 0) {
                     /* some kind of error */
+                    TRACE3(close, slot->cs_num, slot->cs_sok, errno);
                     snprintf(msg, sizeof(msg), "close: %s", strerror(errno));
                     err = 1;
                 } else {
                     /* success */
+                    TRACE3(close, slot->cs_num, slot->cs_sok, 0);
                     snprintf(msg, sizeof(msg), "closed");
                 }
                 slot->cs_sok = -1;
@@ -690,8 +2165,21 @@ void *cslot_main(void *vp)
          *      8. short string describing result: "ok" or "err"
          *      9. long string describing result
          */
+#ifdef RUSAGE_THREAD
+        getrusage(RUSAGE_THREAD, &ru);
+#endif
         pthread_mutex_lock(&(slot->cs_lock));
+#ifdef RUSAGE_THREAD
+        slot->cs_ru = ru;
+#endif
         gettimeofday(&tend, NULL);
+        TRACE5(cmd_done, slot->cs_num, -cmd, err,
+               (tend.tv_sec - tstart.tv_sec) * 1000000LL +
+               (tend.tv_usec - tstart.tv_usec), slot->cs_sok);
+        if (stats_file) {
+            stats_count(cmd, err, (slot->cs_sok >= 0) - hadsok,
+                        &tstart, &tend);
+        }
         opstr = "?";
         if (cmd == NEGCHAR('o')) { opstr = "open"; }
         if (cmd == NEGCHAR('c')) { opstr = "close"; }
@@ -702,13 +2190,11 @@ void *cslot_main(void *vp)
             slot->cs_cbuf[0] = '\0';
         } else {
             slot->cs_cmd = snprintf((char *)slot->cs_cbuf, sizeof(slot->cs_cbuf),
-                                    "%d,%s,%u.%03u,%u.%03u,%s,%s,%s,%s,%s,\"%s\"",
+                                    "%d,%s,%s,%s,%s,%s,%s,%s,%s,\"%s\"",
                                     slot->cs_num,
                                     timediff(&tstart, &tend, tbuf1, sizeof(tbuf1)),
-                                    (unsigned)tstart.tv_sec,
-                                    (unsigned)(tstart.tv_usec / 1000),
-                                    (unsigned)tend.tv_sec,
-                                    (unsigned)(tend.tv_usec / 1000),
+                                    timenum(&tstart, tbuf4, sizeof(tbuf4)),
+                                    timenum(&tend, tbuf5, sizeof(tbuf5)),
                                     timeshow(&tstart, tbuf2, sizeof(tbuf2)),
                                     timeshow(&tend, tbuf3, sizeof(tbuf3)),
                                     opstr,
@@ -728,14 +2214,133 @@ void *cslot_main(void *vp)
     }
 }
 
+/*
+ * report_responses() -- print whatever responses the slot threads have
+ * for us. Returns the number of slots that are still busy with a command.
+ */
+int report_responses(void)
+{
+    int i, busy = 0;
+    struct cslot *slot;
+
+    /*
+     * Going through the list of slots to find out which one
+     * has a response now is an inefficient way to do it.
+     * But anything better seems rather more complicated,
+     * so I'm going to try it this way.
+     */
+    for (i = 0; i < ncslots; ++i) {
+        slot = &(cslots[i]);
+        pthread_mutex_lock(&(slot->cs_lock));
+        if (slot->cs_cmd > 0) {
+            printf("%.*s\n", (int)slot->cs_cmd, slot->cs_cbuf);
+            slot->cs_cmd = 0;
+        } else if (slot->cs_cmd < 0) {
+            ++busy;
+        }
+        pthread_mutex_unlock(&(slot->cs_lock));
+    }
+    fflush(stdout);
+    return(busy);
+}
+
+/*
+ * finish() -- at the end of the run time, wait (up to the send/receive
+ * timeout) for the commands in progress, report them, and exit.
+ */
+void finish(void)
+{
+    struct timeval tnow;
+    struct timespec tlimit;
+
+    gettimeofday(&tnow, NULL);
+    tlimit.tv_sec = tnow.tv_sec + rtimeo.tv_sec;
+    tlimit.tv_nsec = (tnow.tv_usec + rtimeo.tv_usec) * 1000LL;
+    if (tlimit.tv_nsec >= 1000000000) {
+        tlimit.tv_nsec -= 1000000000;
+        tlimit.tv_sec++;
+    }
+    if (opt_verbose) {
+        fprintf(stderr, "# run time is up, finishing\n");
+    }
+    pthread_mutex_lock(&main_wake_mutex);
+    while (report_responses() > 0) {
+        if (pthread_cond_timedwait(&main_wake, &main_wake_mutex,
+                                   &tlimit) == ETIMEDOUT) {
+            report_responses();
+            break;
+        }
+    }
+    pthread_mutex_unlock(&main_wake_mutex);
+    self_check();
+    if (stats_file) {
+        stats_write();
+    }
+    {
+        /* summary of how well tcphammer itself kept up */
+        pthread_mutex_lock(&stats_lock);
+        printf("# scheduling delay (meant to actual command start): %lld"
+               " commands, mean %.0f usec, max %lld usec\n",
+               stats.sched_num,
+               stats.sched_num ? ((double)stats.sched_us / stats.sched_num) : 0,
+               stats.sched_max);
+        printf("# cpu: main thread %.3f sec, slot threads %.3f sec"
+               " (busiest %.3f); context switches %lld voluntary,"
+               " %lld involuntary\n",
+               stats.cpu_main_us / 1e+6, stats.cpu_slots_us / 1e+6,
+               stats.cpu_slot_max_us / 1e+6, stats.nvcsw, stats.nivcsw);
+        printf("# backlog: most %d commands outstanding; saturated %lld of"
+               " %lld intervals\n",
+               stats.backlog_max, stats.sat_intervals, stats.intervals);
+        pthread_mutex_unlock(&stats_lock);
+        fflush(stdout);
+    }
+    if (any_spread) {
+        /* summary of how spread out the actions' commands were */
+        pthread_mutex_lock(&stats_lock);
+        printf("# dispatch skew (first to last command start): %lld actions,"
+               " mean %.0f usec, max %lld usec\n",
+               stats.skew_num,
+               stats.skew_num ? ((double)stats.skew_us / stats.skew_num) : 0,
+               stats.skew_max);
+        pthread_mutex_unlock(&stats_lock);
+        fflush(stdout);
+    }
+    if (any_tfo) {
+        /* summary of TCP Fast Open and how much it helped */
+        pthread_mutex_lock(&stats_lock);
+        printf("# TCP Fast Open used on %lld of %lld opens (%.1f%%)\n",
+               stats.tfo_used, stats.tfo_opens,
+               stats.tfo_opens ?
+               (stats.tfo_used * 100.0 / stats.tfo_opens) : 0.0);
+        printf("# open to first byte: tfo %lld opens, mean %.0f usec;"
+               " plain %lld opens, mean %.0f usec\n",
+               stats.fb_num[1],
+               stats.fb_num[1] ? ((double)stats.fb_us[1] / stats.fb_num[1]) : 0,
+               stats.fb_num[0],
+               stats.fb_num[0] ? ((double)stats.fb_us[0] / stats.fb_num[0]) : 0);
+        pthread_mutex_unlock(&stats_lock);
+        fflush(stdout);
+    }
+    exit(0);
+}
+
 int main(int argc, char **argv)
 {
     int i, j, e, action, slotaction;
     struct cslot *slot;
     struct timeval tnow;
-    struct timespec tnext;
+    struct timespec tnext, tend, twait;
     float use_interval, r, *rs;
-    int nopen = 0;
+    int nopen = 0, ending = 0, waitstats, ncmds, k, naction = 0;
+    int *todo_slot;             /* slots to give commands to, this action */
+    char *todo_act;             /* and what command */
+    struct spread *sp;
+    struct seldist *sd;
+    struct target *t;
+    int nsel, backlog;
+    struct timespec due;
+    double offset;
 
     signal(SIGPIPE, SIG_IGN);
 
@@ -749,7 +2354,14 @@ int main(int argc, char **argv)
     if (parse_config(stdin) < 0) {
         exit(1);
     }
+    seldist_setup();
     rs = calloc(scale_nrand, sizeof(rs[0]));
+    todo_slot = calloc(ncslots, sizeof(todo_slot[0]));
+    todo_act = calloc(ncslots, sizeof(todo_act[0]));
+    if (!rs || !todo_slot || !todo_act) {
+        fprintf(stderr, "Memory allocation problem.\n");
+        exit(1);
+    }
 
     /* start threads */
     if (pthread_mutex_init(&main_wake_mutex, NULL) ||
@@ -771,6 +2383,21 @@ int main(int argc, char **argv)
         fprintf(stderr, "# threads have been started\n");
     }
 
+    self_check();
+    if (stats_file) {
+        stats_write();
+    }
+
+    /* when to stop, if ever */
+    gettimeofday(&tnow, NULL);
+    tend.tv_sec = tnow.tv_sec + (time_t)floor(run_time);
+    tend.tv_nsec = tnow.tv_usec * 1000LL +
+        (long)floor((run_time - floor(run_time)) * 1e+9);
+    if (tend.tv_nsec >= 1000000000) {
+        tend.tv_nsec -= 1000000000;
+        tend.tv_sec++;
+    }
+
     /* main loop */
     for (;;) {
         /* figure out when we'll next do an action */
@@ -788,6 +2415,13 @@ int main(int argc, char **argv)
             tnext.tv_nsec -= 1000000000;
             tnext.tv_sec++;
         }
+        if (run_time > 0 &&
+            (tnext.tv_sec > tend.tv_sec ||
+             (tnext.tv_sec == tend.tv_sec && tnext.tv_nsec >= tend.tv_nsec))) {
+            /* the run will be over before the next action */
+            tnext = tend;
+            ending = 1;
+        }
         if (opt_verbose) {
             fprintf(stderr,
                     "# top of main loop; now = %lu.%06u, next = %lu.%09u\n",
@@ -800,37 +2434,41 @@ int main(int argc, char **argv)
             if (opt_verbose) {
                 fprintf(stderr, "# waiting...\n");
             }
+            /* wake up in time for self_check() & statistics too */
+            twait = tnext;
+            waitstats = 0;
+            if (stats_next.tv_sec < tnext.tv_sec ||
+                (stats_next.tv_sec == tnext.tv_sec &&
+                 stats_next.tv_nsec < tnext.tv_nsec)) {
+                twait = stats_next;
+                waitstats = 1;
+            }
             pthread_mutex_lock(&main_wake_mutex);
-            e = pthread_cond_timedwait(&main_wake, &main_wake_mutex, &tnext);
-            if (e == ETIMEDOUT) {
+            e = pthread_cond_timedwait(&main_wake, &main_wake_mutex, &twait);
+            if (e == ETIMEDOUT && waitstats) {
+                /* It's time to write statistics */
+                pthread_mutex_unlock(&main_wake_mutex);
+                self_check();
+                if (stats_file) {
+                    stats_write();
+                }
+            } else if (e == ETIMEDOUT) {
                 /* It's time to do an action */
                 pthread_mutex_unlock(&main_wake_mutex);
                 if (opt_verbose) {
                     fprintf(stderr, "# it's time!\n");
                 }
+                if (ending) {
+                    finish();
+                }
                 break;
             } else {
                 /* got a response, handle it */
                 if (opt_verbose) {
                     fprintf(stderr, "# got response(s)!\n");
                 }
-                /*
-                 * Going through the list of slots to find out which one
-                 * has a response now is an inefficient way to do it.
-                 * But anything better seems rather more complicated,
-                 * so I'm going to try it this way.
-                 */
                 pthread_mutex_unlock(&main_wake_mutex);
-                for (i = 0; i < ncslots; ++i) {
-                    slot = &(cslots[i]);
-                    pthread_mutex_lock(&(slot->cs_lock));
-                    if (slot->cs_cmd > 0) {
-                        printf("%.*s\n", (int)slot->cs_cmd, slot->cs_cbuf);
-                        slot->cs_cmd = 0;
-                    }
-                    pthread_mutex_unlock(&(slot->cs_lock));
-                }
-                fflush(stdout);
+                report_responses();
             }
         }
 
@@ -870,6 +2508,12 @@ int main(int argc, char **argv)
             fprintf(stderr, "# action %c selection probability %f\n",
                     action, r);
         }
+        sd = &(seldists[strchr("doct", action) - "doct"]);
+        if (sd->sd_how == 'w' && selw_stale) {
+            seldist_reweight();
+        }
+        nsel = sd->sd_how ? seldist_select(sd, r) : 0;
+        ncmds = backlog = 0;
         for (i = 0; i < ncslots; ++i) {
             slot = &(cslots[i]);
             slotaction = action;
@@ -879,7 +2523,16 @@ int main(int argc, char **argv)
                 pthread_mutex_unlock(&(slot->cs_lock));
                 continue;
             }
-            if (drand48() < r) {
+            if (slot->cs_cmd < 0) {
+                /* it hasn't started or finished the last command (which
+                 * may be waiting for its time in a "w" window); leave it
+                 * be, or that command would be lost */
+                ++backlog;
+                pthread_mutex_unlock(&(slot->cs_lock));
+                continue;
+            }
+            pthread_mutex_unlock(&(slot->cs_lock));
+            if (sd->sd_how ? selmark[i] : drand48() < r) {
                 /* selected: action on data, open; inaction on close */
                 if (action == 'd' && slot->cs_is_open) {
                     /* ok */
@@ -908,18 +2561,97 @@ int main(int argc, char **argv)
                 }
             }
             if (slotaction != '\0') {
-                /* yeah, we're doing something, and here it is */
-                if (opt_verbose) {
-                    fprintf(stderr, "# command to slot %d: %c\n",
-                            i, slotaction);
+                /* yeah, we're doing something; it's given out below */
+                todo_slot[ncmds] = i;
+                todo_act[ncmds] = slotaction;
+                ++ncmds;
+            }
+        }
+
+        for (k = 0; k < nsel; ++k) {
+            selmark[sellist[k]] = 0;
+        }
+        pthread_mutex_lock(&stats_lock);
+        stats.backlog = backlog;
+        if (backlog > stats.backlog_max) { stats.backlog_max = backlog; }
+        pthread_mutex_unlock(&stats_lock);
+
+        /* when each command is to start: see spreads[] */
+        sp = &(spreads[strchr("doct", action) - "doct"]);
+        ++naction;
+        if (any_spread) {
+            pthread_mutex_lock(&stats_lock);
+            skew_recs[naction % SKEW_RECS].action = naction;
+            skew_recs[naction % SKEW_RECS].left = (ncmds > 1) ? ncmds : 0;
+            skew_recs[naction % SKEW_RECS].first.tv_sec = 0x7fffffff;
+            timerclear(&(skew_recs[naction % SKEW_RECS].last));
+            pthread_mutex_unlock(&stats_lock);
+        }
+        gettimeofday(&tnow, NULL);
+        offset = 0;
+        for (k = 0; k < ncmds; ++k) {
+            i = todo_slot[k];
+            slot = &(cslots[i]);
+            slotaction = todo_act[k];
+            if (sp->sp_window > 0) {
+                if (sp->sp_how == 'u') {
+                    offset = sp->sp_window * drand48();
+                } else if (sp->sp_how == 'p') {
+                    offset -= log(1.0 - drand48()) * sp->sp_window / ncmds;
+                } else {
+                    offset = sp->sp_window;
                 }
-                slot->cs_cmd = -slotaction;
-                for (j = 0; j < 8; ++j) {
-                    slot->cs_cbuf[j] = lrand48() & 255;
+                due.tv_sec = tnow.tv_sec + (time_t)floor(offset);
+                due.tv_nsec = tnow.tv_usec * 1000LL +
+                    (long)floor((offset - floor(offset)) * 1e+9);
+                if (due.tv_nsec >= 1000000000) {
+                    due.tv_nsec -= 1000000000;
+                    due.tv_sec++;
+                }
+            } else {
+                /* right away */
+                due.tv_sec = due.tv_nsec = 0;
+            }
+            if (opt_verbose) {
+                fprintf(stderr, "# command to slot %d: %c in %f sec\n",
+                        i, slotaction, offset);
+            }
+            pthread_mutex_lock(&(slot->cs_lock));
+            if (slot->cs_cmd > 0) {
+                /* it finished the last thing just now; report it */
+                printf("%.*s\n", (int)slot->cs_cmd, slot->cs_cbuf);
+            }
+            if (slot->cs_tl && slotaction == 'o') {
+                /* from a target file: on to the next target. Done here,
+                 * not in the slot's thread, so "zweight" can follow it */
+                t = &(slot->cs_tl->tl_targets[
+                          slot->cs_tl->tl_spread[slot->cs_tpos]]);
+                if (++slot->cs_tpos >= slot->cs_tl->tl_nspread) {
+                    slot->cs_tpos = 0;
                 }
-                pthread_cond_signal(&(slot->cs_wake));
+                target_to_slot(t, slot);
+            }
+            if (slot->cs_tl && (slotaction == 'o' || slotaction == 'c')) {
+                selw_stale = 1;
+            }
+            slot->cs_cmd = -slotaction;
+            slot->cs_due = due;
+            if (due.tv_sec) {
+                slot->cs_meant.tv_sec = due.tv_sec;
+                slot->cs_meant.tv_usec = due.tv_nsec / 1000;
+            } else {
+                /* meant to start when the action was */
+                slot->cs_meant.tv_sec = tnext.tv_sec;
+                slot->cs_meant.tv_usec = tnext.tv_nsec / 1000;
+            }
+            slot->cs_action = naction;
+            TRACE2(dispatch, i, slotaction);
+            for (j = 0; j < 8; ++j) {
+                slot->cs_cbuf[j] = lrand48() & 255;
             }
+            pthread_cond_signal(&(slot->cs_wake));
             pthread_mutex_unlock(&(slot->cs_lock));
         }
+        TRACE3(action, action, (int)(r * 1000), ncmds);
     }
 }
@@ -26,6 +26,22 @@
  *
  * timedumper - This program dumps some stuff to standard output.
  * End it with control-C.
+ *
+ * Options:
+ *    -c - color output
+ *    -q - only run about 25% of the time
+ *    -b - batched output: buffer it, instead of writing each line as
+ *         soon as it's made
+ *    -l len - add random text at the end of each line, to make it this
+ *         long; "len" can be a number, "min-max" for a uniform
+ *         distribution, or "mean/sd" for a normal distribution
+ *    -e bits - entropy of that text, in bits per character, from 0 to
+ *         6.6; it uses the first 2^bits, rounded to a whole number, of
+ *         "etaoin..." (letters, then digits, then the rest; all 95
+ *         printable characters from about 6.57 up), so the entropy is
+ *         only exact at whole numbers of bits
+ *    -s file - instead, take that text from random places in this file
+ * With -e or -s but no -l, lines are 128 bytes.
  */
 
 #include <stdio.h>
@@ -41,10 +57,206 @@
  */
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <math.h>
 #include <unistd.h>
 #include <time.h>
 #include <sys/time.h>
 
+/* The random text ("payload") comes from blocks of pseudorandom bytes,
+ * made PRNG_LANES at a time by that many independent xorshift128+
+ * generators.  Each lane only uses shifts, xors and adds on its own
+ * state, so the compiler can turn the loop into vector instructions,
+ * and a block is filled much faster than one call per byte.  The bytes
+ * are mapped to characters by table lookup.
+ */
+#define PRNG_LANES 8
+#define BLOCK_SIZE 65536
+
+static unsigned long long prng_a[PRNG_LANES], prng_b[PRNG_LANES];
+
+static void prng_seed(unsigned long long seed)
+{
+  int i, j;
+
+  for (i = 0; i < PRNG_LANES; ++i) {
+    /* splitmix64, so the lanes start out unrelated */
+    for (j = 0; j < 2; ++j) {
+      unsigned long long z = (seed += 0x9e3779b97f4a7c15ull);
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+      z ^= z >> 31;
+      if (j) prng_b[i] = z | 1; else prng_a[i] = z;
+    }
+  }
+}
+
+/* prng_fill(): fill 'buf' with 'len' pseudorandom bytes; 'len' is a
+ * multiple of 8 * PRNG_LANES
+ */
+static void prng_fill(unsigned char *buf, int len)
+{
+  unsigned long long out[PRNG_LANES], s0, s1;
+  int i, j;
+
+  for (i = 0; i < len; i += 8 * PRNG_LANES) {
+    for (j = 0; j < PRNG_LANES; ++j) {
+      s1 = prng_a[j];
+      s0 = prng_b[j];
+      prng_a[j] = s0;
+      s1 ^= s1 << 23;
+      prng_b[j] = s1 ^ s0 ^ (s1 >> 17) ^ (s0 >> 26);
+      out[j] = prng_b[j] + s0;
+    }
+    memcpy(buf + i, out, sizeof(out));
+  }
+}
+
+/* characters for the payload, most common (in English) first */
+static const char payload_chars[] =
+  "etaoinshrdlcumwfgypbvkjxqz"
+  "0123456789"
+  "ETAOINSHRDLCUMWFGYPBVKJXQZ"
+  " .,-_:;'\"!?()[]{}<>/\\|@#$%^&*+=~`";
+
+static struct {
+  int on; /* add a payload at all? */
+  char how; /* length distribution: 'f' fixed, 'u' uniform, 'n' normal */
+  double len1, len2; /* its parameters */
+  char map[256]; /* random byte to character */
+  char *corpus; /* text to sample from instead (-s), or NULL */
+  long corpus_len;
+  unsigned char block[BLOCK_SIZE]; /* random bytes */
+  int pos; /* how much of block[] has been used */
+} pl;
+
+/* payload_bytes(): get 'n' random bytes, refilling the block as needed */
+static unsigned char *payload_bytes(int n)
+{
+  if (pl.pos + n > BLOCK_SIZE) {
+    prng_fill(pl.block, BLOCK_SIZE);
+    pl.pos = 0;
+  }
+  pl.pos += n;
+  return(pl.block + pl.pos - n);
+}
+
+/* payload_len(): pick how long a line should be */
+static int payload_len(void)
+{
+  unsigned char *r = payload_bytes(8);
+  double u1, u2, l;
+
+  u1 = ((r[0] | (r[1] << 8) | (r[2] << 16)) + 0.5) / 16777216.0;
+  u2 = ((r[3] | (r[4] << 8) | (r[5] << 16)) + 0.5) / 16777216.0;
+  switch (pl.how) {
+  case 'u':
+    l = pl.len1 + floor(u1 * (pl.len2 - pl.len1 + 1));
+    break;
+  case 'n':
+    l = pl.len1 + pl.len2 * sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+    break;
+  default:
+    l = pl.len1;
+  }
+  return((l < 0) ? 0 : (l > 1000000) ? 1000000 : (int)l);
+}
+
+/* payload_put(): write 'n' characters of payload */
+static void payload_put(int n)
+{
+  static char out[4096];
+  unsigned char *r;
+  long off;
+  int i, k;
+
+  while (n > 0) {
+    k = (n > sizeof(out)) ? sizeof(out) : n;
+    if (pl.corpus) {
+      /* a random piece of the corpus, wrapping around */
+      r = payload_bytes(8);
+      off = (r[0] | (r[1] << 8) | (r[2] << 16) |
+	     ((unsigned long)r[3] << 24)) % pl.corpus_len;
+      for (i = 0; i < k; ++i) {
+	out[i] = pl.corpus[off];
+	if (++off >= pl.corpus_len) off = 0;
+      }
+    } else {
+      r = payload_bytes((k + 63) & ~63);
+      for (i = 0; i < k; ++i) {
+	out[i] = pl.map[r[i]];
+      }
+    }
+    fwrite(out, 1, k, stdout);
+    n -= k;
+  }
+}
+
+/* payload_setup(): parse the -l and -e options, load -s; 0 on success */
+static int payload_setup(char *lopt, char *eopt, char *sopt)
+{
+  int i, k;
+  double bits;
+  FILE *fp;
+  char *e;
+
+  pl.how = 'f';
+  pl.len1 = 128;
+  if (lopt) {
+    pl.len1 = strtod(lopt, &e);
+    if (*e == '-' || *e == '/') {
+      pl.how = (*e == '-') ? 'u' : 'n';
+      pl.len2 = strtod(e + 1, &e);
+    }
+    if (*e || pl.len1 < 0 || pl.len2 < 0 ||
+	(pl.how == 'u' && pl.len2 < pl.len1)) {
+      fprintf(stderr, "timedumper: bad length '%s'\n", lopt);
+      return(-1);
+    }
+  }
+
+  bits = log(95) / log(2);
+  if (eopt) {
+    bits = strtod(eopt, &e);
+    if (*e || !(bits >= 0) || bits > 6.6) {
+      fprintf(stderr, "timedumper: entropy must be 0 to 6.6 bits\n");
+      return(-1);
+    }
+  }
+  k = (int)floor(pow(2, bits) + 0.5);
+  if (k > 95) k = 95;
+  if (k < 1) k = 1;
+  for (i = 0; i < 256; ++i) {
+    pl.map[i] = payload_chars[(i * k) >> 8];
+  }
+
+  if (sopt) {
+    if (!(fp = fopen(sopt, "r"))) {
+      perror(sopt);
+      return(-1);
+    }
+    fseek(fp, 0, SEEK_END);
+    pl.corpus_len = ftell(fp);
+    rewind(fp);
+    if (pl.corpus_len <= 0 || !(pl.corpus = malloc(pl.corpus_len)) ||
+	fread(pl.corpus, 1, pl.corpus_len, fp) != pl.corpus_len) {
+      fprintf(stderr, "timedumper: couldn't read %s\n", sopt);
+      return(-1);
+    }
+    fclose(fp);
+    for (i = 0; i < pl.corpus_len; ++i) {
+      if (!isprint((unsigned char)pl.corpus[i])) {
+	pl.corpus[i] = ' ';
+      }
+    }
+  }
+
+  prng_seed((unsigned long long)time(NULL) * 1000003 + getpid());
+  pl.pos = BLOCK_SIZE;
+  pl.on = 1;
+  return(0);
+}
+
 int main(int argc, char *argv[])
 {
   unsigned long long ctr = 0;
@@ -52,7 +264,8 @@ int main(int argc, char *argv[])
   char ctb[32];
   unsigned lfsr = 1;
   unsigned long long lfsr64 = 1;
-  int copt = 0, qopt = 0;
+  int copt = 0, qopt = 0, bopt = 0, n;
+  char *lopt = NULL, *eopt = NULL, *sopt = NULL;
 
   if (argc > 0) {
     --argc;
@@ -61,6 +274,10 @@ int main(int argc, char *argv[])
   while (argc > 0) {
     if (!strcmp(argv[0], "-c")) copt = 1;
     else if (!strcmp(argv[0], "-q")) qopt = 1;
+    else if (!strcmp(argv[0], "-b")) bopt = 1;
+    else if (!strcmp(argv[0], "-l") && argc > 1) { lopt = *++argv; --argc; }
+    else if (!strcmp(argv[0], "-e") && argc > 1) { eopt = *++argv; --argc; }
+    else if (!strcmp(argv[0], "-s") && argc > 1) { sopt = *++argv; --argc; }
     else break;
     --argc;
     ++argv;
@@ -68,6 +285,12 @@ int main(int argc, char *argv[])
   if (argc > 1 && !strcmp(argv[1], "-c")) {
     copt = 1;
   }
+  if ((lopt || eopt || sopt) && payload_setup(lopt, eopt, sopt) < 0) {
+    exit(1);
+  }
+  if (bopt) {
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+  }
 
   for (;;) {
     memset(&tv, 0, sizeof tv);
@@ -86,13 +309,24 @@ int main(int argc, char *argv[])
       printf("\033[3%cm\033[4%cm",
 	     (int)('0' + (lfsr & 7)), (int)('0' + ((lfsr >> 3) & 7)));
     }
-    printf("%15llu   %s.%06u   %06x   %016llx\n",
-	   (unsigned long long)ctr, ctb,
-	   (unsigned)tv.tv_usec, (unsigned)lfsr, (unsigned long long)lfsr64);
+    n = printf("%15llu   %s.%06u   %06x   %016llx",
+	       (unsigned long long)ctr, ctb,
+	       (unsigned)tv.tv_usec, (unsigned)lfsr, (unsigned long long)lfsr64);
+    if (pl.on) {
+      /* random text to make it the chosen length, newline included */
+      n = payload_len() - n - 1;
+      if (n > 3) {
+	fputs("   ", stdout);
+	payload_put(n - 3);
+      }
+    }
+    putchar('\n');
     if (copt) {
       printf("\033[m");
     }
-    fflush(stdout);
+    if (!bopt) {
+      fflush(stdout);
+    }
 
     ++ctr;
     lfsr <<= 1; if (lfsr & 0x1000000) lfsr ^= 0x1864CFB;
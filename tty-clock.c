@@ -51,11 +51,10 @@
 #include <locale.h>
 #include <curses.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/time.h>
 #include <sys/select.h>
-#ifdef RAW
 #include <signal.h>
-#endif
 
 static char *progname = "tty-clock";
 
@@ -82,6 +81,12 @@ static void usage(void)
             "    -b -- suppress display of banner-sized time\n"
             "    -c -- suppress display of 3-month calendar\n"
             "    -d -- suppress display of plain date+time line\n"
+            "    -S file -- keep counts of wakeups, redraws, output etc;\n"
+            "               write them to file on SIGUSR1 and at exit\n"
+            "    -T [type:]device -- display on this terminal device\n"
+            "               instead; may be repeated, for several terminals\n"
+            "               driven from this one process.  'type' defaults\n"
+            "               to $TERM.\n"
             , progname);
     exit(1);
 }
@@ -117,6 +122,204 @@ static char *dbg_timestamp(char *buf, size_t bufsz, struct timeval *tv)
     return(buf);
 }
 
+/* statistics (-S): counters of what the program does, to confirm it
+ * really sleeps between changes.  Written out on SIGUSR1 and at exit.
+ * When -S isn't given, 'stats' is NULL and none of the timing is done.
+ */
+
+static char *stats = NULL; /* file to write them to */
+
+static struct {
+    unsigned long wake_key;     /* wakeups: keyboard input */
+    unsigned long wake_timeout; /* wakeups: delay ran out, time to redraw */
+    unsigned long wake_early;   /* wakeups: before it was time (signal etc) */
+    unsigned long draw_all;     /* redraws of the whole display */
+    unsigned long refreshes;    /* calls to refresh() */
+    long long out_bytes;        /* bytes written to the terminal; -1 if
+                                 * that can't be found out here */
+    unsigned long lt_calls;     /* calls to localtime_r() */
+    double lt_sec;              /* time spent in them */
+    unsigned long cnc_calls;    /* calls to calculate_next_change() */
+    double cnc_sec;             /* time spent in them */
+    double late_max;            /* latest redraw, after its boundary, sec */
+} counts;
+
+static volatile sig_atomic_t stats_due = 0; /* SIGUSR1 received */
+static volatile sig_atomic_t quit_due = 0;  /* SIGINT etc received */
+
+static void stats_signal(int sig)
+{
+    if (sig == SIGUSR1) {
+        stats_due = 1;
+    } else {
+        quit_due = 1;
+    }
+}
+
+/* monotonic clock, in seconds, for timing things */
+static double stats_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+/* Bytes the program has written so far, to count what curses sends to the
+ * terminal, by looking before & after it does so.  Only Linux keeps such
+ * a count (in /proc); elsewhere out_bytes ends up -1.
+ */
+static long long stats_written(void)
+{
+    long long wchar = -1;
+#ifdef __linux__
+    char line[128];
+    FILE *fp;
+
+    if ((fp = fopen("/proc/self/io", "r")) != NULL) {
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            if (sscanf(line, "wchar: %lld", &wchar) == 1) {
+                break;
+            }
+        }
+        fclose(fp);
+    }
+#endif /* __linux__ */
+    return(wchar);
+}
+
+/* Do curses output (refresh() or endwin()), counting it if -S.  Returns
+ * how many bytes it wrote; -1 if that can't be found out (or without -S).
+ */
+static long long stats_output(int (*fn)(void))
+{
+    long long w0, w1;
+
+    if (stats == NULL) {
+        fn();
+        return(-1);
+    }
+    w0 = stats_written();
+    fn();
+    w1 = stats_written();
+    if (w0 < 0 || w1 < 0) {
+        counts.out_bytes = -1;
+        return(-1);
+    } else if (counts.out_bytes >= 0) {
+        counts.out_bytes += w1 - w0;
+    }
+    return(w1 - w0);
+}
+
+/* localtime_r(), timed if -S */
+static struct tm *stats_localtime(const time_t *t, struct tm *tm)
+{
+    struct tm *rv;
+    double t0;
+
+    if (stats == NULL) {
+        return(localtime_r(t, tm));
+    }
+    t0 = stats_clock();
+    rv = localtime_r(t, tm);
+    counts.lt_sec += stats_clock() - t0;
+    ++counts.lt_calls;
+    return(rv);
+}
+
+/* terminals to display on: those given with -T, each a separate curses
+ * screen; or without -T, just the one we were run on.  The widgets, the
+ * calculation of when they change, and the calendar's layout are shared
+ * among them; each screen just gets its own redraw & refresh, so curses
+ * sends each terminal only what changed on it.
+ */
+
+#define MAX_SCREENS 16
+
+struct screen {
+    char *dev;          /* device name; NULL for the one we were run on */
+    char *type;         /* terminal type; NULL for $TERM */
+    SCREEN *sp;         /* curses screen; NULL for initscr()'s */
+    WINDOW *ww;         /* its standard screen window */
+    int fd;             /* where its input comes from */
+    int draw_all;       /* forces (re)drawing of its whole display */
+    long long out_bytes; /* output to it (for -S); -1 if unknown */
+};
+
+static struct screen screens[MAX_SCREENS];
+static int num_screens = 0;
+
+/* Make screen 's' the one curses works on */
+static void screen_select(struct screen *s)
+{
+    if (s->sp != NULL) {
+        set_term(s->sp);
+    }
+}
+
+/* End curses on the first 'n' screens */
+static void screens_end(int n)
+{
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        screen_select(&(screens[i]));
+        stats_output(&endwin);
+    }
+}
+
+/* Start curses on all the screens */
+static void screens_open(void)
+{
+    struct screen *s;
+    FILE *fp;
+    int i, fd;
+
+    if (num_screens == 0) {
+        /* just the terminal we were run on */
+        s = &(screens[num_screens++]);
+        s->ww = initscr();
+        s->fd = STDIN_FILENO;
+    } else {
+        for (i = 0; i < num_screens; ++i) {
+            s = &(screens[i]);
+            fd = open(s->dev, O_RDWR | O_NOCTTY);
+            if (fd < 0 || (fp = fdopen(fd, "r+")) == NULL) {
+                screens_end(i);
+                fprintf(stderr, "%s: %s: %s\n",
+                        progname, s->dev, strerror(errno));
+                exit(1);
+            }
+            s->sp = newterm(s->type, fp, fp);
+            if (s->sp == NULL) {
+                screens_end(i);
+                fprintf(stderr, "%s: %s: can't use terminal type '%s'\n",
+                        progname, s->dev,
+                        s->type ? s->type :
+                        (getenv("TERM") ? getenv("TERM") : ""));
+                exit(1);
+            }
+            s->ww = stdscr;
+            s->fd = fd;
+        }
+    }
+    for (i = 0; i < num_screens; ++i) {
+        s = &(screens[i]);
+        screen_select(s);
+#ifdef RAW
+        raw();
+#else
+        cbreak();
+#endif
+        noecho();
+        nonl();
+        intrflush(s->ww, FALSE);
+        nodelay(s->ww, TRUE);
+        keypad(s->ww, TRUE);
+        s->draw_all = 1;
+    }
+}
+
 /* "fake" time calculation */
 
 struct fake_time_control {
@@ -160,7 +363,7 @@ static void fake_time_calc(struct timeval *t, struct fake_time_control *ftc)
 /* generic-ish "widget" structure */
 struct widget {
     void *data; /* type specific data */
-    WINDOW *ww; /* where displayed */
+    WINDOW *ww; /* where displayed (just now; see 'struct screen') */
     int rowmn, rowmx; /* row number range */
     char *name; /* label for debugging */
     /* There could be a column number range, but not needed until/unless
@@ -172,6 +375,7 @@ struct widget {
     int (*change_by)(struct widget *w, time_t t, struct tm *tm);
     void (*redraw)(struct widget *w, time_t t, struct tm *tm, int faked_time);
     time_t last_drawn; /* time it was last drawn */
+    unsigned long redraws; /* how many times it's been drawn (for -S) */
     struct tm last_drawn_d; /* details of last_drawn */
     int opt_nosec, opt_12h; /* some option flags multiple widgets use */
 };
@@ -294,7 +498,7 @@ static struct banner_widget_font banner_widget_font_1 = {
 struct banner_widget {
     /* 'data' field of 'struct widget' for a banner widget */
     struct banner_widget_font *fnt; /* font to use */
-    chtype mark, space;
+    int halftone; /* mark "pixels" with ACS_CKBOARD instead of reverse */
 };
 
 static int banner_widget_change_by(struct widget *w, time_t t, struct tm *tm)
@@ -312,6 +516,13 @@ static void banner_widget_redraw(struct widget *w, time_t t, struct tm *tm,
     struct banner_widget_font *fnt = bw->fnt;
     int y, x, c, h;
     int str[8], len;
+    chtype mark;
+
+    /* ACS_BLOCK didn't show up well on mine, using ' ' | A_REVERSE instead.
+     * ACS_CKBOARD is looked up here, not once, since it can be different
+     * on each terminal.
+     */
+    mark = bw->halftone ? ACS_CKBOARD : (' ' | A_REVERSE);
 
     /* represent the time in hh:mm:ss or hh:mm format using our own
      * character codes
@@ -340,7 +551,7 @@ static void banner_widget_redraw(struct widget *w, time_t t, struct tm *tm,
             for (x = fnt->widths[str[c]] - 1; x >= 0; --x) {
                 waddch(w->ww,
                        ((fnt->bitmap[str[c] * fnt->height + y] >> x) & 1) ?
-                       bw->mark : bw->space);
+                       mark : ' ');
             }
         }
     }
@@ -361,9 +572,7 @@ static void banner_widget_init(struct widget *w, WINDOW *ww,
     bw->fnt = fnt;
     w->opt_nosec = nosec;
     w->opt_12h = opt_12h;
-    bw->mark = opt_halftone ? ACS_CKBOARD : (' ' | A_REVERSE);
-    /* ACS_BLOCK didn't show up well on mine, using ' ' | A_REVERSE instead */
-    bw->space = ' ';
+    bw->halftone = opt_halftone;
 }
 
 /* "cal" widget: 3 month calendar */
@@ -379,31 +588,39 @@ static int cal_widget_change_by(struct widget *w, time_t t, struct tm *tm)
     return((tm->tm_year != tm0->tm_year) || (tm->tm_yday != tm0->tm_yday));
 }
 
-static void cal_widget_redraw(struct widget *w, time_t t, struct tm *tm,
-                              int faked_time)
+struct cal_widget {
+    /* 'data' field of 'struct widget' for a "cal" widget: what to draw,
+     * worked out once for the day shown and drawn from on every screen */
+    int valid;          /* has it been worked out? */
+    int year, yday;     /* for what day */
+    struct {
+        char monyear[32];   /* month & year header */
+        int x;              /* where it goes */
+    } hdr[3];
+    struct {
+        int y, x;           /* where */
+        chtype show[2];     /* the two characters of the day */
+    } days[3 * 31];
+    int ndays;          /* entries in days[] */
+};
+
+/* work out the calendar's contents for the day in 'tm' */
+static void cal_widget_layout(struct widget *w, struct tm *tm)
 {
-    int rm;             /* relative month 0-2 being drawn */
-    int mo;             /* actual month 0-11 being drawn */
+    struct cal_widget *cw = w->data;
+    int rm;             /* relative month 0-2 being laid out */
+    int mo;             /* actual month 0-11 being laid out */
     int ye;             /* year corresponding to mo */
     struct tm tmt;      /* temporary time data */
-    time_t rdt;         /* representing the day we're displaying now */
-    int rdd;            /* day of the month we're displaying now */
-    int rdy;            /* line of screen for day we're displaying now */
-    int rdtoday;        /* is the day we're displaying now, today? */
-    char monyear[32];   /* buffer holding text to write: month & year */
-    chtype dayshow[2];  /* for showing the day */
+    time_t rdt;         /* representing the day we're laying out now */
+    int rdd;            /* day of the month we're laying out now */
+    int rdy;            /* line of screen for day we're laying out now */
+    int rdtoday;        /* is the day we're laying out now, today? */
     int rmx[3] = { 0, 22, 44 }; /* horizontal positions of month displays */
     int mow = 20;       /* horizontal width of a month display */
-    int y;
     size_t sz;
 
-    /* clear the area occupied by the widget */
-    for (y = w->rowmn; y <= w->rowmx; ++y) {
-        wmove(w->ww, y, 0);
-        wclrtoeol(w->ww);
-    }
-
-    /* draw the three months */
+    cw->ndays = 0;
     for (rm = 0; rm < 3; ++rm) {
         /* figure out actual month and year for this month display */
         mo = tm->tm_mon + rm - 1;
@@ -431,17 +648,15 @@ static void cal_widget_redraw(struct widget *w, time_t t, struct tm *tm,
         rdt = mktime(&tmt);
         rdy = w->rowmn + 2;
 
-        /* display the month and year header line, centered */
-        sz = strftime(monyear, sizeof(monyear), "%B %Y", &tmt);
-        mvwaddstr(w->ww, w->rowmn, rmx[rm] + ((mow - sz) >> 1), monyear);
+        /* the month and year header line, centered */
+        sz = strftime(cw->hdr[rm].monyear, sizeof(cw->hdr[rm].monyear),
+                      "%B %Y", &tmt);
+        cw->hdr[rm].x = rmx[rm] + ((mow - sz) >> 1);
 
-        /* display a day of the week guide on the next line */
-        mvwaddstr(w->ww, w->rowmn + 1, rmx[rm], "Su Mo Tu We Th Fr Sa");
-
-        /* display days of the month until we run out of days */
+        /* days of the month until we run out of days */
         for (;;) {
             /* get info about this day */
-            localtime_r(&rdt, &tmt);
+            stats_localtime(&rdt, &tmt);
             rdtoday = (tmt.tm_year == tm->tm_year &&
                        tmt.tm_yday == tm->tm_yday);
 
@@ -449,43 +664,77 @@ static void cal_widget_redraw(struct widget *w, time_t t, struct tm *tm,
             if (tmt.tm_mday < rdd) {
                 /* new month, this one is done */
                 dbgf(("Month '%s' ends: has no day %d",
-                      monyear, (int)rdd));
+                      cw->hdr[rm].monyear, (int)rdd));
                 break;
             }
             if (tmt.tm_wday == 0 && rdd != 1) {
                 /* new week, new line on the screen */
                 rdy += 1;
             }
-            if (rdy > w->rowmx) {
+            if (rdy > w->rowmx || cw->ndays >= 3 * 31) {
                 /* out of space, this month must be done */
                 dbgf(("Month '%s' ends: out of weeks at day %d",
-                      monyear, (int)rdd));
+                      cw->hdr[rm].monyear, (int)rdd));
                 break;
             }
 
-            /* display the day info in the appropriate place */
+            /* the day info, for the appropriate place */
             dbgf(("Month '%s' day %d: y=%d x=%d highlight=%s",
-                  monyear, (int)rdd, (int)rdy, (int)(rmx[rm] + tmt.tm_wday * 3),
+                  cw->hdr[rm].monyear, (int)rdd, (int)rdy,
+                  (int)(rmx[rm] + tmt.tm_wday * 3),
                   rdtoday ? "yes" : "no"));
-            wmove(w->ww, rdy, rmx[rm] + tmt.tm_wday * 3);
+            cw->days[cw->ndays].y = rdy;
+            cw->days[cw->ndays].x = rmx[rm] + tmt.tm_wday * 3;
             if (tmt.tm_mday < 10) {
-                dayshow[0] = ' ';
+                cw->days[cw->ndays].show[0] = ' ';
             } else {
-                dayshow[0] = '0' + (tmt.tm_mday / 10);
+                cw->days[cw->ndays].show[0] = '0' + (tmt.tm_mday / 10);
             }
-            dayshow[1] = '0' + (tmt.tm_mday % 10);
+            cw->days[cw->ndays].show[1] = '0' + (tmt.tm_mday % 10);
             if (rdtoday) {
-                dayshow[0] |= WA_STANDOUT;
-                dayshow[1] |= WA_STANDOUT;
+                cw->days[cw->ndays].show[0] |= WA_STANDOUT;
+                cw->days[cw->ndays].show[1] |= WA_STANDOUT;
             }
-            waddch(w->ww, dayshow[0]);
-            waddch(w->ww, dayshow[1]);
+            cw->ndays++;
 
             /* next day */
             rdd++;
             rdt += 86400;
         }
     }
+    cw->year = tm->tm_year;
+    cw->yday = tm->tm_yday;
+    cw->valid = 1;
+}
+
+static void cal_widget_redraw(struct widget *w, time_t t, struct tm *tm,
+                              int faked_time)
+{
+    struct cal_widget *cw = w->data;
+    int rmx[3] = { 0, 22, 44 }; /* horizontal positions of month displays */
+    int rm, y, i;
+
+    /* work out what to draw, once for all the screens */
+    if (!cw->valid || cw->year != tm->tm_year || cw->yday != tm->tm_yday) {
+        cal_widget_layout(w, tm);
+    }
+
+    /* clear the area occupied by the widget */
+    for (y = w->rowmn; y <= w->rowmx; ++y) {
+        wmove(w->ww, y, 0);
+        wclrtoeol(w->ww);
+    }
+
+    /* draw the three months: header, day of the week guide, and days */
+    for (rm = 0; rm < 3; ++rm) {
+        mvwaddstr(w->ww, w->rowmn, cw->hdr[rm].x, cw->hdr[rm].monyear);
+        mvwaddstr(w->ww, w->rowmn + 1, rmx[rm], "Su Mo Tu We Th Fr Sa");
+    }
+    for (i = 0; i < cw->ndays; ++i) {
+        wmove(w->ww, cw->days[i].y, cw->days[i].x);
+        waddch(w->ww, cw->days[i].show[0]);
+        waddch(w->ww, cw->days[i].show[1]);
+    }
 
     /* Example from 'cal' of the kind of output being imitated:
               May 2020             June 2020             July 2020
@@ -506,6 +755,7 @@ static void cal_widget_init(struct widget *w, WINDOW *ww, int *row)
     w->change_by = &cal_widget_change_by;
     w->redraw = &cal_widget_redraw;
     w->name = "cal";
+    w->data = calloc(1, sizeof(struct cal_widget));
 }
 
 /* Calculate the time to the next change, calling all widgets'
@@ -542,7 +792,7 @@ time_t calculate_next_change(time_t tnow, struct widget *widgets,
         dbgf(("    tmin=%lu tmax=%lu (j=%d)",
               (unsigned long)tmin,
               (unsigned long)tmax, (int)j));
-        localtime_r(&tmax, &tm);
+        stats_localtime(&tmax, &tm);
         for (i = 0; i < num_widgets; ++i) {
             if (widgets[i].change_by(&(widgets[i]), tmax, &tm)) {
                 break; /* this one changed */
@@ -579,7 +829,7 @@ time_t calculate_next_change(time_t tnow, struct widget *widgets,
         }
 
         /* has it changed by tmid? */
-        localtime_r(&tmid, &tm);
+        stats_localtime(&tmid, &tm);
         for (i = 0; i < num_widgets; ++i) {
             if (widgets[i].change_by(&(widgets[i]), tmid, &tm)) {
                 break; /* this one changed */
@@ -597,6 +847,55 @@ time_t calculate_next_change(time_t tnow, struct widget *widgets,
     return(tmax);
 }
 
+/* Write out the -S statistics: "key value" lines.  It's written to a
+ * temporary file and renamed, so a reader never sees part of one.
+ */
+static void stats_write(struct widget *widgets, int num_widgets)
+{
+    char tmp[1024];
+    FILE *fp;
+    int i;
+
+    if (stats == NULL) {
+        return;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.tmp", stats);
+    if ((fp = fopen(tmp, "w")) == NULL) {
+        dbgf(("%s: %s", tmp, strerror(errno)));
+        return;
+    }
+    fprintf(fp, "tty-clock\n"
+            "pid %d\n"
+            "wake_key %lu\n"
+            "wake_timeout %lu\n"
+            "wake_early %lu\n"
+            "draw_all %lu\n"
+            "refreshes %lu\n"
+            "out_bytes %lld\n"
+            "localtime_calls %lu\n"
+            "localtime_us %.0f\n"
+            "next_change_calls %lu\n"
+            "next_change_us %.0f\n"
+            "late_max_us %.0f\n",
+            (int)getpid(), counts.wake_key, counts.wake_timeout,
+            counts.wake_early, counts.draw_all, counts.refreshes,
+            counts.out_bytes, counts.lt_calls, counts.lt_sec * 1e+6,
+            counts.cnc_calls, counts.cnc_sec * 1e+6, counts.late_max * 1e+6);
+    for (i = 0; i < num_widgets; ++i) {
+        fprintf(fp, "redraws_%s %lu\n", widgets[i].name, widgets[i].redraws);
+    }
+    if (num_screens > 1) {
+        fprintf(fp, "screens %d\n", num_screens);
+        for (i = 0; i < num_screens; ++i) {
+            fprintf(fp, "out_bytes_%d %lld\n", i, screens[i].out_bytes);
+        }
+    }
+    if (fclose(fp) != 0 || rename(tmp, stats) < 0) {
+        dbgf(("%s: %s", stats, strerror(errno)));
+        unlink(tmp);
+    }
+}
+
 #ifdef CNCTEST
 /* tester for calculate_next_change(): time t, should change at ct */
 static int cnctest_cb(struct widget *w, time_t t, struct tm *tm)
@@ -671,23 +970,29 @@ static void ftctest(struct fake_time_control *ftc)
 
 int main(int argc, char **argv)
 {
-    int oc, row, num_widgets, ch, i;
+    int oc, row, num_widgets, ch, i, j, maxfd;
     struct widget widgets[3], *w;
+    int changed[3];         /* which widgets change this time */
+    struct screen *scr;
     int opt_12h = 0, opt_nosec = 0, opt_halftone = 0;
     int opt_noban = 0, opt_nocal = 0, opt_nodate = 0;
-    WINDOW *ww;
     struct fake_time_control fake_time; /* see -o, -r options */
     struct timeval tlast;   /* time shown by last display update */
     time_t tnext;           /* next time we'll redraw */
     struct timeval tnow;    /* present time */
     struct timeval treal;   /* present time - real */
-    struct timeval dly;     /* time to wait */
+    struct timespec dly;    /* time to wait */
     struct tm tnow_d;       /* details of tnow */
-    int draw_all = 1;       /* forces (re)drawing of whole display */
+    int draw_all = 1;       /* (re)drawing some screen's whole display */
     int waited = 1;         /* waited since last drawing? */
     int every_second = 0;   /* display changes every second */
+    int woke = 0;           /* woke up from a delay, not for a key */
+    double t0;
     fd_set rfds;
-    char tsbuf[64], tsbuf2[64];
+    char tsbuf[64], tsbuf2[64], *cp;
+    struct sigaction sa;
+    sigset_t sigs, waitsigs;
+    long long out;
 
     /* initial initialization */
 
@@ -709,7 +1014,7 @@ int main(int argc, char **argv)
 
     /* parse the command line options */
 
-    while ((oc = getopt(argc, argv, "r:o:hsbcdHD:")) >= 0) {
+    while ((oc = getopt(argc, argv, "r:o:hsbcdHD:S:T:")) >= 0) {
         switch (oc) {
         case 'r': /* -r num -- time rate */
             fake_time.enable = 1;
@@ -763,6 +1068,23 @@ int main(int argc, char **argv)
             dbgf(("Starting: %s\n",
                   dbg_timestamp(tsbuf, sizeof(tsbuf), &fake_time.orig)));
             break;
+        case 'S': /* -S file -- statistics, on SIGUSR1 & at exit */
+            stats = optarg;
+            break;
+        case 'T': /* -T [type:]device -- a terminal to display on */
+            if (num_screens >= MAX_SCREENS) {
+                fprintf(stderr, "%s: Too many terminals, limit is %d.\n",
+                        progname, (int)MAX_SCREENS);
+                usage();
+            }
+            scr = &(screens[num_screens++]);
+            scr->dev = optarg;
+            if (optarg[0] != '/' && (cp = strchr(optarg, ':')) != NULL) {
+                *cp = '\0';
+                scr->type = optarg;
+                scr->dev = cp + 1;
+            }
+            break;
         default:
             fprintf(stderr, "%s: Invalid option flag.\n", progname);
             usage();
@@ -788,38 +1110,52 @@ int main(int argc, char **argv)
 
     dbgf(("Command line options parsed."));
 
+    sigprocmask(SIG_BLOCK, NULL, &waitsigs);
+    if (stats != NULL) {
+        /* Catch SIGUSR1 to write statistics, and the usual ways of
+         * ending the program to write them at exit.  Without SA_RESTART,
+         * so they cut short the wait in pselect().  Done before initscr()
+         * so curses leaves them alone.  They're blocked except during
+         * that wait, so one that comes just after the flags are checked
+         * isn't left until the wait times out.
+         */
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = &stats_signal;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGUSR1, &sa, NULL);
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        sigaction(SIGHUP, &sa, NULL);
+        sigemptyset(&sigs);
+        sigaddset(&sigs, SIGUSR1);
+        sigaddset(&sigs, SIGINT);
+        sigaddset(&sigs, SIGTERM);
+        sigaddset(&sigs, SIGHUP);
+        sigprocmask(SIG_BLOCK, &sigs, NULL);
+    }
+
     /* initialize curses display */
 
     setlocale(LC_ALL, "");
-    ww = initscr();
-#ifdef RAW
-    raw();
-#else
-    cbreak();
-#endif
-    noecho();
-    nonl();
-    intrflush(stdscr, FALSE);
-    nodelay(stdscr, TRUE);
-    keypad(stdscr, TRUE);
+    screens_open();
 
     /* build the widgets */
 
     row = num_widgets = 0;
     if (!opt_nodate) {
         /* single line like the output of "date" */
-        date_widget_init(&(widgets[num_widgets++]), ww, &row,
+        date_widget_init(&(widgets[num_widgets++]), screens[0].ww, &row,
                          opt_nosec, opt_12h);
     }
     if (!opt_noban) {
         /* banner-sized time display */
-        banner_widget_init(&(widgets[num_widgets++]), ww, &row,
+        banner_widget_init(&(widgets[num_widgets++]), screens[0].ww, &row,
                            opt_nosec, opt_12h, opt_halftone,
                            &banner_widget_font_1);
     }
     if (!opt_nocal) {
         /* three month calendar */
-        cal_widget_init(&(widgets[num_widgets++]), ww, &row);
+        cal_widget_init(&(widgets[num_widgets++]), screens[0].ww, &row);
     }
 
     /* does any widget lack a change_by handler & thus update every second? */
@@ -835,49 +1171,66 @@ int main(int argc, char **argv)
     for (;;) {
         dbgf(("Top of event loop"));
 
+        if (quit_due) {
+            dbgf(("    signal: end program"));
+            screens_end(num_screens);
+            stats_write(widgets, num_widgets);
+            return(0);
+        }
+        if (stats_due) {
+            dbgf(("    signal: write statistics"));
+            stats_due = 0;
+            stats_write(widgets, num_widgets);
+        }
+
         /* See if there are any interesting keys typed on the keyboard */
-        while ((ch = getch()) != ERR) {
-            /* key pressed, see what interesting thing happens */
-            /* keys recognized:
-             *      ^C, q - end program
-             *      ^L - redraw screen
-             */
-            dbgf(("    keypress: %d\n", (int)ch));
-            switch (ch) {
-            case 12:                /* ^L - redraw screen */
-            case KEY_NPAGE:
-            case KEY_CLEAR:
-                dbgf(("    key action: redraw screen"));
-                draw_all = 1;   
-                break;
+        for (j = 0; j < num_screens; ++j) {
+            scr = &(screens[j]);
+            screen_select(scr);
+            while ((ch = wgetch(scr->ww)) != ERR) {
+                /* key pressed, see what interesting thing happens */
+                /* keys recognized:
+                 *      ^C, q - end program
+                 *      ^L - redraw screen
+                 */
+                dbgf(("    keypress: %d\n", (int)ch));
+                switch (ch) {
+                case 12:                /* ^L - redraw screen */
+                case KEY_NPAGE:
+                case KEY_CLEAR:
+                    dbgf(("    key action: redraw screen %d", j));
+                    scr->draw_all = draw_all = 1;
+                    break;
 #ifdef RAW
-            case 3:                 /* ^C, q - end program */
-            case KEY_BREAK:
+                case 3:                 /* ^C, q - end program */
+                case KEY_BREAK:
 #endif /* RAW */
-            case 'q':
-            case 'Q':
-                dbgf(("    key action: end program"));
-                endwin();
-                return(0);
-                break;
+                case 'q':
+                case 'Q':
+                    dbgf(("    key action: end program"));
+                    screens_end(num_screens);
+                    stats_write(widgets, num_widgets);
+                    return(0);
+                    break;
 #ifdef RAW
-            case 26:                /* ^Z - suspend program */
-            case KEY_SUSPEND:
-                dbgf(("    key action: suspend program"));
-                raise(SIGSTOP);
-                break;
+                case 26:                /* ^Z - suspend program */
+                case KEY_SUSPEND:
+                    dbgf(("    key action: suspend program"));
+                    raise(SIGSTOP);
+                    break;
 #endif /* RAW */
-            default:
-                /* ignore unrecognized keys */
-                dbgf(("    key action: ignored (unrecognized)"));
-                break;
+                default:
+                    /* ignore unrecognized keys */
+                    dbgf(("    key action: ignored (unrecognized)"));
+                    break;
+                }
             }
         }
-        
+
         /* Find out what time it is & what time we're going to display */
 
         if (gettimeofday(&tnow, NULL) < 0) {
-            endwin();
+            screens_end(num_screens);
             perror("gettimeofday");
             return(1);
         }
@@ -893,11 +1246,14 @@ int main(int argc, char **argv)
                   dbg_timestamp(tsbuf, sizeof(tsbuf), &tnow)));
         }
 
-        localtime_r(&tnow.tv_sec, &tnow_d);
+        stats_localtime(&tnow.tv_sec, &tnow_d);
 
         /* Is it time to change any part of the display? */
         if (tnow.tv_sec < tlast.tv_sec) {
             dbgf(("time went backwards, redrawing everything"));
+            for (j = 0; j < num_screens; ++j) {
+                screens[j].draw_all = 1;
+            }
             draw_all = 1;
         }
 
@@ -905,6 +1261,11 @@ int main(int argc, char **argv)
             /* Nope.  Wait until it is */
             double delay;
 
+            if (woke) {
+                ++counts.wake_early;
+                woke = 0;
+            }
+
             delay = tnext - tnow.tv_sec - (((double)tnow.tv_usec) * 1e-6);
             if (fake_time.enable) {
                 if (fake_time.scale < 1e-6) {
@@ -916,47 +1277,98 @@ int main(int argc, char **argv)
             }
 
             dly.tv_sec = floor(delay);
-            dly.tv_usec = rint((delay - dly.tv_sec) * 1e+6);
+            dly.tv_nsec = rint((delay - dly.tv_sec) * 1e+6) * 1000;
             if (dly.tv_sec < 0) {
-                dly.tv_sec = dly.tv_usec = 0; /* don't do negative delay */
+                dly.tv_sec = dly.tv_nsec = 0; /* don't do negative delay */
             }
-            if (dly.tv_sec == 0 && dly.tv_usec < MIN_DELAY_USEC) {
-                dly.tv_usec = MIN_DELAY_USEC; /* don't do super short delay */
+            if (dly.tv_sec == 0 && dly.tv_nsec < MIN_DELAY_USEC * 1000L) {
+                /* don't do super short delay */
+                dly.tv_nsec = MIN_DELAY_USEC * 1000L;
             }
             if (dly.tv_sec >= MAX_DELAY_SEC) {
                 dly.tv_sec = MAX_DELAY_SEC; /* don't do super long delay */
-                dly.tv_usec = 0;
+                dly.tv_nsec = 0;
             }
             dbgf(("waiting %u.%06lu seconds unless keypress comes in",
-                  (unsigned)dly.tv_sec, (unsigned long)dly.tv_usec));
+                  (unsigned)dly.tv_sec, (unsigned long)dly.tv_nsec / 1000));
             FD_ZERO(&rfds);
-            FD_SET(STDIN_FILENO, &rfds);
-            select(STDIN_FILENO + 1, &rfds, NULL, NULL, &dly);
+            maxfd = 0;
+            for (j = 0; j < num_screens; ++j) {
+                FD_SET(screens[j].fd, &rfds);
+                if (screens[j].fd > maxfd) {
+                    maxfd = screens[j].fd;
+                }
+            }
+            if (pselect(maxfd + 1, &rfds, NULL, NULL, &dly, &waitsigs) > 0) {
+                ++counts.wake_key;
+            } else {
+                woke = 1; /* timed out or signal; which shows up later */
+            }
             waited = 1;
             continue;
         }
 
         /* Figure out what it's time to redraw, and do so */
-        if (draw_all) {
-            wclear(ww);
+        if (woke) {
+            ++counts.wake_timeout;
+            woke = 0;
+        }
+        if (stats != NULL && !draw_all && tnext > 0) {
+            /* how late is it, after the time it was supposed to change? */
+            double late = tnow.tv_sec - tnext + tnow.tv_usec * 1e-6;
+
+            if (late > counts.late_max) {
+                counts.late_max = late;
+            }
         }
         for (i = 0; i < num_widgets; ++i) {
             w = &(widgets[i]);
-            if (draw_all ||
+            changed[i] =
                 (w->change_by == NULL && w->last_drawn != tnow.tv_sec) ||
-                (w->change_by && w->change_by(w, tnow.tv_sec, &tnow_d))) {
-
-                dbgf(("    redrawing widget %d '%s'", (int)i, w->name));
-                w->redraw(w, tnow.tv_sec, &tnow_d, fake_time.enable);
+                (w->change_by && w->change_by(w, tnow.tv_sec, &tnow_d));
+        }
+        for (j = 0; j < num_screens; ++j) {
+            scr = &(screens[j]);
+            screen_select(scr);
+            if (scr->draw_all) {
+                wclear(scr->ww);
+                ++counts.draw_all;
+            }
+            for (i = 0; i < num_widgets; ++i) {
+                w = &(widgets[i]);
+                if (scr->draw_all || changed[i]) {
+                    dbgf(("    redrawing widget %d '%s' on screen %d",
+                          (int)i, w->name, j));
+                    w->ww = scr->ww;
+                    w->redraw(w, tnow.tv_sec, &tnow_d, fake_time.enable);
+                }
+            }
+            out = stats_output(&refresh);
+            if (out < 0 || scr->out_bytes < 0) {
+                scr->out_bytes = -1;
+            } else {
+                scr->out_bytes += out;
+            }
+            ++counts.refreshes;
+            scr->draw_all = 0;
+        }
+        for (i = 0; i < num_widgets; ++i) {
+            w = &(widgets[i]);
+            if (draw_all || changed[i]) {
                 w->last_drawn = tnow.tv_sec;
+                ++w->redraws;
                 w->last_drawn_d = tnow_d;
             }
         }
-        refresh();
 
         /* Figure out when is the next time we'll need to redraw anything */
         if (every_second) {
             tnext = tnow.tv_sec + 1;
+        } else if (stats != NULL) {
+            t0 = stats_clock();
+            tnext = calculate_next_change(tnow.tv_sec, widgets, num_widgets);
+            counts.cnc_sec += stats_clock() - t0;
+            ++counts.cnc_calls;
         } else {
             tnext = calculate_next_change(tnow.tv_sec, widgets, num_widgets);
         }
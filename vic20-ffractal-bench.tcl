@@ -0,0 +1,207 @@
+#!/usr/bin/tclsh
+# vic20-ffractal-bench.tcl - cycle count benchmark of vic20-ffractal's 'draw'
+#
+# Runs a built vic20-ffractal.prg in the VICE emulator (warp mode) and
+# drives it through VICE's remote monitor.  For every combination of the
+# three "rules" (selectNW, selectNE, selectSW; 8 values each, so 512
+# in all) it sets the rules in memory, runs 'draw' from main_loop__draw
+# to the breakpoint at main_loop, reads the cycle count off the monitor's
+# stopwatch, and saves the bitmap.  Addresses come from the symbol table
+# in the assembler's list output, so any build configuration works.
+#
+# Writes one line per combination to the output file:
+#       config nw ne sw cycles crc
+# where crc is the CRC-32 of the 2k bitmap, followed by a "#" line with
+# the totals.  Given a reference file in the same format (e.g. the output
+# from a known good build), the bitmaps are checked against it and the
+# program exits with status 1 if any differ.
+#
+# Cycle counts include the time spent in interrupt handlers while
+# 'draw' runs, as they would on the real machine.
+
+proc usage {} {
+    puts stderr "Usage: tclsh vic20-ffractal-bench.tcl \[options\]"
+    puts stderr "Options:"
+    puts stderr "\tprg= program to run (required)"
+    puts stderr "\tlst= assembler list output, for symbols (required)"
+    puts stderr "\temu= emulator command, def xvic"
+    puts stderr "\tconfig= name of the build configuration, def \"default\""
+    puts stderr "\tout= file to append results to, def stdout"
+    puts stderr "\tref= reference results to compare bitmaps against"
+    puts stderr "\tdumps= directory to keep the bitmaps in"
+    puts stderr "\tport= TCP port for the remote monitor, def 6510"
+    puts stderr "\ttimeout= seconds to wait for the emulator, def 60"
+    exit 1
+}
+
+# read command line parameters into array $parm()
+array set parm {
+    prg "" lst "" emu "xvic" config "default" out "" ref "" dumps ""
+    port 6510 timeout 60
+}
+
+foreach arg $argv {
+    set i [string first = $arg]
+    set ap0 [string range $arg 0 [expr {$i - 1}]]
+    set ap1 [string range $arg [expr {$i + 1}] end]
+    if {$i < 0 || ![info exists parm($ap0)] ||
+        ($ap0 in {port timeout} && ![string is integer -strict $ap1])} {
+        puts stderr "Invalid parameter $arg"
+        usage
+    }
+    set parm($ap0) $ap1
+}
+if {$parm(prg) eq "" || $parm(lst) eq ""} {
+    usage
+}
+
+# symbol - look up a symbol's value in the list output.  crasm's symbol
+# table has lines like "1800   Abs BITMAP"; be lenient about the layout.
+set fp [open $parm(lst) r]
+set lst [read $fp]
+close $fp
+proc symbol {name} {
+    global lst parm
+    foreach re [list "(?i)(\[0-9a-f\]{1,4})\\s+Abs\\s+$name\\M" \
+                    "(?i)Abs\\s+$name\\s+=?\\$?(\[0-9a-f\]{1,4})\\M"] {
+        if {[regexp $re $lst -> v]} {
+            return [scan $v %x]
+        }
+    }
+    error "Symbol $name not found in $parm(lst)"
+}
+foreach s {main_loop main_loop__draw selectNW selectNE selectSW bitmap} {
+    set sym($s) [symbol $s]
+}
+
+# start the emulator, and connect to its remote monitor
+set emu [exec {*}$parm(emu) -default -warp +sound \
+             -remotemonitor \
+             -remotemonitoraddress ip4://127.0.0.1:$parm(port) \
+             -autostart [file normalize $parm(prg)] >@ stderr 2>@ stderr &]
+set t0 [clock seconds]
+while {[catch {socket 127.0.0.1 $parm(port)} sock]} {
+    if {[clock seconds] - $t0 > $parm(timeout)} {
+        catch {exec kill $emu}
+        error "Emulator's remote monitor didn't come up: $sock"
+    }
+    after 100
+}
+fconfigure $sock -blocking 0 -buffering none -translation binary
+
+# mon - send a monitor command and return what it says, up to the
+# next prompt (which looks like "(C:$1234) ").
+proc mon {cmd} {
+    global sock parm emu
+    if {$cmd ne ""} {
+        puts -nonewline $sock "$cmd\n"
+    }
+    set got ""
+    set t0 [clock seconds]
+    while {![regexp {\(C:\$[0-9a-f]{4}\) $} $got]} {
+        append got [read $sock]
+        if {[eof $sock]} {
+            error "Emulator went away during \"$cmd\""
+        }
+        if {[clock seconds] - $t0 > $parm(timeout)} {
+            catch {exec kill $emu}
+            error "Timed out during \"$cmd\": $got"
+        }
+        after 1
+    }
+    return [regsub {\(C:\$[0-9a-f]{4}\) $} $got ""]
+}
+
+# read the reference results, if any, as crc by "config nw ne sw"
+set ref [dict create]
+if {$parm(ref) ne "" && [file exists $parm(ref)]} {
+    set fp [open $parm(ref) r]
+    while {[gets $fp line] >= 0} {
+        if {[string index $line 0] ne "#" && [llength $line] == 6} {
+            dict set ref [lrange $line 0 3] [lindex $line 5]
+        }
+    }
+    close $fp
+}
+if {$parm(dumps) ne ""} {
+    file mkdir $parm(dumps)
+    set dumps [file normalize $parm(dumps)]
+} else {
+    set dumps [pwd]
+}
+
+# Let the program start up and draw its first fractal, and stop it there.
+# (Sending a command stops the emulator & enters the monitor; "g" leaves.)
+mon [format {break exec $%04x} $sym(main_loop)]
+puts -nonewline $sock "g\n"
+mon ""
+
+# Now try each combination of rules.
+if {$parm(out) ne ""} {
+    set out [open $parm(out) a]
+} else {
+    set out stdout
+}
+set total 0
+set mn ""
+set mx 0
+set bad 0
+set n 0
+for {set nw 0} {$nw < 8} {incr nw} {
+    for {set ne 0} {$ne < 8} {incr ne} {
+        for {set sw 0} {$sw < 8} {incr sw} {
+            # set the rules, the same codes main_loop stores for a key
+            mon [format {> $%04x $%02x} $sym(selectNW) $nw]
+            mon [format {> $%04x $%02x} $sym(selectNE) [expr {$ne + 8}]]
+            mon [format {> $%04x $%02x} $sym(selectSW) [expr {$sw + 16}]]
+
+            # run 'draw' and time it
+            mon [format {r pc = $%04x} $sym(main_loop__draw)]
+            mon "sw reset"
+            puts -nonewline $sock "g\n"
+            mon ""
+            if {![regexp {([0-9]+)} [mon "sw"] -> cycles]} {
+                error "Can't read stopwatch for $nw $ne $sw"
+            }
+            set cycles [scan $cycles %d]
+
+            # save the bitmap & checksum it
+            set fn [file join $dumps \
+                        [format "%s-%d%d%d.bin" $parm(config) $nw $ne $sw]]
+            mon [format {bsave "%s" 0 $%04x $%04x} $fn \
+                     $sym(bitmap) [expr {$sym(bitmap) + 2047}]]
+            set fp [open $fn r]
+            fconfigure $fp -translation binary
+            set crc [format %08x [zlib crc32 [read $fp]]]
+            close $fp
+            if {$parm(dumps) eq ""} {
+                file delete $fn
+            }
+
+            set key [list $parm(config) $nw $ne $sw]
+            if {[dict exists $ref $key] && [dict get $ref $key] ne $crc} {
+                puts stderr "vic20-ffractal-bench: $key: bitmap differs"
+                incr bad
+            }
+            puts $out "$key $cycles $crc"
+            incr total $cycles
+            incr n
+            if {$mn eq "" || $cycles < $mn} { set mn $cycles }
+            if {$cycles > $mx} { set mx $cycles }
+        }
+    }
+}
+
+set summary [format "# %s: %d draws, total %d cycles, mean %.0f, min %d,\
+                     max %d, bitmaps differing %s" \
+                 $parm(config) $n $total [expr {double($total) / $n}] \
+                 $mn $mx [expr {[dict size $ref] ? $bad : "-"}]]
+puts $out $summary
+if {$out ne "stdout"} {
+    close $out
+    puts $summary
+}
+
+catch {mon "quit"}
+close $sock
+exit [expr {$bad ? 1 : 0}]
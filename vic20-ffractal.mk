@@ -4,12 +4,27 @@
 #       vic20-ffractal.prg -- compiled program in PRG format
 #       vic20-ffractal.d64 -- 1540/1541 floppy disk image containing it
 #       vic20-ffractal.lst -- list output from the assembler (for debugging)
+# Other targets:
+#       bench -- for each configuration in BENCH_CONFIGS (values of
+#           config_exp), assemble a copy of the program and run it in VICE
+#           under vic20-ffractal-bench.tcl, which times 'draw' for every
+#           combination of rules.  Results, per draw and totals, go to
+#           vic20-ffractal-bench.txt; bitmaps are checked against
+#           BENCH_REF if that exists.  For a headless run set XVIC_WRAP
+#           (e.g. to "xvfb-run -a") or use a VICE built with a headless UI.
+#       bench-ref -- store vic20-ffractal-bench.txt as BENCH_REF
 
 TCL="tclsh"
 SREC2PRG="srec2prg.tcl"
 CRASM="crasm"
 C1541="$(HOME)/pkg/vice-gtk3-3.5/bin/c1541"
 PETCAT="$(HOME)/pkg/vice-gtk3-3.5/bin/petcat"
+XVIC="$(HOME)/pkg/vice-gtk3-3.5/bin/xvic"
+X64SC="$(HOME)/pkg/vice-gtk3-3.5/bin/x64sc"
+XVIC_WRAP=
+BENCH="vic20-ffractal-bench.tcl"
+BENCH_CONFIGS=99 0 8
+BENCH_REF=vic20-ffractal-bench-ref.txt
 
 NAME=vic20-ffractal
 
@@ -41,6 +56,32 @@ $(NAME).srcprg: $(NAME).asm
 	tr 'A-Z' 'a-z' < $(NAME).asm | \
 	$(PETCAT) -w2 -o $(PWD)/$(NAME).srcprg
 
+# The emulator settings are single quoted, since vic20-ffractal-bench.tcl
+# takes them as a Tcl list, and that copes with the quotes in $(XVIC).
+bench: $(NAME).asm
+	-rm -f $(NAME)-bench.txt
+	for c in $(BENCH_CONFIGS) ; do \
+	    case $$c in \
+	        3) emu='$(XVIC) -memory 3k' ;; \
+	        8) emu='$(XVIC) -memory 8k' ;; \
+	        64) emu='$(X64SC)' ;; \
+	        *) emu='$(XVIC) -memory none' ;; \
+	    esac ; \
+	    b=$(NAME)-exp$$c ; \
+	    sed "s/^config_exp = .*/config_exp = $$c/" $(NAME).asm > $$b.asm && \
+	    $(CRASM) -o $$b.srec $$b.asm > $$b.lst ; \
+	    $(TCL) $(SREC2PRG) < $$b.srec > $$b.prg && \
+	    $(TCL) $(BENCH) prg=$$b.prg lst=$$b.lst "emu=$(XVIC_WRAP) $$emu" \
+	        config=exp$$c out=$(NAME)-bench.txt ref=$(BENCH_REF) \
+	        dumps=$(NAME)-bench-dumps || exit 1 ; \
+	done
+
+bench-ref: $(NAME)-bench.txt
+	cp $(NAME)-bench.txt $(BENCH_REF)
+
 clean:
 	-rm $(NAME).d64 $(NAME).prg $(NAME).srec $(NAME).lst $(NAME).srcprg \
 	    $(NAME).stamp
+	-rm -rf $(NAME)-exp*.* $(NAME)-bench.txt $(NAME)-bench-dumps
+
+.PHONY: bench bench-ref clean